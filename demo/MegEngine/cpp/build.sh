@@ -25,7 +25,7 @@ if [ -z $OPENCV_INSTALL_LIB_PATH ];then
     exit -1
 fi
 
-INCLUDE_FLAG="-I$MGE_INSTALL_PATH/include -I$OPENCV_INSTALL_INCLUDE_PATH"
+INCLUDE_FLAG="-I$MGE_INSTALL_PATH/include -I$OPENCV_INSTALL_INCLUDE_PATH -I../../postprocess/include"
 LINK_FLAG="-L$MGE_INSTALL_PATH/lib/ -lmegengine -L$OPENCV_INSTALL_LIB_PATH -lopencv_core -lopencv_highgui -lopencv_imgproc -lopencv_imgcodecs"
 BUILD_FLAG="-static-libstdc++ -O3 -pie -fPIE -g"
 
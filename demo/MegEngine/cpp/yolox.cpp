@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string>
 #include <vector>
+#include <yolox_postprocess.h>
 
 /**
  * @brief Define names based depends on Unicode path support
@@ -48,187 +49,20 @@ void blobFromImage(cv::Mat &img, float *blob_data) {
   }
 }
 
-struct Object {
-  cv::Rect_<float> rect;
-  int label;
-  float prob;
-};
-
-struct GridAndStride {
-  int grid0;
-  int grid1;
-  int stride;
-};
-
-static void
-generate_grids_and_stride(const int target_size, std::vector<int> &strides,
-                          std::vector<GridAndStride> &grid_strides) {
-  for (auto stride : strides) {
-    int num_grid = target_size / stride;
-    for (int g1 = 0; g1 < num_grid; g1++) {
-      for (int g0 = 0; g0 < num_grid; g0++) {
-        grid_strides.push_back((GridAndStride){g0, g1, stride});
-      }
-    }
-  }
-}
-
-static void generate_yolox_proposals(std::vector<GridAndStride> grid_strides,
-                                     const float *feat_ptr,
-                                     float prob_threshold,
-                                     std::vector<Object> &objects) {
-  const int num_class = 80;
-  const int num_anchors = grid_strides.size();
-
-  for (int anchor_idx = 0; anchor_idx < num_anchors; anchor_idx++) {
-    const int grid0 = grid_strides[anchor_idx].grid0;
-    const int grid1 = grid_strides[anchor_idx].grid1;
-    const int stride = grid_strides[anchor_idx].stride;
-
-    const int basic_pos = anchor_idx * 85;
-
-    float x_center = (feat_ptr[basic_pos + 0] + grid0) * stride;
-    float y_center = (feat_ptr[basic_pos + 1] + grid1) * stride;
-    float w = exp(feat_ptr[basic_pos + 2]) * stride;
-    float h = exp(feat_ptr[basic_pos + 3]) * stride;
-    float x0 = x_center - w * 0.5f;
-    float y0 = y_center - h * 0.5f;
-
-    float box_objectness = feat_ptr[basic_pos + 4];
-    for (int class_idx = 0; class_idx < num_class; class_idx++) {
-      float box_cls_score = feat_ptr[basic_pos + 5 + class_idx];
-      float box_prob = box_objectness * box_cls_score;
-      if (box_prob > prob_threshold) {
-        Object obj;
-        obj.rect.x = x0;
-        obj.rect.y = y0;
-        obj.rect.width = w;
-        obj.rect.height = h;
-        obj.label = class_idx;
-        obj.prob = box_prob;
-
-        objects.push_back(obj);
-      }
-
-    } // class loop
-
-  } // point anchor loop
-}
-
-static inline float intersection_area(const Object &a, const Object &b) {
-  cv::Rect_<float> inter = a.rect & b.rect;
-  return inter.area();
-}
-
-static void qsort_descent_inplace(std::vector<Object> &faceobjects, int left,
-                                  int right) {
-  int i = left;
-  int j = right;
-  float p = faceobjects[(left + right) / 2].prob;
-
-  while (i <= j) {
-    while (faceobjects[i].prob > p)
-      i++;
-
-    while (faceobjects[j].prob < p)
-      j--;
-
-    if (i <= j) {
-      // swap
-      std::swap(faceobjects[i], faceobjects[j]);
-
-      i++;
-      j--;
-    }
-  }
-
-#pragma omp parallel sections
-  {
-#pragma omp section
-    {
-      if (left < j)
-        qsort_descent_inplace(faceobjects, left, j);
-    }
-#pragma omp section
-    {
-      if (i < right)
-        qsort_descent_inplace(faceobjects, i, right);
-    }
-  }
-}
-
-static void qsort_descent_inplace(std::vector<Object> &objects) {
-  if (objects.empty())
-    return;
-
-  qsort_descent_inplace(objects, 0, objects.size() - 1);
-}
-
-static void nms_sorted_bboxes(const std::vector<Object> &faceobjects,
-                              std::vector<int> &picked, float nms_threshold) {
-  picked.clear();
-
-  const int n = faceobjects.size();
-
-  std::vector<float> areas(n);
-  for (int i = 0; i < n; i++) {
-    areas[i] = faceobjects[i].rect.area();
-  }
-
-  for (int i = 0; i < n; i++) {
-    const Object &a = faceobjects[i];
-
-    int keep = 1;
-    for (int j = 0; j < (int)picked.size(); j++) {
-      const Object &b = faceobjects[picked[j]];
-
-      // intersection over union
-      float inter_area = intersection_area(a, b);
-      float union_area = areas[i] + areas[picked[j]] - inter_area;
-      // float IoU = inter_area / union_area
-      if (inter_area / union_area > nms_threshold)
-        keep = 0;
-    }
-
-    if (keep)
-      picked.push_back(i);
-  }
-}
+// decoding, NMS and the mapping back to the image live in demo/postprocess
+typedef yolox::Object<false> Object;
 
-static void decode_outputs(const float *prob, std::vector<Object> &objects,
+// num_anchors and num_channels are the last two output dimensions, the anchor
+// count of the input size and 5 + the number of classes
+static void decode_outputs(const float *prob, int num_anchors,
+                           int num_channels, std::vector<Object> &objects,
                            float scale, const int img_w, const int img_h) {
-  std::vector<Object> proposals;
-  std::vector<int> strides = {8, 16, 32};
-  std::vector<GridAndStride> grid_strides;
-
-  generate_grids_and_stride(INPUT_W, strides, grid_strides);
-  generate_yolox_proposals(grid_strides, prob, BBOX_CONF_THRESH, proposals);
-  qsort_descent_inplace(proposals);
-
-  std::vector<int> picked;
-  nms_sorted_bboxes(proposals, picked, NMS_THRESH);
-  int count = picked.size();
-  objects.resize(count);
-
-  for (int i = 0; i < count; i++) {
-    objects[i] = proposals[picked[i]];
-
-    // adjust offset to original unpadded
-    float x0 = (objects[i].rect.x) / scale;
-    float y0 = (objects[i].rect.y) / scale;
-    float x1 = (objects[i].rect.x + objects[i].rect.width) / scale;
-    float y1 = (objects[i].rect.y + objects[i].rect.height) / scale;
-
-    // clip
-    x0 = std::max(std::min(x0, (float)(img_w - 1)), 0.f);
-    y0 = std::max(std::min(y0, (float)(img_h - 1)), 0.f);
-    x1 = std::max(std::min(x1, (float)(img_w - 1)), 0.f);
-    y1 = std::max(std::min(y1, (float)(img_h - 1)), 0.f);
-
-    objects[i].rect.x = x0;
-    objects[i].rect.y = y0;
-    objects[i].rect.width = x1 - x0;
-    objects[i].rect.height = y1 - y0;
+  // the anchor grid and the buffers are built on the first frame and reused
+  static yolox::Decoder<false> decoder(INPUT_W, INPUT_H);
+  if (!decoder.Decode(num_anchors, num_channels, prob, BBOX_CONF_THRESH,
+                      NMS_THRESH, scale, img_w, img_h, &objects)) {
+    std::cout << "unexpected output dimensions " << num_anchors << " x "
+              << num_channels << std::endl;
   }
 }
 
@@ -311,7 +145,10 @@ static void draw_objects(const cv::Mat &bgr,
       txt_color = cv::Scalar(255, 255, 255);
     }
 
-    cv::rectangle(image, obj.rect, color * 255, 2);
+    cv::rectangle(image,
+                  cv::Rect_<float>(obj.rect.x, obj.rect.y, obj.rect.width,
+                                   obj.rect.height),
+                  color * 255, 2);
 
     char text[256];
     sprintf(text, "%s %.1f%%", class_names[obj.label], obj.prob * 100);
@@ -463,7 +300,9 @@ int main(int argc, char *argv[]) {
       std::min(INPUT_W / (image.cols * 1.0), INPUT_H / (image.rows * 1.0));
   std::vector<Object> objects;
 
-  decode_outputs(predict_ptr, objects, scale, img_w, img_h);
+  decode_outputs(predict_ptr, predict.shape(predict.shape().ndim - 2),
+                 predict.shape(predict.shape().ndim - 1), objects, scale, img_w,
+                 img_h);
   draw_objects(image, objects);
 
   return EXIT_SUCCESS;
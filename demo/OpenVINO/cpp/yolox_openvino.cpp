@@ -9,6 +9,7 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <inference_engine.hpp>
+#include "yolox_postprocess.h"
 
 using namespace InferenceEngine;
 
@@ -23,19 +24,18 @@ using namespace InferenceEngine;
 
 static const int INPUT_W = 640;
 static const int INPUT_H = 640;
-static const int NUM_CLASSES = 6; // COCO has 80 classes. Modify this value on your own dataset.
 cv::VideoWriter videoWriter("../output.avi", cv::VideoWriter::fourcc('M', 'J', 'P', 'G'),15 ,cv::Size(1280, 768));
-cv::Mat static_resize(cv::Mat& img) {
+// resizes straight into the top left of out, which is allocated on the first
+// frame and reused after
+void static_resize(const cv::Mat& img, cv::Mat& out) {
     float r = std::min(INPUT_W / (img.cols*1.0), INPUT_H / (img.rows*1.0));
     // r = std::min(r, 1.0f);
     int unpad_w = r * img.cols;
     int unpad_h = r * img.rows;
-    cv::Mat re(unpad_h, unpad_w, CV_8UC3);
+    out.create(INPUT_H, INPUT_W, CV_8UC3);
+    out.setTo(cv::Scalar(114, 114, 114));
+    cv::Mat re = out(cv::Rect(0, 0, unpad_w, unpad_h));
     cv::resize(img, re, re.size());
-    //cv::Mat out(INPUT_W, INPUT_H, CV_8UC3, cv::Scalar(114, 114, 114));
-    cv::Mat out(INPUT_H, INPUT_W, CV_8UC3, cv::Scalar(114, 114, 114));
-    re.copyTo(out(cv::Rect(0, 0, re.cols, re.rows)));
-    return out;
 }
 
 void blobFromImage(cv::Mat& img, Blob::Ptr& blob){
@@ -67,249 +67,16 @@ void blobFromImage(cv::Mat& img, Blob::Ptr& blob){
 }
 
 
-struct Object
-{
-    cv::Rect_<float> rect;
-    cv::Point2d points[4];
-    int label;
-    float prob;
-};
-
-struct GridAndStride
-{
-    int grid0;
-    int grid1;
-    int stride;
-};
-
-static void generate_grids_and_stride(const int target_w, const int target_h, std::vector<int>& strides, std::vector<GridAndStride>& grid_strides)
-{
-    for (auto stride : strides)
-    {
-        int num_grid_w = target_w / stride;
-        int num_grid_h = target_h / stride;
-        for (int g1 = 0; g1 < num_grid_h; g1++)
-        {
-            for (int g0 = 0; g0 < num_grid_w; g0++)
-            {
-                grid_strides.push_back((GridAndStride){g0, g1, stride});
-            }
-        }
-    }
-}
-
-
-static void generate_yolox_proposals(std::vector<GridAndStride> grid_strides, const float * feat_ptr, float prob_threshold, std::vector<Object>& objects)
-{
-
-    const int num_anchors = grid_strides.size();
-
-    for (int anchor_idx = 0; anchor_idx < num_anchors; anchor_idx++)
-    {
-        const int grid0 = grid_strides[anchor_idx].grid0;
-        const int grid1 = grid_strides[anchor_idx].grid1;
-        const int stride = grid_strides[anchor_idx].stride;
-
-	//const int basic_pos = anchor_idx * (NUM_CLASSES + 5);
-        const int basic_pos = anchor_idx * (NUM_CLASSES + 13);
-
-        // yolox/models/yolo_head.py decode logic
-        //  outputs[..., :2] = (outputs[..., :2] + grids) * strides
-        //  outputs[..., 2:4] = torch.exp(outputs[..., 2:4]) * strides
-        float x_center = (feat_ptr[basic_pos + 0] + grid0) * stride;
-        float y_center = (feat_ptr[basic_pos + 1] + grid1) * stride;
-        float w = exp(feat_ptr[basic_pos + 2]) * stride;
-        float h = exp(feat_ptr[basic_pos + 3]) * stride;
-        float x1 = (feat_ptr[basic_pos + 4] + grid0) * stride;
-        float y1 = (feat_ptr[basic_pos + 5] + grid1) * stride;
-        float x2 = (feat_ptr[basic_pos + 6] + grid0) * stride;
-        float y2 = (feat_ptr[basic_pos + 7] + grid1) * stride;
-        float x3 = (feat_ptr[basic_pos + 8] + grid0) * stride;
-        float y3 = (feat_ptr[basic_pos + 9] + grid1) * stride;
-        float x4 = (feat_ptr[basic_pos + 10] + grid0) * stride;
-        float y4 = (feat_ptr[basic_pos + 11] + grid1) * stride;
-        float x0 = x_center - w * 0.5f;
-        float y0 = y_center - h * 0.5f;
-
-        float box_objectness = feat_ptr[basic_pos + 12];
-        for (int class_idx = 0; class_idx < NUM_CLASSES; class_idx++)
-        {
-            float box_cls_score = feat_ptr[basic_pos + 13 + class_idx];
-            float box_prob = box_objectness * box_cls_score;
-            if (box_prob > prob_threshold)
-            {
-                Object obj;
-                obj.rect.x = x0;
-                obj.rect.y = y0;
-                obj.rect.width = w;
-                obj.rect.height = h;
-                obj.points[0].x = x1;
-                obj.points[0].y = y1;
-                obj.points[1].x = x2;
-                obj.points[1].y = y2;
-                obj.points[2].x = x3;
-                obj.points[2].y = y3;
-                obj.points[3].x = x4;
-                obj.points[3].y = y4;
-                obj.label = class_idx;
-                obj.prob = box_prob;
-
-                objects.push_back(obj);
-            }
-
-        } // class loop
-
-    } // point anchor loop
-}
-
-static inline float intersection_area(const Object& a, const Object& b)
-{
-    cv::Rect_<float> inter = a.rect & b.rect;
-    return inter.area();
-}
-
-static void qsort_descent_inplace(std::vector<Object>& faceobjects, int left, int right)
-{
-    int i = left;
-    int j = right;
-    float p = faceobjects[(left + right) / 2].prob;
-
-    while (i <= j)
-    {
-        while (faceobjects[i].prob > p)
-            i++;
-
-        while (faceobjects[j].prob < p)
-            j--;
-
-        if (i <= j)
-        {
-            // swap
-            std::swap(faceobjects[i], faceobjects[j]);
-
-            i++;
-            j--;
-        }
-    }
+// decoding, NMS and the mapping back to the image live in demo/postprocess
+typedef yolox::Object<true> Object;
 
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            if (left < j) qsort_descent_inplace(faceobjects, left, j);
-        }
-        #pragma omp section
-        {
-            if (i < right) qsort_descent_inplace(faceobjects, i, right);
-        }
-    }
-}
-
-
-static void qsort_descent_inplace(std::vector<Object>& objects)
-{
-    if (objects.empty())
-        return;
-
-    qsort_descent_inplace(objects, 0, objects.size() - 1);
-}
-
-static void nms_sorted_bboxes(const std::vector<Object>& faceobjects, std::vector<int>& picked, float nms_threshold)
-{
-    picked.clear();
-
-    const int n = faceobjects.size();
-
-    std::vector<float> areas(n);
-    for (int i = 0; i < n; i++)
-    {
-        areas[i] = faceobjects[i].rect.area();
-    }
-
-    for (int i = 0; i < n; i++)
-    {
-        const Object& a = faceobjects[i];
-
-        int keep = 1;
-        for (int j = 0; j < (int)picked.size(); j++)
-        {
-            const Object& b = faceobjects[picked[j]];
-
-            // intersection over union
-            float inter_area = intersection_area(a, b);
-            float union_area = areas[i] + areas[picked[j]] - inter_area;
-            // float IoU = inter_area / union_area
-            if (inter_area / union_area > nms_threshold)
-                keep = 0;
-        }
-
-        if (keep)
-            picked.push_back(i);
-    }
-}
-
-
-static void decode_outputs(const float * prob, std::vector<Object>& objects, float scale, const int img_w, const int img_h) {
-        std::vector<Object> proposals;
-        std::vector<int> strides = {8, 16, 32};
-        std::vector<GridAndStride> grid_strides;
-
-        generate_grids_and_stride(INPUT_W, INPUT_H, strides, grid_strides);
-        generate_yolox_proposals(grid_strides, prob,  BBOX_CONF_THRESH, proposals);
-        qsort_descent_inplace(proposals);
-
-        std::vector<int> picked;
-        nms_sorted_bboxes(proposals, picked, NMS_THRESH);
-        int count = picked.size();
-        objects.resize(count);
-
-        for (int i = 0; i < count; i++)
-        {
-            objects[i] = proposals[picked[i]];
-
-            // adjust offset to original unpadded
-            float x0 = (objects[i].rect.x) / scale;
-            float y0 = (objects[i].rect.y) / scale;
-            float x1 = (objects[i].rect.x + objects[i].rect.width) / scale;
-            float y1 = (objects[i].rect.y + objects[i].rect.height) / scale;
-            float x_1 = (objects[i].points[0].x) / scale;
-            float y_1 = (objects[i].points[0].y) / scale;
-            float x_2 = (objects[i].points[1].x) / scale;
-            float y_2 = (objects[i].points[1].y) / scale;
-            float x_3 = (objects[i].points[2].x) / scale;
-            float y_3 = (objects[i].points[2].y) / scale;
-            float x_4 = (objects[i].points[3].x) / scale;
-            float y_4 = (objects[i].points[3].y) / scale;
-
-
-            // clip
-            x0 = std::max(std::min(x0, (float)(img_w - 1)), 0.f);
-            y0 = std::max(std::min(y0, (float)(img_h - 1)), 0.f);
-            x1 = std::max(std::min(x1, (float)(img_w - 1)), 0.f);
-            y1 = std::max(std::min(y1, (float)(img_h - 1)), 0.f);
-            x_1 = std::max(std::min(x_1, (float)(img_w - 1)), 0.f);
-            y_1 = std::max(std::min(y_1, (float)(img_h - 1)), 0.f);
-            x_2 = std::max(std::min(x_2, (float)(img_w - 1)), 0.f);
-            y_2 = std::max(std::min(y_2, (float)(img_h - 1)), 0.f);
-            x_3 = std::max(std::min(x_3, (float)(img_w - 1)), 0.f);
-            y_3 = std::max(std::min(y_3, (float)(img_h - 1)), 0.f);
-            x_4 = std::max(std::min(x_4, (float)(img_w - 1)), 0.f);
-            y_4 = std::max(std::min(y_4, (float)(img_h - 1)), 0.f);
-
-            objects[i].rect.x = x0;
-            objects[i].rect.y = y0;
-            objects[i].rect.width = x1 - x0;
-            objects[i].rect.height = y1 - y0;
-            objects[i].points[0].x = x_1;
-            objects[i].points[0].y = y_1;
-            objects[i].points[1].x = x_2;
-            objects[i].points[1].y = y_2;
-            objects[i].points[2].x = x_3;
-            objects[i].points[2].y = y_3;
-            objects[i].points[3].x = x_4;
-            objects[i].points[3].y = y_4;
-
-        }
+// num_anchors and num_channels are the last two output dimensions, the anchor count of the
+// input size and 13 + the number of classes
+static void decode_outputs(const float * prob, int num_anchors, int num_channels, std::vector<Object>& objects, float scale, const int img_w, const int img_h) {
+        // the anchor grid and the buffers are built on the first frame and reused
+        static yolox::Decoder<true> decoder(INPUT_W, INPUT_H);
+        if (!decoder.Decode(num_anchors, num_channels, prob, BBOX_CONF_THRESH, NMS_THRESH, scale, img_w, img_h, &objects))
+            throw std::logic_error("unexpected output dimensions " + std::to_string(num_anchors) + " x " + std::to_string(num_channels));
 }
 
 const float color_list[80][3] =
@@ -396,7 +163,8 @@ const float color_list[80][3] =
     {0.50, 0.5, 0}
 };
 
-static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects)
+// draws on image in place instead of on a copy
+static void draw_objects(cv::Mat& image, const std::vector<Object>& objects)
 {
 //    static const char* class_names[] = {
 //        "person", "bicycle", "car", "motorcycle", "airplane", "bus", "train", "truck", "boat", "traffic light",
@@ -414,8 +182,6 @@ static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects)
             "B_4","R_G","R_3","R_4","R_Bb","N_3"
     };
 
-    cv::Mat image = bgr.clone();
-
     for (size_t i = 0; i < objects.size(); i++)
     {
         const Object& obj = objects[i];
@@ -435,7 +201,9 @@ static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects)
         //cv::rectangle(image, obj.rect, color * 255, 2);
         for(int j = 0;j<4;j++)
         {
-            cv::line(image,obj.points[j%4],obj.points[(j+1)%4],cv::Scalar(0,255,0),1);
+            const yolox::Point& p0 = obj.points[j%4];
+            const yolox::Point& p1 = obj.points[(j+1)%4];
+            cv::line(image,cv::Point2f(p0.x,p0.y),cv::Point2f(p1.x,p1.y),cv::Scalar(0,255,0),1);
         }
 
 
@@ -544,14 +312,19 @@ int main(int argc, char* argv[]) {
         capture.open("../data/demo2.mp4");
         int test_num = 1000;
         auto start1 = std::chrono::system_clock::now();
+        // the frame buffers live across frames, so the steady state loop does not allocate
+        cv::Mat image;
+        cv::Mat pr_img;
+        std::vector<Object> objects;
         while (1)
         //for(int k =0;k<test_num;k++)
         {
-            cv::Mat image;
             capture >> image;//读取当前帧
             //cv::Mat image = imread_t(input_image_path);
+            if (image.empty())
+                break;
 
-            cv::Mat pr_img = static_resize(image);
+            static_resize(image, pr_img);
             Blob::Ptr imgBlob = infer_request.GetBlob(input_name);     // just wrap Mat data by Blob::Ptr
             blobFromImage(pr_img, imgBlob);
 
@@ -582,9 +355,9 @@ int main(int argc, char* argv[]) {
             int img_w = image.cols;
             int img_h = image.rows;
             float scale = std::min(INPUT_W / (image.cols * 1.0), INPUT_H / (image.rows * 1.0));
-            std::vector<Object> objects;
 
-            decode_outputs(net_pred, objects, scale, img_w, img_h);
+            const SizeVector& output_dims = output_blob->getTensorDesc().getDims();
+            decode_outputs(net_pred, output_dims[output_dims.size() - 2], output_dims.back(), objects, scale, img_w, img_h);
 //            auto end2 = std::chrono::system_clock::now();
 //            std::cout << "decode output time: "
 //                      << std::chrono::duration_cast<std::chrono::milliseconds>(end2 - start2).count() << std::endl;
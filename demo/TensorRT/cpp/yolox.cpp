@@ -9,6 +9,7 @@
 #include "NvInfer.h"
 #include "cuda_runtime_api.h"
 #include "logging.h"
+#include "yolox_postprocess.h"
 
 #define CHECK(status) \
     do\
@@ -30,7 +31,6 @@ using namespace nvinfer1;
 // stuff we know about the network and the input/output blobs
 static const int INPUT_W = 640;
 static const int INPUT_H = 640;
-static const int NUM_CLASSES = 80;
 const char* INPUT_BLOB_NAME = "input_0";
 const char* OUTPUT_BLOB_NAME = "output_0";
 static Logger gLogger;
@@ -47,168 +47,11 @@ cv::Mat static_resize(cv::Mat& img) {
     return out;
 }
 
-struct Object
-{
-    cv::Rect_<float> rect;
-    int label;
-    float prob;
-};
-
-struct GridAndStride
-{
-    int grid0;
-    int grid1;
-    int stride;
-};
-
-static void generate_grids_and_stride(std::vector<int>& strides, std::vector<GridAndStride>& grid_strides)
-{
-    for (auto stride : strides)
-    {
-        int num_grid_y = INPUT_H / stride;
-        int num_grid_x = INPUT_W / stride;
-        for (int g1 = 0; g1 < num_grid_y; g1++)
-        {
-            for (int g0 = 0; g0 < num_grid_x; g0++)
-            {
-                grid_strides.push_back((GridAndStride){g0, g1, stride});
-            }
-        }
-    }
-}
-
-static inline float intersection_area(const Object& a, const Object& b)
-{
-    cv::Rect_<float> inter = a.rect & b.rect;
-    return inter.area();
-}
-
-static void qsort_descent_inplace(std::vector<Object>& faceobjects, int left, int right)
-{
-    int i = left;
-    int j = right;
-    float p = faceobjects[(left + right) / 2].prob;
-
-    while (i <= j)
-    {
-        while (faceobjects[i].prob > p)
-            i++;
-
-        while (faceobjects[j].prob < p)
-            j--;
-
-        if (i <= j)
-        {
-            // swap
-            std::swap(faceobjects[i], faceobjects[j]);
-
-            i++;
-            j--;
-        }
-    }
-
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            if (left < j) qsort_descent_inplace(faceobjects, left, j);
-        }
-        #pragma omp section
-        {
-            if (i < right) qsort_descent_inplace(faceobjects, i, right);
-        }
-    }
-}
-
-static void qsort_descent_inplace(std::vector<Object>& objects)
-{
-    if (objects.empty())
-        return;
+// decoding, NMS and the mapping back to the image live in demo/postprocess
+typedef yolox::Object<false> Object;
 
-    qsort_descent_inplace(objects, 0, objects.size() - 1);
-}
-
-static void nms_sorted_bboxes(const std::vector<Object>& faceobjects, std::vector<int>& picked, float nms_threshold)
-{
-    picked.clear();
-
-    const int n = faceobjects.size();
-
-    std::vector<float> areas(n);
-    for (int i = 0; i < n; i++)
-    {
-        areas[i] = faceobjects[i].rect.area();
-    }
-
-    for (int i = 0; i < n; i++)
-    {
-        const Object& a = faceobjects[i];
-
-        int keep = 1;
-        for (int j = 0; j < (int)picked.size(); j++)
-        {
-            const Object& b = faceobjects[picked[j]];
-
-            // intersection over union
-            float inter_area = intersection_area(a, b);
-            float union_area = areas[i] + areas[picked[j]] - inter_area;
-            // float IoU = inter_area / union_area
-            if (inter_area / union_area > nms_threshold)
-                keep = 0;
-        }
-
-        if (keep)
-            picked.push_back(i);
-    }
-}
-
-
-static void generate_yolox_proposals(std::vector<GridAndStride> grid_strides, float* feat_blob, float prob_threshold, std::vector<Object>& objects)
-{
-
-    const int num_anchors = grid_strides.size();
-
-    for (int anchor_idx = 0; anchor_idx < num_anchors; anchor_idx++)
-    {
-        const int grid0 = grid_strides[anchor_idx].grid0;
-        const int grid1 = grid_strides[anchor_idx].grid1;
-        const int stride = grid_strides[anchor_idx].stride;
-
-        const int basic_pos = anchor_idx * (NUM_CLASSES + 5);
-
-        // yolox/models/yolo_head.py decode logic
-        float x_center = (feat_blob[basic_pos+0] + grid0) * stride;
-        float y_center = (feat_blob[basic_pos+1] + grid1) * stride;
-        float w = exp(feat_blob[basic_pos+2]) * stride;
-        float h = exp(feat_blob[basic_pos+3]) * stride;
-        float x0 = x_center - w * 0.5f;
-        float y0 = y_center - h * 0.5f;
-
-        float box_objectness = feat_blob[basic_pos+4];
-        for (int class_idx = 0; class_idx < NUM_CLASSES; class_idx++)
-        {
-            float box_cls_score = feat_blob[basic_pos + 5 + class_idx];
-            float box_prob = box_objectness * box_cls_score;
-            if (box_prob > prob_threshold)
-            {
-                Object obj;
-                obj.rect.x = x0;
-                obj.rect.y = y0;
-                obj.rect.width = w;
-                obj.rect.height = h;
-                obj.label = class_idx;
-                obj.prob = box_prob;
-
-                objects.push_back(obj);
-            }
-
-        } // class loop
-
-    } // point anchor loop
-}
-
-float* blobFromImage(cv::Mat& img){
-    float* blob = new float[img.total()*3];
+// blob holds img.total() * 3 floats, allocated once by the caller
+void blobFromImage(cv::Mat& img, float* blob){
     int channels = 3;
     int img_h = img.rows;
     int img_w = img.cols;
@@ -223,50 +66,18 @@ float* blobFromImage(cv::Mat& img){
             }
         }
     }
-    return blob;
 }
 
 
-static void decode_outputs(float* prob, std::vector<Object>& objects, float scale, const int img_w, const int img_h) {
-        std::vector<Object> proposals;
-        std::vector<int> strides = {8, 16, 32};
-        std::vector<GridAndStride> grid_strides;
-        generate_grids_and_stride(strides, grid_strides);
-        generate_yolox_proposals(grid_strides, prob,  BBOX_CONF_THRESH, proposals);
-        std::cout << "num of boxes before nms: " << proposals.size() << std::endl;
-
-        qsort_descent_inplace(proposals);
-
-        std::vector<int> picked;
-        nms_sorted_bboxes(proposals, picked, NMS_THRESH);
-
-
-        int count = picked.size();
-
-        std::cout << "num of boxes: " << count << std::endl;
-
-        objects.resize(count);
-        for (int i = 0; i < count; i++)
-        {
-            objects[i] = proposals[picked[i]];
-
-            // adjust offset to original unpadded
-            float x0 = (objects[i].rect.x) / scale;
-            float y0 = (objects[i].rect.y) / scale;
-            float x1 = (objects[i].rect.x + objects[i].rect.width) / scale;
-            float y1 = (objects[i].rect.y + objects[i].rect.height) / scale;
-
-            // clip
-            x0 = std::max(std::min(x0, (float)(img_w - 1)), 0.f);
-            y0 = std::max(std::min(y0, (float)(img_h - 1)), 0.f);
-            x1 = std::max(std::min(x1, (float)(img_w - 1)), 0.f);
-            y1 = std::max(std::min(y1, (float)(img_h - 1)), 0.f);
-
-            objects[i].rect.x = x0;
-            objects[i].rect.y = y0;
-            objects[i].rect.width = x1 - x0;
-            objects[i].rect.height = y1 - y0;
+// num_anchors and num_channels are the last two output dimensions, the anchor count of the
+// input size and 5 + the number of classes
+static void decode_outputs(float* prob, int num_anchors, int num_channels, std::vector<Object>& objects, float scale, const int img_w, const int img_h) {
+        // the anchor grid and the buffers are built on the first frame and reused
+        static yolox::Decoder<false> decoder(INPUT_W, INPUT_H);
+        if (!decoder.Decode(num_anchors, num_channels, prob, BBOX_CONF_THRESH, NMS_THRESH, scale, img_w, img_h, &objects)) {
+            std::cerr << "unexpected output dimensions " << num_anchors << " x " << num_channels << std::endl;
         }
+        std::cout << "num of boxes: " << objects.size() << std::endl;
 }
 
 const float color_list[80][3] =
@@ -353,7 +164,8 @@ const float color_list[80][3] =
     {0.50, 0.5, 0}
 };
 
-static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects, std::string f)
+// draws on image in place instead of on a copy
+static void draw_objects(cv::Mat& image, const std::vector<Object>& objects, std::string f)
 {
     static const char* class_names[] = {
         "person", "bicycle", "car", "motorcycle", "airplane", "bus", "train", "truck", "boat", "traffic light",
@@ -367,8 +179,6 @@ static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects,
         "hair drier", "toothbrush"
     };
 
-    cv::Mat image = bgr.clone();
-
     for (size_t i = 0; i < objects.size(); i++)
     {
         const Object& obj = objects[i];
@@ -385,7 +195,7 @@ static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects,
             txt_color = cv::Scalar(255, 255, 255);
         }
 
-        cv::rectangle(image, obj.rect, color * 255, 2);
+        cv::rectangle(image, cv::Rect_<float>(obj.rect.x, obj.rect.y, obj.rect.width, obj.rect.height), color * 255, 2);
 
         char text[256];
         sprintf(text, "%s %.1f%%", class_names[obj.label], obj.prob * 100);
@@ -500,6 +310,7 @@ int main(int argc, char** argv) {
         output_size *= out_dims.d[j];
     }
     static float* prob = new float[output_size];
+    static float* blob = new float[3 * INPUT_H * INPUT_W];
 
     cv::Mat img = cv::imread(input_image_path);
     int img_w = img.cols;
@@ -507,8 +318,7 @@ int main(int argc, char** argv) {
     cv::Mat pr_img = static_resize(img);
     std::cout << "blob image" << std::endl;
 
-    float* blob;
-    blob = blobFromImage(pr_img);
+    blobFromImage(pr_img, blob);
     float scale = std::min(INPUT_W / (img.cols*1.0), INPUT_H / (img.rows*1.0));
 
     // run inference
@@ -518,10 +328,8 @@ int main(int argc, char** argv) {
     std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
 
     std::vector<Object> objects;
-    decode_outputs(prob, objects, scale, img_w, img_h);
+    decode_outputs(prob, out_dims.d[out_dims.nbDims - 2], out_dims.d[out_dims.nbDims - 1], objects, scale, img_w, img_h);
     draw_objects(img, objects, input_image_path);
-    // delete the pointer to the float
-    delete blob;
     // destroy the engine
     context->destroy();
     engine->destroy();
@@ -17,6 +17,8 @@
 #include "net.h"
 #include "benchmark.h"
 
+#include "yolox_postprocess.h"
+
 static ncnn::UnlockedPoolAllocator g_blob_pool_allocator;
 static ncnn::PoolAllocator g_workspace_pool_allocator;
 
@@ -70,180 +72,8 @@ public:
 
 DEFINE_LAYER_CREATOR(YoloV5Focus)
 
-struct Object
-{
-    float x;
-    float y;
-    float w;
-    float h;
-    int label;
-    float prob;
-};
-
-struct GridAndStride
-{
-    int grid0;
-    int grid1;
-    int stride;
-};
-
-static inline float intersection_area(const Object& a, const Object& b)
-{
-    if (a.x > b.x + b.w || a.x + a.w < b.x || a.y > b.y + b.h || a.y + a.h < b.y)
-    {
-        // no intersection
-        return 0.f;
-    }
-
-    float inter_width = std::min(a.x + a.w, b.x + b.w) - std::max(a.x, b.x);
-    float inter_height = std::min(a.y + a.h, b.y + b.h) - std::max(a.y, b.y);
-
-    return inter_width * inter_height;
-}
-
-static void qsort_descent_inplace(std::vector<Object>& faceobjects, int left, int right)
-{
-    int i = left;
-    int j = right;
-    float p = faceobjects[(left + right) / 2].prob;
-
-    while (i <= j)
-    {
-        while (faceobjects[i].prob > p)
-            i++;
-
-        while (faceobjects[j].prob < p)
-            j--;
-
-        if (i <= j)
-        {
-            // swap
-            std::swap(faceobjects[i], faceobjects[j]);
-
-            i++;
-            j--;
-        }
-    }
-
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            if (left < j) qsort_descent_inplace(faceobjects, left, j);
-        }
-        #pragma omp section
-        {
-            if (i < right) qsort_descent_inplace(faceobjects, i, right);
-        }
-    }
-}
-
-static void qsort_descent_inplace(std::vector<Object>& faceobjects)
-{
-    if (faceobjects.empty())
-        return;
-
-    qsort_descent_inplace(faceobjects, 0, faceobjects.size() - 1);
-}
-
-static void nms_sorted_bboxes(const std::vector<Object>& faceobjects, std::vector<int>& picked, float nms_threshold)
-{
-    picked.clear();
-
-    const int n = faceobjects.size();
-
-    std::vector<float> areas(n);
-    for (int i = 0; i < n; i++)
-    {
-        areas[i] = faceobjects[i].w * faceobjects[i].h;
-    }
-
-    for (int i = 0; i < n; i++)
-    {
-        const Object& a = faceobjects[i];
-
-        int keep = 1;
-        for (int j = 0; j < (int)picked.size(); j++)
-        {
-            const Object& b = faceobjects[picked[j]];
-
-            // intersection over union
-            float inter_area = intersection_area(a, b);
-            float union_area = areas[i] + areas[picked[j]] - inter_area;
-            // float IoU = inter_area / union_area
-            if (inter_area / union_area > nms_threshold)
-                keep = 0;
-        }
-
-        if (keep)
-            picked.push_back(i);
-    }
-}
-
-static void generate_grids_and_stride(const int target_size, std::vector<int>& strides, std::vector<GridAndStride>& grid_strides)
-{
-    for (auto stride : strides)
-    {
-        int num_grid = target_size / stride;
-        for (int g1 = 0; g1 < num_grid; g1++)
-        {
-            for (int g0 = 0; g0 < num_grid; g0++)
-            {
-                grid_strides.push_back((GridAndStride){g0, g1, stride});
-            }
-        }
-    }
-}
-
-static void generate_yolox_proposals(std::vector<GridAndStride> grid_strides, const ncnn::Mat& feat_blob, float prob_threshold, std::vector<Object>& objects)
-{
-    const int num_grid = feat_blob.h;
-    fprintf(stderr, "output height: %d, width: %d, channels: %d, dims:%d\n", feat_blob.h, feat_blob.w, feat_blob.c, feat_blob.dims);
-
-    const int num_class = feat_blob.w - 5;
-
-    const int num_anchors = grid_strides.size();
-
-    const float* feat_ptr = feat_blob.channel(0);
-    for (int anchor_idx = 0; anchor_idx < num_anchors; anchor_idx++)
-    {
-        const int grid0 = grid_strides[anchor_idx].grid0;
-        const int grid1 = grid_strides[anchor_idx].grid1;
-        const int stride = grid_strides[anchor_idx].stride;
-
-        // yolox/models/yolo_head.py decode logic
-        //  outputs[..., :2] = (outputs[..., :2] + grids) * strides
-        //  outputs[..., 2:4] = torch.exp(outputs[..., 2:4]) * strides
-        float x_center = (feat_ptr[0] + grid0) * stride;
-        float y_center = (feat_ptr[1] + grid1) * stride;
-        float w = exp(feat_ptr[2]) * stride;
-        float h = exp(feat_ptr[3]) * stride;
-        float x0 = x_center - w * 0.5f;
-        float y0 = y_center - h * 0.5f;
-
-        float box_objectness = feat_ptr[4];
-        for (int class_idx = 0; class_idx < num_class; class_idx++)
-        {
-            float box_cls_score = feat_ptr[5 + class_idx];
-            float box_prob = box_objectness * box_cls_score;
-            if (box_prob > prob_threshold)
-            {
-                Object obj;
-                obj.x = x0;
-                obj.y = y0;
-                obj.w = w;
-                obj.h = h;
-                obj.label = class_idx;
-                obj.prob = box_prob;
-
-                objects.push_back(obj);
-            }
-
-        } // class loop
-        feat_ptr += feat_blob.w;
-
-    } // point anchor loop
-}
+// decoding, NMS and the mapping back to the image live in demo/postprocess
+typedef yolox::Object<false> Object;
 
 
 extern "C" {
@@ -352,7 +182,6 @@ JNIEXPORT jobjectArray JNICALL Java_com_megvii_yoloXncnn_YOLOXncnn_Detect(JNIEnv
     const int target_size = 640;
     const float prob_threshold = 0.3f;
     const float nms_threshold = 0.65f;
-    std::vector<int> strides = {8, 16, 32}; // might have stride=64
 
     int w = width;
     int h = height;
@@ -390,50 +219,13 @@ JNIEXPORT jobjectArray JNICALL Java_com_megvii_yoloXncnn_YOLOXncnn_Detect(JNIEnv
 
         ex.input("images", in_pad);
 
-        std::vector<Object> proposals;
+        ncnn::Mat out;
+        ex.extract("output", out);
 
-        // yolox decode and generate proposal logic
-        {
-            ncnn::Mat out;
-            ex.extract("output", out);
-
-            std::vector<GridAndStride> grid_strides;
-            generate_grids_and_stride(target_size, strides, grid_strides);
-            generate_yolox_proposals(grid_strides, out, prob_threshold, proposals);
-
-        }
-
-        // sort all proposals by score from highest to lowest
-        qsort_descent_inplace(proposals);
-
-        // apply nms with nms_threshold
-        std::vector<int> picked;
-        nms_sorted_bboxes(proposals, picked, nms_threshold);
-
-        int count = picked.size();
-
-        objects.resize(count);
-        for (int i = 0; i < count; i++)
-        {
-            objects[i] = proposals[picked[i]];
-
-            // adjust offset to original unpadded
-            float x0 = (objects[i].x) / scale;
-            float y0 = (objects[i].y) / scale;
-            float x1 = (objects[i].x + objects[i].w) / scale;
-            float y1 = (objects[i].y + objects[i].h) / scale;
-
-            // clip
-            x0 = std::max(std::min(x0, (float)(width - 1)), 0.f);
-            y0 = std::max(std::min(y0, (float)(height - 1)), 0.f);
-            x1 = std::max(std::min(x1, (float)(width - 1)), 0.f);
-            y1 = std::max(std::min(y1, (float)(height - 1)), 0.f);
-
-            objects[i].x = x0;
-            objects[i].y = y0;
-            objects[i].w = x1 - x0;
-            objects[i].h = y1 - y0;
-        }
+        // the anchor grid and the buffers are built on the first frame and reused
+        static yolox::Decoder<false> decoder(target_size, target_size);
+        if (!decoder.Decode(out.h, out.w, (const float*)out.data, prob_threshold, nms_threshold, scale, width, height, &objects))
+            return NULL;
     }
 
     // objects to Obj[]
@@ -455,10 +247,10 @@ JNIEXPORT jobjectArray JNICALL Java_com_megvii_yoloXncnn_YOLOXncnn_Detect(JNIEnv
     {
         jobject jObj = env->NewObject(objCls, constructortorId, thiz);
 
-        env->SetFloatField(jObj, xId, objects[i].x);
-        env->SetFloatField(jObj, yId, objects[i].y);
-        env->SetFloatField(jObj, wId, objects[i].w);
-        env->SetFloatField(jObj, hId, objects[i].h);
+        env->SetFloatField(jObj, xId, objects[i].rect.x);
+        env->SetFloatField(jObj, yId, objects[i].rect.y);
+        env->SetFloatField(jObj, wId, objects[i].rect.width);
+        env->SetFloatField(jObj, hId, objects[i].rect.height);
         env->SetObjectField(jObj, labelId, env->NewStringUTF(class_names[objects[i].label]));
         env->SetFloatField(jObj, probId, objects[i].prob);
 
@@ -27,6 +27,8 @@
 #include <stdio.h>
 #include <vector>
 
+#include "yolox_postprocess.h"
+
 #define YOLOX_NMS_THRESH  0.45 // nms threshold
 #define YOLOX_CONF_THRESH 0.25 // threshold of bounding box prob
 #define YOLOX_TARGET_SIZE 640  // target image size after resize, might use 416 for small model
@@ -80,171 +82,8 @@ public:
 
 DEFINE_LAYER_CREATOR(YoloV5Focus)
 
-struct Object
-{
-    cv::Rect_<float> rect;
-    int label;
-    float prob;
-};
-
-struct GridAndStride
-{
-    int grid0;
-    int grid1;
-    int stride;
-};
-
-static inline float intersection_area(const Object& a, const Object& b)
-{
-    cv::Rect_<float> inter = a.rect & b.rect;
-    return inter.area();
-}
-
-static void qsort_descent_inplace(std::vector<Object>& faceobjects, int left, int right)
-{
-    int i = left;
-    int j = right;
-    float p = faceobjects[(left + right) / 2].prob;
-
-    while (i <= j)
-    {
-        while (faceobjects[i].prob > p)
-            i++;
-
-        while (faceobjects[j].prob < p)
-            j--;
-
-        if (i <= j)
-        {
-            // swap
-            std::swap(faceobjects[i], faceobjects[j]);
-
-            i++;
-            j--;
-        }
-    }
-
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            if (left < j) qsort_descent_inplace(faceobjects, left, j);
-        }
-        #pragma omp section
-        {
-            if (i < right) qsort_descent_inplace(faceobjects, i, right);
-        }
-    }
-}
-
-static void qsort_descent_inplace(std::vector<Object>& objects)
-{
-    if (objects.empty())
-        return;
-
-    qsort_descent_inplace(objects, 0, objects.size() - 1);
-}
-
-static void nms_sorted_bboxes(const std::vector<Object>& faceobjects, std::vector<int>& picked, float nms_threshold)
-{
-    picked.clear();
-
-    const int n = faceobjects.size();
-
-    std::vector<float> areas(n);
-    for (int i = 0; i < n; i++)
-    {
-        areas[i] = faceobjects[i].rect.area();
-    }
-
-    for (int i = 0; i < n; i++)
-    {
-        const Object& a = faceobjects[i];
-
-        int keep = 1;
-        for (int j = 0; j < (int)picked.size(); j++)
-        {
-            const Object& b = faceobjects[picked[j]];
-
-            // intersection over union
-            float inter_area = intersection_area(a, b);
-            float union_area = areas[i] + areas[picked[j]] - inter_area;
-            // float IoU = inter_area / union_area
-            if (inter_area / union_area > nms_threshold)
-                keep = 0;
-        }
-
-        if (keep)
-            picked.push_back(i);
-    }
-}
-
-static void generate_grids_and_stride(const int target_size, std::vector<int>& strides, std::vector<GridAndStride>& grid_strides)
-{
-    for (int i = 0; i < (int)strides.size(); i++)
-    {
-        int stride = strides[i];
-        int num_grid = target_size / stride;
-        for (int g1 = 0; g1 < num_grid; g1++)
-        {
-            for (int g0 = 0; g0 < num_grid; g0++)
-            {
-                GridAndStride gs;
-                gs.grid0 = g0;
-                gs.grid1 = g1;
-                gs.stride = stride;
-                grid_strides.push_back(gs);
-            }
-        }
-    }
-}
-
-static void generate_yolox_proposals(std::vector<GridAndStride> grid_strides, const ncnn::Mat& feat_blob, float prob_threshold, std::vector<Object>& objects)
-{
-    const int num_grid = feat_blob.h;
-    const int num_class = feat_blob.w - 5;
-    const int num_anchors = grid_strides.size();
-
-    const float* feat_ptr = feat_blob.channel(0);
-    for (int anchor_idx = 0; anchor_idx < num_anchors; anchor_idx++)
-    {
-        const int grid0 = grid_strides[anchor_idx].grid0;
-        const int grid1 = grid_strides[anchor_idx].grid1;
-        const int stride = grid_strides[anchor_idx].stride;
-
-        // yolox/models/yolo_head.py decode logic
-        //  outputs[..., :2] = (outputs[..., :2] + grids) * strides
-        //  outputs[..., 2:4] = torch.exp(outputs[..., 2:4]) * strides
-        float x_center = (feat_ptr[0] + grid0) * stride;
-        float y_center = (feat_ptr[1] + grid1) * stride;
-        float w = exp(feat_ptr[2]) * stride;
-        float h = exp(feat_ptr[3]) * stride;
-        float x0 = x_center - w * 0.5f;
-        float y0 = y_center - h * 0.5f;
-
-        float box_objectness = feat_ptr[4];
-        for (int class_idx = 0; class_idx < num_class; class_idx++)
-        {
-            float box_cls_score = feat_ptr[5 + class_idx];
-            float box_prob = box_objectness * box_cls_score;
-            if (box_prob > prob_threshold)
-            {
-                Object obj;
-                obj.rect.x = x0;
-                obj.rect.y = y0;
-                obj.rect.width = w;
-                obj.rect.height = h;
-                obj.label = class_idx;
-                obj.prob = box_prob;
-
-                objects.push_back(obj);
-            }
-
-        } // class loop
-        feat_ptr += feat_blob.w;
-
-    } // point anchor loop
-}
+// decoding, NMS and the mapping back to the image live in demo/postprocess
+typedef yolox::Object<false> Object;
 
 static int detect_yolox(const cv::Mat& bgr, std::vector<Object>& objects)
 {
@@ -293,49 +132,16 @@ static int detect_yolox(const cv::Mat& bgr, std::vector<Object>& objects)
 
     ex.input("images", in_pad);
 
-    std::vector<Object> proposals;
-
-    {
-        ncnn::Mat out;
-        ex.extract("output", out);
-
-        static const int stride_arr[] = {8, 16, 32}; // might have stride=64 in YOLOX
-        std::vector<int> strides(stride_arr, stride_arr + sizeof(stride_arr) / sizeof(stride_arr[0]));
-        std::vector<GridAndStride> grid_strides;
-        generate_grids_and_stride(YOLOX_TARGET_SIZE, strides, grid_strides);
-        generate_yolox_proposals(grid_strides, out, YOLOX_CONF_THRESH, proposals);
-    }
-
-    // sort all proposals by score from highest to lowest
-    qsort_descent_inplace(proposals);
-
-    // apply nms with nms_threshold
-    std::vector<int> picked;
-    nms_sorted_bboxes(proposals, picked, YOLOX_NMS_THRESH);
+    ncnn::Mat out;
+    ex.extract("output", out);
 
-    int count = picked.size();
-
-    objects.resize(count);
-    for (int i = 0; i < count; i++)
+    // one row of box, objectness and class scores per anchor of the stride 8, 16 and 32 maps
+    // the anchor grid and the buffers are built on the first call and reused
+    static yolox::Decoder<false> decoder(YOLOX_TARGET_SIZE, YOLOX_TARGET_SIZE);
+    if (!decoder.Decode(out.h, out.w, (const float*)out.data, YOLOX_CONF_THRESH, YOLOX_NMS_THRESH, scale, img_w, img_h, &objects))
     {
-        objects[i] = proposals[picked[i]];
-
-        // adjust offset to original unpadded
-        float x0 = (objects[i].rect.x) / scale;
-        float y0 = (objects[i].rect.y) / scale;
-        float x1 = (objects[i].rect.x + objects[i].rect.width) / scale;
-        float y1 = (objects[i].rect.y + objects[i].rect.height) / scale;
-
-        // clip
-        x0 = std::max(std::min(x0, (float)(img_w - 1)), 0.f);
-        y0 = std::max(std::min(y0, (float)(img_h - 1)), 0.f);
-        x1 = std::max(std::min(x1, (float)(img_w - 1)), 0.f);
-        y1 = std::max(std::min(y1, (float)(img_h - 1)), 0.f);
-
-        objects[i].rect.x = x0;
-        objects[i].rect.y = y0;
-        objects[i].rect.width = x1 - x0;
-        objects[i].rect.height = y1 - y0;
+        fprintf(stderr, "unexpected output shape %d x %d\n", out.h, out.w);
+        return -1;
     }
 
     return 0;
@@ -364,7 +170,7 @@ static void draw_objects(const cv::Mat& bgr, const std::vector<Object>& objects)
         fprintf(stderr, "%d = %.5f at %.2f %.2f %.2f x %.2f\n", obj.label, obj.prob,
                 obj.rect.x, obj.rect.y, obj.rect.width, obj.rect.height);
 
-        cv::rectangle(image, obj.rect, cv::Scalar(255, 0, 0));
+        cv::rectangle(image, cv::Rect_<float>(obj.rect.x, obj.rect.y, obj.rect.width, obj.rect.height), cv::Scalar(255, 0, 0));
 
         char text[256];
         sprintf(text, "%s %.1f%%", class_names[obj.label], obj.prob * 100);
@@ -0,0 +1,649 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "yolox_simd.h"
+
+// Post-processing of the YOLOX head output shared by the C++ demos: anchor
+// grids, proposal decoding, score sorting, NMS and the mapping of the boxes
+// back to the original image.  The head output is a row major
+// num_anchors x num_channels float array whose rows follow the cells of the
+// stride 8, 16 and 32 feature maps.  The decoding is a template on the class
+// count and on whether the model also regresses the 4 corners of the object,
+// so the row layout is known at compile time.  There is no OpenCV dependency,
+// the demos convert to cv types where they draw
+namespace yolox {
+
+struct Point {
+  float x;
+  float y;
+};
+
+// Axis aligned box with x, y the top left corner
+struct Rect {
+  float x;
+  float y;
+  float width;
+  float height;
+
+  float area() const {
+    return width * height;
+  }
+};
+
+template <bool WithCorners>
+struct Object;
+
+// Detection of a box only model
+template <>
+struct Object<false> {
+  Rect rect;
+  int label;
+  float prob;
+};
+
+// Detection of a model that also regresses the 4 corners of the object, e.g.
+// the armor plates of the OpenVINO demo
+template <>
+struct Object<true> {
+  Rect rect;
+  Point points[4];
+  int label;
+  float prob;
+};
+
+// Channels of one head output row: the box (cx, cy, w, h), for corner models
+// the x, y offsets of the 4 corners, then the objectness and the class scores
+template <bool WithCorners>
+struct RowLayout {
+  static const bool kWithCorners = WithCorners;
+  static const int kNumCorners = WithCorners ? 4 : 0;
+  static const int kObjectnessChannel = 4 + 2 * kNumCorners;
+  static const int kClassChannel = kObjectnessChannel + 1;
+};
+
+// Row layout of a model with NumClasses classes.  The decoding is
+// instantiated per layout, so with the class count known at compile time the
+// compiler can unroll and vectorize the class loops
+template <int NumClasses, bool WithCorners>
+struct OutputLayout : RowLayout<WithCorners> {
+  static_assert(NumClasses > 0, "the class count must be positive");
+
+  static const int kNumClasses = NumClasses;
+  static const int kNumChannels =
+      RowLayout<WithCorners>::kClassChannel + NumClasses;
+
+  static constexpr int num_classes() {
+    return kNumClasses;
+  }
+
+  static constexpr int num_channels() {
+    return kNumChannels;
+  }
+};
+
+// Row layout of a model whose class count is only known at runtime, for the
+// generic decoding of class counts without an instantiation
+template <bool WithCorners>
+class DynamicOutputLayout : public RowLayout<WithCorners> {
+ public:
+  explicit DynamicOutputLayout(int num_classes) : num_classes_(num_classes) {}
+
+  int num_classes() const {
+    return num_classes_;
+  }
+
+  int num_channels() const {
+    return RowLayout<WithCorners>::kClassChannel + num_classes_;
+  }
+
+ private:
+  int num_classes_;
+};
+
+// Strides of the P3, P4 and P5 outputs of the YOLOX head
+inline std::vector<int> DefaultStrides() {
+  return std::vector<int>{8, 16, 32};
+}
+
+namespace detail {
+
+// std::vector allocator whose storage starts on a cache line
+template <typename T>
+struct CacheAlignedAllocator {
+  typedef T value_type;
+  static const size_t kAlignment = 64;
+
+  CacheAlignedAllocator() {}
+
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+  // over-allocate, and keep the start of the block just before the aligned
+  // storage for deallocate()
+  T* allocate(size_t n) {
+    void* block = ::operator new(n * sizeof(T) + sizeof(void*) + kAlignment);
+    const uintptr_t aligned =
+        (reinterpret_cast<uintptr_t>(block) + sizeof(void*) + kAlignment -
+         1) &
+        ~static_cast<uintptr_t>(kAlignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = block;
+    return reinterpret_cast<T*>(aligned);
+  }
+
+  void deallocate(T* storage, size_t) {
+    ::operator delete(reinterpret_cast<void**>(storage)[-1]);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(
+    const CacheAlignedAllocator<T>&,
+    const CacheAlignedAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(
+    const CacheAlignedAllocator<T>&,
+    const CacheAlignedAllocator<U>&) {
+  return false;
+}
+
+} // namespace detail
+
+// Anchors of the head output rows of an input_w x input_h input: the column
+// and row of the feature map cell and the stride of every row, in the order
+// of the rows.  The table is a structure of cache aligned float arrays, ready
+// for decoding without conversion.  It only depends on the input resolution,
+// so build it once and keep it across frames
+class AnchorGrid {
+ public:
+  typedef std::vector<float, detail::CacheAlignedAllocator<float>> Array;
+
+  AnchorGrid(
+      int input_w,
+      int input_h,
+      const std::vector<int>& strides = DefaultStrides())
+      : input_w_(input_w), input_h_(input_h) {
+    size_t num_anchors = 0;
+    for (const int stride : strides) {
+      num_anchors += static_cast<size_t>(input_w / stride) * (input_h / stride);
+    }
+    grid0_.reserve(num_anchors);
+    grid1_.reserve(num_anchors);
+    stride_.reserve(num_anchors);
+    for (const int stride : strides) {
+      const int num_grid_w = input_w / stride;
+      const int num_grid_h = input_h / stride;
+      for (int g1 = 0; g1 < num_grid_h; ++g1) {
+        for (int g0 = 0; g0 < num_grid_w; ++g0) {
+          grid0_.push_back(g0);
+          grid1_.push_back(g1);
+          stride_.push_back(stride);
+        }
+      }
+    }
+  }
+
+  int input_w() const {
+    return input_w_;
+  }
+
+  int input_h() const {
+    return input_h_;
+  }
+
+  // Number of anchors, the number of rows of the head output
+  int size() const {
+    return stride_.size();
+  }
+
+  const float* grid0() const {
+    return grid0_.data();
+  }
+
+  const float* grid1() const {
+    return grid1_.data();
+  }
+
+  const float* stride() const {
+    return stride_.data();
+  }
+
+ private:
+  int input_w_;
+  int input_h_;
+  Array grid0_;
+  Array grid1_;
+  Array stride_;
+};
+
+namespace detail {
+
+inline float Clip(float value, float upper) {
+  return std::max(std::min(value, upper), 0.f);
+}
+
+// Corner handling of the two output layouts, a no-op for box only models
+template <bool WithCorners>
+struct Corners {
+  static void Decode(const float*, float, float, float, Object<false>*) {}
+
+  static void ScaleAndClip(float, float, float, Object<false>*) {}
+};
+
+template <>
+struct Corners<true> {
+  static void Decode(
+      const float* row,
+      float grid0,
+      float grid1,
+      float stride,
+      Object<true>* object) {
+    for (int k = 0; k < 4; ++k) {
+      object->points[k].x = (row[4 + 2 * k] + grid0) * stride;
+      object->points[k].y = (row[5 + 2 * k] + grid1) * stride;
+    }
+  }
+
+  static void
+  ScaleAndClip(float scale, float max_x, float max_y, Object<true>* object) {
+    for (int k = 0; k < 4; ++k) {
+      object->points[k].x = Clip(object->points[k].x / scale, max_x);
+      object->points[k].y = Clip(object->points[k].y / scale, max_y);
+    }
+  }
+};
+
+} // namespace detail
+
+// Append to proposals every (anchor, class) pair of the head output whose
+// objectness times class score is above prob_threshold, with the box (and
+// corners) in the pixels of the network input.  The candidate anchors are
+// found with the SIMD kernels of yolox_simd.h, and only they are decoded.
+// The candidate anchors go to candidates, a buffer reused across frames.
+// yolox/models/yolo_head.py decode logic:
+//   outputs[..., :2] = (outputs[..., :2] + grids) * strides
+//   outputs[..., 2:4] = torch.exp(outputs[..., 2:4]) * strides
+template <typename Layout>
+void GenerateProposals(
+    const Layout& layout,
+    const AnchorGrid& grid,
+    const float* output,
+    float prob_threshold,
+    std::vector<Object<Layout::kWithCorners>>* proposals,
+    std::vector<int>* candidates) {
+  typedef Object<Layout::kWithCorners> ObjectType;
+  FindCandidateAnchors(layout, output, grid.size(), prob_threshold, candidates);
+  for (const int anchor : *candidates) {
+    const float* row =
+        output + static_cast<size_t>(anchor) * layout.num_channels();
+    const float grid0 = grid.grid0()[anchor];
+    const float grid1 = grid.grid1()[anchor];
+    const float stride = grid.stride()[anchor];
+
+    const float x_center = (row[0] + grid0) * stride;
+    const float y_center = (row[1] + grid1) * stride;
+    const float w = std::exp(row[2]) * stride;
+    const float h = std::exp(row[3]) * stride;
+    const float objectness = row[Layout::kObjectnessChannel];
+    for (int class_index = 0; class_index < layout.num_classes();
+         ++class_index) {
+      const float prob = objectness * row[Layout::kClassChannel + class_index];
+      if (prob > prob_threshold) {
+        ObjectType object;
+        object.rect = Rect{x_center - w * 0.5f, y_center - h * 0.5f, w, h};
+        detail::Corners<Layout::kWithCorners>::Decode(
+            row, grid0, grid1, stride, &object);
+        object.label = class_index;
+        object.prob = prob;
+        proposals->push_back(object);
+      }
+    }
+  }
+}
+
+// GenerateProposals() with a candidate buffer of its own
+template <typename Layout>
+void GenerateProposals(
+    const Layout& layout,
+    const AnchorGrid& grid,
+    const float* output,
+    float prob_threshold,
+    std::vector<Object<Layout::kWithCorners>>* proposals) {
+  std::vector<int> candidates;
+  GenerateProposals(
+      layout, grid, output, prob_threshold, proposals, &candidates);
+}
+
+// Sort the objects by decreasing score
+template <typename ObjectT>
+void SortByScore(std::vector<ObjectT>* objects) {
+  std::sort(
+      objects->begin(),
+      objects->end(),
+      [](const ObjectT& a, const ObjectT& b) { return a.prob > b.prob; });
+}
+
+inline float IntersectionArea(const Rect& a, const Rect& b) {
+  const float w =
+      std::min(a.x + a.width, b.x + b.width) - std::max(a.x, b.x);
+  const float h =
+      std::min(a.y + a.height, b.y + b.height) - std::max(a.y, b.y);
+  return (w > 0.f && h > 0.f) ? w * h : 0.f;
+}
+
+// Greedy class agnostic NMS over objects sorted by decreasing score.  Fills
+// picked with the indices of the objects that overlap no higher scoring kept
+// object by more than nms_threshold IOU.  The box areas go to areas, a
+// buffer reused across frames
+template <typename ObjectT>
+void NmsSortedBoxes(
+    const std::vector<ObjectT>& objects,
+    float nms_threshold,
+    std::vector<int>* picked,
+    std::vector<float>* areas) {
+  picked->clear();
+  const int n = objects.size();
+  areas->resize(n);
+  for (int i = 0; i < n; ++i) {
+    (*areas)[i] = objects[i].rect.area();
+  }
+  for (int i = 0; i < n; ++i) {
+    bool keep = true;
+    for (const int j : *picked) {
+      const float inter_area =
+          IntersectionArea(objects[i].rect, objects[j].rect);
+      const float union_area = (*areas)[i] + (*areas)[j] - inter_area;
+      if (inter_area / union_area > nms_threshold) {
+        keep = false;
+        break;
+      }
+    }
+    if (keep) {
+      picked->push_back(i);
+    }
+  }
+}
+
+// NmsSortedBoxes() with an area buffer of its own
+template <typename ObjectT>
+void NmsSortedBoxes(
+    const std::vector<ObjectT>& objects,
+    float nms_threshold,
+    std::vector<int>* picked) {
+  std::vector<float> areas;
+  NmsSortedBoxes(objects, nms_threshold, picked, &areas);
+}
+
+// Map an object from the letterboxed network input back to the image that
+// was resized by scale into it, clipped to the image_w x image_h image.
+// YOLOX pads only at the bottom and right, so no offset is needed
+template <bool WithCorners>
+void ScaleAndClip(
+    float scale,
+    int image_w,
+    int image_h,
+    Object<WithCorners>* object) {
+  const float max_x = image_w - 1;
+  const float max_y = image_h - 1;
+  Rect& rect = object->rect;
+  const float x0 = detail::Clip(rect.x / scale, max_x);
+  const float y0 = detail::Clip(rect.y / scale, max_y);
+  const float x1 = detail::Clip((rect.x + rect.width) / scale, max_x);
+  const float y1 = detail::Clip((rect.y + rect.height) / scale, max_y);
+  rect = Rect{x0, y0, x1 - x0, y1 - y0};
+  detail::Corners<WithCorners>::ScaleAndClip(scale, max_x, max_y, object);
+}
+
+// Intermediate buffers of the post-processing of a frame.  They are cleared,
+// not freed, between frames, so once they have grown to the largest frame
+// the decoding does no heap allocation
+template <bool WithCorners>
+struct DecodeWorkspace {
+  std::vector<int> candidates;
+  std::vector<Object<WithCorners>> proposals;
+  std::vector<int> picked;
+  std::vector<float> areas;
+
+  // Room for num_anchors anchors with one proposal each, which is enough
+  // unless anchors pass the threshold for several classes
+  void Reserve(size_t num_anchors) {
+    candidates.reserve(num_anchors);
+    proposals.reserve(num_anchors);
+    picked.reserve(num_anchors);
+    areas.reserve(num_anchors);
+  }
+};
+
+// Full post-processing of the head output of the input of grid that holds
+// the image_w x image_h image resized by scale: proposals above
+// prob_threshold, NMS at nms_threshold, and the kept objects in image pixels.
+// objects keeps its capacity, like the buffers of workspace
+template <typename Layout>
+void DecodeOutputs(
+    const Layout& layout,
+    const AnchorGrid& grid,
+    const float* output,
+    float prob_threshold,
+    float nms_threshold,
+    float scale,
+    int image_w,
+    int image_h,
+    std::vector<Object<Layout::kWithCorners>>* objects,
+    DecodeWorkspace<Layout::kWithCorners>* workspace) {
+  std::vector<Object<Layout::kWithCorners>>& proposals = workspace->proposals;
+  proposals.clear();
+  GenerateProposals(
+      layout, grid, output, prob_threshold, &proposals, &workspace->candidates);
+  SortByScore(&proposals);
+
+  const std::vector<int>& picked = workspace->picked;
+  NmsSortedBoxes(
+      proposals, nms_threshold, &workspace->picked, &workspace->areas);
+
+  objects->resize(picked.size());
+  for (size_t i = 0; i < picked.size(); ++i) {
+    (*objects)[i] = proposals[picked[i]];
+    ScaleAndClip(scale, image_w, image_h, &(*objects)[i]);
+  }
+}
+
+// DecodeOutputs() of an input_w x input_h input.  This builds the anchor grid
+// and the buffers on every call, video loops should keep a Decoder instead
+template <typename Layout>
+void DecodeOutputs(
+    const Layout& layout,
+    const float* output,
+    int input_w,
+    int input_h,
+    float prob_threshold,
+    float nms_threshold,
+    float scale,
+    int image_w,
+    int image_h,
+    std::vector<Object<Layout::kWithCorners>>* objects) {
+  DecodeWorkspace<Layout::kWithCorners> workspace;
+  DecodeOutputs(
+      layout,
+      AnchorGrid(input_w, input_h),
+      output,
+      prob_threshold,
+      nms_threshold,
+      scale,
+      image_w,
+      image_h,
+      objects,
+      &workspace);
+}
+
+// DecodeOutputs() of a model with NumClasses classes
+template <int NumClasses, bool WithCorners>
+void DecodeOutputs(
+    const float* output,
+    int input_w,
+    int input_h,
+    float prob_threshold,
+    float nms_threshold,
+    float scale,
+    int image_w,
+    int image_h,
+    std::vector<Object<WithCorners>>* objects) {
+  DecodeOutputs(
+      OutputLayout<NumClasses, WithCorners>(),
+      output,
+      input_w,
+      input_h,
+      prob_threshold,
+      nms_threshold,
+      scale,
+      image_w,
+      image_h,
+      objects);
+}
+
+// Class counts with a dedicated instantiation of the decoding.  The
+// benchmark measures it as fast as the generic layout for the deployed
+// counts, so ClassCounts<> with only the generic path costs no speed
+template <int... Counts>
+struct ClassCounts {};
+
+// Class counts of the deployed models: the 80 COCO classes for box only
+// models, and the 6 armor classes of the OpenVINO demo for corner models
+template <bool WithCorners>
+struct DeployedClassCounts {
+  typedef ClassCounts<80> type;
+};
+
+template <>
+struct DeployedClassCounts<true> {
+  typedef ClassCounts<6> type;
+};
+
+namespace detail {
+
+template <bool WithCorners, typename... Args>
+void DecodeWithClassCount(ClassCounts<>, int num_classes, Args&&... args) {
+  DecodeOutputs(
+      DynamicOutputLayout<WithCorners>(num_classes),
+      std::forward<Args>(args)...);
+}
+
+template <bool WithCorners, int First, int... Rest, typename... Args>
+void DecodeWithClassCount(
+    ClassCounts<First, Rest...>,
+    int num_classes,
+    Args&&... args) {
+  if (num_classes == First) {
+    DecodeOutputs(
+        OutputLayout<First, WithCorners>(), std::forward<Args>(args)...);
+  } else {
+    DecodeWithClassCount<WithCorners>(
+        ClassCounts<Rest...>(), num_classes, std::forward<Args>(args)...);
+  }
+}
+
+} // namespace detail
+
+// Post-processing of the frames of a model at one input resolution.  The
+// constructor builds the anchor grid and reserves the buffers for the anchor
+// count, so decoding a frame builds no table, and once the buffers have grown
+// to the largest frame it does no heap allocation.  Keep the decoder across
+// frames, e.g. as a static of the decoding function, with one decoder per
+// thread
+template <
+    bool WithCorners,
+    typename Counts = typename DeployedClassCounts<WithCorners>::type>
+class Decoder {
+ public:
+  Decoder(
+      int input_w,
+      int input_h,
+      const std::vector<int>& strides = DefaultStrides())
+      : grid_(input_w, input_h, strides) {
+    workspace_.Reserve(grid_.size());
+  }
+
+  const AnchorGrid& grid() const {
+    return grid_;
+  }
+
+  // DecodeOutputs() of a model output of num_anchors rows of num_channels
+  // channels, its last two dimensions.  Uses the instantiation of the matching
+  // class count of Counts, or else the generic decoding with the class count
+  // given at runtime.  Returns false if num_anchors is not the anchor count of
+  // the grid, i.e. the model runs at another input size, or if num_channels is
+  // too small for the layout
+  bool Decode(
+      int num_anchors,
+      int num_channels,
+      const float* output,
+      float prob_threshold,
+      float nms_threshold,
+      float scale,
+      int image_w,
+      int image_h,
+      std::vector<Object<WithCorners>>* objects) {
+    const int num_classes =
+        num_channels - RowLayout<WithCorners>::kClassChannel;
+    if (num_anchors != grid_.size() || num_classes <= 0) {
+      return false;
+    }
+    detail::DecodeWithClassCount<WithCorners>(
+        Counts(),
+        num_classes,
+        grid_,
+        output,
+        prob_threshold,
+        nms_threshold,
+        scale,
+        image_w,
+        image_h,
+        objects,
+        &workspace_);
+    return true;
+  }
+
+ private:
+  AnchorGrid grid_;
+  DecodeWorkspace<WithCorners> workspace_;
+};
+
+// Decoder::Decode() of a single input_w x input_h frame
+template <
+    bool WithCorners,
+    typename Counts = typename DeployedClassCounts<WithCorners>::type>
+bool DispatchDecodeOutputs(
+    int num_anchors,
+    int num_channels,
+    const float* output,
+    int input_w,
+    int input_h,
+    float prob_threshold,
+    float nms_threshold,
+    float scale,
+    int image_w,
+    int image_h,
+    std::vector<Object<WithCorners>>* objects) {
+  return Decoder<WithCorners, Counts>(input_w, input_h)
+      .Decode(
+          num_anchors,
+          num_channels,
+          output,
+          prob_threshold,
+          nms_threshold,
+          scale,
+          image_w,
+          image_h,
+          objects);
+}
+
+} // namespace yolox
@@ -0,0 +1,373 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Vectorized search for the anchors of a head output that can yield a
+// proposal, so that the box decoding, exp and the per class loop run only for
+// them.  An anchor is a candidate if its objectness times its max class score
+// is above the threshold; anchors with a negative objectness are always
+// candidates, since for them the max score does not bound the products.  The
+// kernels test 8 (AVX2), 16 (AVX-512) or 4 (NEON) anchors at a time and are
+// selected at runtime from the CPU features.  The x86 kernels use target
+// attributes, so they need no -mavx2 / -mavx512f and the rest of the library
+// still runs on older CPUs
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define YOLOX_SIMD_X86 1
+#include <immintrin.h>
+#define YOLOX_TARGET_AVX2 __attribute__((target("avx2")))
+#define YOLOX_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define YOLOX_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace yolox {
+
+enum class SimdLevel { kScalar, kNeon, kAvx2, kAvx512 };
+
+inline const char* SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kNeon:
+      return "neon";
+    case SimdLevel::kAvx2:
+      return "avx2";
+    case SimdLevel::kAvx512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+// Whether this build and the CPU it runs on support the kernel of level
+inline bool SimdLevelSupported(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kScalar:
+      return true;
+#if defined(YOLOX_SIMD_NEON)
+    case SimdLevel::kNeon:
+      return true;
+#endif
+#if defined(YOLOX_SIMD_X86)
+    case SimdLevel::kAvx2:
+      return __builtin_cpu_supports("avx2");
+    case SimdLevel::kAvx512:
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+  }
+}
+
+// Fastest supported level, detected once
+inline SimdLevel BestSimdLevel() {
+  static const SimdLevel level = SimdLevelSupported(SimdLevel::kAvx512)
+      ? SimdLevel::kAvx512
+      : SimdLevelSupported(SimdLevel::kAvx2)
+      ? SimdLevel::kAvx2
+      : SimdLevelSupported(SimdLevel::kNeon) ? SimdLevel::kNeon
+                                             : SimdLevel::kScalar;
+  return level;
+}
+
+namespace detail {
+
+// The max scores below ignore NaN class scores like the per class products
+// of GenerateProposals(), whose comparisons are false for them
+template <typename Layout>
+inline bool
+IsCandidate(const Layout& layout, const float* row, float prob_threshold) {
+  const float objectness = row[Layout::kObjectnessChannel];
+  float class_max = -std::numeric_limits<float>::infinity();
+  for (int c = 0; c < layout.num_classes(); ++c) {
+    class_max = std::max(class_max, row[Layout::kClassChannel + c]);
+  }
+  return objectness * class_max > prob_threshold || objectness < 0.f;
+}
+
+template <typename Layout>
+void ScalarCandidates(
+    const Layout& layout,
+    const float* output,
+    int begin,
+    int end,
+    float prob_threshold,
+    std::vector<int>* candidates) {
+  for (int anchor = begin; anchor < end; ++anchor) {
+    const float* row =
+        output + static_cast<size_t>(anchor) * layout.num_channels();
+    if (IsCandidate(layout, row, prob_threshold)) {
+      candidates->push_back(anchor);
+    }
+  }
+}
+
+// Append anchor + k for every bit k set in mask
+inline void
+AppendLanes(unsigned mask, int anchor, std::vector<int>* candidates) {
+  while (mask != 0) {
+    candidates->push_back(anchor + __builtin_ctz(mask));
+    mask &= mask - 1;
+  }
+}
+
+#if defined(YOLOX_SIMD_X86)
+
+// Lane wise max of the class scores of one row.  max_ps returns its second
+// operand when either is NaN, so the accumulator goes second to skip NaNs
+YOLOX_TARGET_AVX2 inline __m256
+Avx2ClassMax(const float* scores, int num_classes) {
+  const __m256 lowest =
+      _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  __m256 result = lowest;
+  int c = 0;
+  for (; c + 8 <= num_classes; c += 8) {
+    result = _mm256_max_ps(_mm256_loadu_ps(scores + c), result);
+  }
+  if (c < num_classes) {
+    const __m256i mask = _mm256_cmpgt_epi32(
+        _mm256_set1_epi32(num_classes - c),
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256 tail = _mm256_blendv_ps(
+        lowest,
+        _mm256_maskload_ps(scores + c, mask),
+        _mm256_castsi256_ps(mask));
+    result = _mm256_max_ps(tail, result);
+  }
+  return result;
+}
+
+// Reduce 8 vectors to the vector of their 8 horizontal maxima
+YOLOX_TARGET_AVX2 inline __m256 Avx2HorizontalMax8(const __m256* v) {
+  const __m256 t0 = _mm256_max_ps(
+      _mm256_unpacklo_ps(v[0], v[1]), _mm256_unpackhi_ps(v[0], v[1]));
+  const __m256 t1 = _mm256_max_ps(
+      _mm256_unpacklo_ps(v[2], v[3]), _mm256_unpackhi_ps(v[2], v[3]));
+  const __m256 t2 = _mm256_max_ps(
+      _mm256_unpacklo_ps(v[4], v[5]), _mm256_unpackhi_ps(v[4], v[5]));
+  const __m256 t3 = _mm256_max_ps(
+      _mm256_unpacklo_ps(v[6], v[7]), _mm256_unpackhi_ps(v[6], v[7]));
+  const __m256 u0 = _mm256_max_ps(
+      _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0)),
+      _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2)));
+  const __m256 u1 = _mm256_max_ps(
+      _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0)),
+      _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2)));
+  return _mm256_max_ps(
+      _mm256_permute2f128_ps(u0, u1, 0x20),
+      _mm256_permute2f128_ps(u0, u1, 0x31));
+}
+
+// Candidate mask of the 8 anchors whose rows start at rows
+template <typename Layout>
+YOLOX_TARGET_AVX2 inline unsigned Avx2CandidateMask(
+    const Layout& layout,
+    const float* rows,
+    __m256 threshold) {
+  const int num_channels = layout.num_channels();
+  __m256 maxima[8];
+  for (int k = 0; k < 8; ++k) {
+    maxima[k] = Avx2ClassMax(
+        rows + k * num_channels + Layout::kClassChannel, layout.num_classes());
+  }
+  const __m256 class_max = Avx2HorizontalMax8(maxima);
+  const __m256i row_offsets = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+      _mm256_set1_epi32(num_channels));
+  const __m256 objectness = _mm256_i32gather_ps(
+      rows + Layout::kObjectnessChannel, row_offsets, 4);
+  const __m256 pass = _mm256_or_ps(
+      _mm256_cmp_ps(
+          _mm256_mul_ps(objectness, class_max), threshold, _CMP_GT_OQ),
+      _mm256_cmp_ps(objectness, _mm256_setzero_ps(), _CMP_LT_OQ));
+  return _mm256_movemask_ps(pass);
+}
+
+template <typename Layout>
+YOLOX_TARGET_AVX2 void Avx2Candidates(
+    const Layout& layout,
+    const float* output,
+    int begin,
+    int end,
+    float prob_threshold,
+    std::vector<int>* candidates) {
+  const __m256 threshold = _mm256_set1_ps(prob_threshold);
+  int anchor = begin;
+  for (; anchor + 8 <= end; anchor += 8) {
+    AppendLanes(
+        Avx2CandidateMask(
+            layout,
+            output + static_cast<size_t>(anchor) * layout.num_channels(),
+            threshold),
+        anchor,
+        candidates);
+  }
+  ScalarCandidates(layout, output, anchor, end, prob_threshold, candidates);
+}
+
+// GCC 12 flags the _mm512_undefined_* placeholders of its own intrinsics
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// Lane wise max of the class scores of one row, folded to 8 lanes for
+// Avx2HorizontalMax8()
+YOLOX_TARGET_AVX512 inline __m256
+Avx512ClassMax(const float* scores, int num_classes) {
+  const __m512 lowest =
+      _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  __m512 result = lowest;
+  int c = 0;
+  for (; c + 16 <= num_classes; c += 16) {
+    result = _mm512_max_ps(_mm512_loadu_ps(scores + c), result);
+  }
+  if (c < num_classes) {
+    const __mmask16 mask =
+        static_cast<__mmask16>((1u << (num_classes - c)) - 1);
+    result =
+        _mm512_max_ps(_mm512_mask_loadu_ps(lowest, mask, scores + c), result);
+  }
+  return _mm256_max_ps(
+      _mm512_castps512_ps256(result),
+      _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(result), 1)));
+}
+
+template <typename Layout>
+YOLOX_TARGET_AVX512 void Avx512Candidates(
+    const Layout& layout,
+    const float* output,
+    int begin,
+    int end,
+    float prob_threshold,
+    std::vector<int>* candidates) {
+  const int num_channels = layout.num_channels();
+  const __m512 threshold = _mm512_set1_ps(prob_threshold);
+  const __m512i row_offsets = _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm512_set1_epi32(num_channels));
+  int anchor = begin;
+  for (; anchor + 16 <= end; anchor += 16) {
+    const float* rows = output + static_cast<size_t>(anchor) * num_channels;
+    __m256 maxima[16];
+    for (int k = 0; k < 16; ++k) {
+      maxima[k] = Avx512ClassMax(
+          rows + k * num_channels + Layout::kClassChannel,
+          layout.num_classes());
+    }
+    const __m512 class_max = _mm512_castpd_ps(_mm512_insertf64x4(
+        _mm512_castps_pd(_mm512_castps256_ps512(Avx2HorizontalMax8(maxima))),
+        _mm256_castps_pd(Avx2HorizontalMax8(maxima + 8)),
+        1));
+    const __m512 objectness = _mm512_i32gather_ps(
+        row_offsets, rows + Layout::kObjectnessChannel, 4);
+    const __mmask16 pass =
+        _mm512_cmp_ps_mask(
+            _mm512_mul_ps(objectness, class_max), threshold, _CMP_GT_OQ) |
+        _mm512_cmp_ps_mask(objectness, _mm512_setzero_ps(), _CMP_LT_OQ);
+    AppendLanes(pass, anchor, candidates);
+  }
+  Avx2Candidates(layout, output, anchor, end, prob_threshold, candidates);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // YOLOX_SIMD_X86
+
+#if defined(YOLOX_SIMD_NEON)
+
+// maxnm returns the number when one operand is NaN
+inline float NeonClassMax(const float* scores, int num_classes) {
+  float32x4_t result = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+  int c = 0;
+  for (; c + 4 <= num_classes; c += 4) {
+    result = vmaxnmq_f32(result, vld1q_f32(scores + c));
+  }
+  float class_max = vmaxnmvq_f32(result);
+  for (; c < num_classes; ++c) {
+    class_max = std::max(class_max, scores[c]);
+  }
+  return class_max;
+}
+
+template <typename Layout>
+void NeonCandidates(
+    const Layout& layout,
+    const float* output,
+    int begin,
+    int end,
+    float prob_threshold,
+    std::vector<int>* candidates) {
+  const int num_channels = layout.num_channels();
+  const float32x4_t threshold = vdupq_n_f32(prob_threshold);
+  int anchor = begin;
+  for (; anchor + 4 <= end; anchor += 4) {
+    const float* rows = output + static_cast<size_t>(anchor) * num_channels;
+    float maxima[4];
+    float objectness[4];
+    for (int k = 0; k < 4; ++k) {
+      const float* row = rows + k * num_channels;
+      maxima[k] =
+          NeonClassMax(row + Layout::kClassChannel, layout.num_classes());
+      objectness[k] = row[Layout::kObjectnessChannel];
+    }
+    const float32x4_t object = vld1q_f32(objectness);
+    const uint32x4_t pass = vorrq_u32(
+        vcgtq_f32(vmulq_f32(object, vld1q_f32(maxima)), threshold),
+        vcltq_f32(object, vdupq_n_f32(0.f)));
+    const uint32x4_t bits = vandq_u32(pass, uint32x4_t{1, 2, 4, 8});
+    AppendLanes(vaddvq_u32(bits), anchor, candidates);
+  }
+  ScalarCandidates(layout, output, anchor, end, prob_threshold, candidates);
+}
+
+#endif // YOLOX_SIMD_NEON
+
+} // namespace detail
+
+// Fill candidates with the increasing indices of the anchors of the
+// num_anchors x layout.num_channels() head output that can yield a proposal
+// above prob_threshold.  Unsupported levels fall back to the scalar loop
+template <typename Layout>
+void FindCandidateAnchors(
+    const Layout& layout,
+    const float* output,
+    int num_anchors,
+    float prob_threshold,
+    std::vector<int>* candidates,
+    SimdLevel level = BestSimdLevel()) {
+  candidates->clear();
+  if (!SimdLevelSupported(level)) {
+    level = SimdLevel::kScalar;
+  }
+  switch (level) {
+#if defined(YOLOX_SIMD_X86)
+    case SimdLevel::kAvx512:
+      detail::Avx512Candidates(
+          layout, output, 0, num_anchors, prob_threshold, candidates);
+      return;
+    case SimdLevel::kAvx2:
+      detail::Avx2Candidates(
+          layout, output, 0, num_anchors, prob_threshold, candidates);
+      return;
+#endif
+#if defined(YOLOX_SIMD_NEON)
+    case SimdLevel::kNeon:
+      detail::NeonCandidates(
+          layout, output, 0, num_anchors, prob_threshold, candidates);
+      return;
+#endif
+    default:
+      detail::ScalarCandidates(
+          layout, output, 0, num_anchors, prob_threshold, candidates);
+  }
+}
+
+} // namespace yolox
@@ -0,0 +1,161 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#include <yolox_postprocess.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Time DecodeOutputs() on synthetic 640 x 640 head outputs of the deployed
+// layouts, with their compile time layout and with the generic one, and the
+// anchor grid and buffers kept across frames as a Decoder does.  Scores are
+// low except on a few hundred anchors, like the outputs of a trained model,
+// so the numbers reflect both the full anchor scan and the NMS of a realistic
+// proposal count.  The anchor grid build and the candidate anchor search of
+// each supported SIMD kernel are also timed.  Usage:
+// postprocess_benchmark [runs]
+namespace {
+
+template <int NumClasses, bool WithCorners>
+std::vector<float> SyntheticOutput(int num_anchors, std::mt19937* generator) {
+  typedef yolox::OutputLayout<NumClasses, WithCorners> Layout;
+  std::uniform_real_distribution<float> offset(-0.5f, 1.5f);
+  std::uniform_real_distribution<float> log_size(0.f, 2.5f);
+  std::uniform_real_distribution<float> low_score(0.f, 0.05f);
+  std::uniform_real_distribution<float> high_score(0.3f, 1.f);
+  std::uniform_int_distribution<int> positive(0, 31);
+  std::vector<float> output(num_anchors * Layout::kNumChannels);
+  for (int anchor = 0; anchor < num_anchors; ++anchor) {
+    float* row = &output[anchor * Layout::kNumChannels];
+    for (int k = 0; k < Layout::kObjectnessChannel; ++k) {
+      row[k] = offset(*generator);
+    }
+    row[2] = log_size(*generator);
+    row[3] = log_size(*generator);
+    const bool is_positive = positive(*generator) == 0;
+    row[Layout::kObjectnessChannel] =
+        is_positive ? high_score(*generator) : low_score(*generator);
+    for (int c = 0; c < NumClasses; ++c) {
+      row[Layout::kClassChannel + c] = low_score(*generator);
+    }
+    if (is_positive) {
+      row[Layout::kClassChannel + anchor % NumClasses] = high_score(*generator);
+    }
+  }
+  return output;
+}
+
+// Mean time in us of DecodeOutputs() with layout, and the anchor grid and
+// the buffers kept across frames
+template <typename Layout>
+double TimeDecode(
+    const Layout& layout,
+    const std::vector<float>& output,
+    int num_runs,
+    std::vector<yolox::Object<Layout::kWithCorners>>* objects) {
+  const yolox::AnchorGrid grid(640, 640);
+  yolox::DecodeWorkspace<Layout::kWithCorners> workspace;
+  // warm up the caches and the buffers
+  yolox::DecodeOutputs(
+      layout,
+      grid,
+      output.data(),
+      0.3f,
+      0.45f,
+      0.5f,
+      1280,
+      1280,
+      objects,
+      &workspace);
+  const auto start = std::chrono::steady_clock::now();
+  for (int run = 0; run < num_runs; ++run) {
+    yolox::DecodeOutputs(
+        layout,
+        grid,
+        output.data(),
+        0.3f,
+        0.45f,
+        0.5f,
+        1280,
+        1280,
+        objects,
+        &workspace);
+  }
+  const std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / num_runs;
+}
+
+template <int NumClasses, bool WithCorners>
+void Benchmark(const char* name, int num_runs) {
+  typedef yolox::OutputLayout<NumClasses, WithCorners> Layout;
+  std::mt19937 generator(0);
+  const std::vector<float> output =
+      SyntheticOutput<NumClasses, WithCorners>(8400, &generator);
+  std::vector<yolox::Object<WithCorners>> objects;
+  const double specialized_us =
+      TimeDecode(Layout(), output, num_runs, &objects);
+  std::printf(
+      "%-17s %9.1f us/frame  %zu objects\n",
+      name,
+      specialized_us,
+      objects.size());
+  const double generic_us = TimeDecode(
+      yolox::DynamicOutputLayout<WithCorners>(NumClasses),
+      output,
+      num_runs,
+      &objects);
+  std::printf("  generic layout    %9.1f us/frame\n", generic_us);
+
+  // what a decoder saves per frame by keeping its anchor grid
+  const auto grid_start = std::chrono::steady_clock::now();
+  for (int run = 0; run < num_runs; ++run) {
+    const yolox::AnchorGrid grid(640, 640);
+    if (grid.size() != 8400) {
+      std::abort();
+    }
+  }
+  const std::chrono::duration<double, std::micro> grid_elapsed =
+      std::chrono::steady_clock::now() - grid_start;
+  std::printf(
+      "  anchor grid build %9.1f us\n", grid_elapsed.count() / num_runs);
+
+  // the candidate search alone, for every kernel this CPU supports
+  const yolox::SimdLevel levels[] = {
+      yolox::SimdLevel::kScalar,
+      yolox::SimdLevel::kNeon,
+      yolox::SimdLevel::kAvx2,
+      yolox::SimdLevel::kAvx512};
+  std::vector<int> candidates;
+  for (const yolox::SimdLevel level : levels) {
+    if (!yolox::SimdLevelSupported(level)) {
+      continue;
+    }
+    const auto level_start = std::chrono::steady_clock::now();
+    for (int run = 0; run < num_runs; ++run) {
+      yolox::FindCandidateAnchors(
+          Layout(), output.data(), 8400, 0.3f, &candidates, level);
+    }
+    const std::chrono::duration<double, std::micro> level_elapsed =
+        std::chrono::steady_clock::now() - level_start;
+    std::printf(
+        "  candidates %-6s %9.1f us/frame  %zu anchors\n",
+        yolox::SimdLevelName(level),
+        level_elapsed.count() / num_runs,
+        candidates.size());
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  const int num_runs = argc > 1 ? std::atoi(argv[1]) : 200;
+  if (num_runs <= 0) {
+    std::fprintf(stderr, "usage: %s [runs]\n", argv[0]);
+    return 1;
+  }
+  Benchmark<80, false>("80 classes", num_runs);
+  Benchmark<6, true>("6 classes+corners", num_runs);
+  return 0;
+}
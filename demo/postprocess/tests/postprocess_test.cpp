@@ -0,0 +1,493 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#include <yolox_postprocess.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+// Heap allocations of the test so far, counted by the replacement operators
+// new below to check that the steady state decoding does not allocate.  Every
+// form of new and delete is replaced, so that all of them pair malloc with free
+static size_t allocation_count = 0;
+
+// Not inlined into the replacement operators delete, where GCC would see free()
+// of a block returned by operator new and warn about a mismatched deallocation
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void FreeBlock(void* block) {
+  std::free(block);
+}
+
+void* operator new(std::size_t size) {
+  ++allocation_count;
+  void* block = std::malloc(size > 0 ? size : 1);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* block) noexcept {
+  FreeBlock(block);
+}
+
+void operator delete[](void* block) noexcept {
+  FreeBlock(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept {
+  FreeBlock(block);
+}
+
+void operator delete[](void* block, std::size_t) noexcept {
+  FreeBlock(block);
+}
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT_TRUE(condition)                                        \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      ++failures;                                                     \
+    }                                                                 \
+  } while (0)
+
+#define EXPECT_NEAR(a, b) EXPECT_TRUE(std::fabs((a) - (b)) < 1e-4f)
+
+float Iou(const yolox::Rect& a, const yolox::Rect& b) {
+  const float inter = yolox::IntersectionArea(a, b);
+  return inter / (a.area() + b.area() - inter);
+}
+
+// Head output with every score 0, except for the anchors set by the tests
+template <int NumClasses, bool WithCorners>
+std::vector<float> EmptyOutput(int num_anchors) {
+  return std::vector<float>(
+      num_anchors * yolox::OutputLayout<NumClasses, WithCorners>::kNumChannels,
+      0.f);
+}
+
+void TestLayout() {
+  typedef yolox::OutputLayout<80, false> Boxes;
+  EXPECT_TRUE(Boxes::kObjectnessChannel == 4);
+  EXPECT_TRUE(Boxes::kClassChannel == 5);
+  EXPECT_TRUE(Boxes::kNumChannels == 85);
+  typedef yolox::OutputLayout<6, true> Corners;
+  EXPECT_TRUE(Corners::kObjectnessChannel == 12);
+  EXPECT_TRUE(Corners::kClassChannel == 13);
+  EXPECT_TRUE(Corners::kNumChannels == 19);
+}
+
+void TestGrids() {
+  const yolox::AnchorGrid grid(640, 640);
+  EXPECT_TRUE(grid.size() == 8400);
+  EXPECT_TRUE(grid.input_w() == 640 && grid.input_h() == 640);
+  // rows follow the cells of each stride in row major order
+  EXPECT_TRUE(grid.grid0()[1] == 1.f && grid.grid1()[1] == 0.f);
+  EXPECT_TRUE(grid.grid0()[80] == 0.f && grid.grid1()[80] == 1.f);
+  EXPECT_TRUE(grid.stride()[6400] == 16.f);
+  EXPECT_TRUE(grid.grid0()[8399] == 19.f);
+  EXPECT_TRUE(grid.stride()[8399] == 32.f);
+  for (const float* array : {grid.grid0(), grid.grid1(), grid.stride()}) {
+    EXPECT_TRUE(reinterpret_cast<uintptr_t>(array) % 64 == 0);
+  }
+
+  const yolox::AnchorGrid small_grid(416, 256);
+  EXPECT_TRUE(small_grid.size() == 52 * 32 + 26 * 16 + 13 * 8);
+  // copies get their own aligned storage
+  const yolox::AnchorGrid copy = small_grid;
+  EXPECT_TRUE(copy.size() == small_grid.size());
+  EXPECT_TRUE(copy.stride() != small_grid.stride());
+  EXPECT_TRUE(reinterpret_cast<uintptr_t>(copy.stride()) % 64 == 0);
+  EXPECT_TRUE(copy.grid1()[copy.size() - 1] == 7.f);
+}
+
+void TestProposals() {
+  typedef yolox::OutputLayout<3, true> Layout;
+  const yolox::AnchorGrid grid(64, 64);
+  std::vector<float> output = EmptyOutput<3, true>(grid.size());
+
+  // cell (2, 1) of the stride 8 map
+  float* row = &output[10 * Layout::kNumChannels];
+  row[0] = 0.5f;
+  row[1] = 0.25f;
+  row[2] = std::log(2.f);
+  row[3] = 0.f;
+  for (int k = 0; k < 4; ++k) {
+    row[4 + 2 * k] = k;
+    row[5 + 2 * k] = -k;
+  }
+  row[Layout::kObjectnessChannel] = 0.5f;
+  row[Layout::kClassChannel + 0] = 0.5f;
+  row[Layout::kClassChannel + 2] = 0.75f;
+
+  std::vector<yolox::Object<true>> proposals;
+  yolox::GenerateProposals(
+      Layout(), grid, output.data(), 0.3f, &proposals);
+  EXPECT_TRUE(proposals.size() == 1);
+  if (proposals.size() == 1) {
+    const yolox::Object<true>& object = proposals[0];
+    EXPECT_TRUE(object.label == 2);
+    EXPECT_NEAR(object.prob, 0.375f);
+    EXPECT_NEAR(object.rect.x, (2.5f * 8.f) - 8.f);
+    EXPECT_NEAR(object.rect.y, (1.25f * 8.f) - 4.f);
+    EXPECT_NEAR(object.rect.width, 16.f);
+    EXPECT_NEAR(object.rect.height, 8.f);
+    for (int k = 0; k < 4; ++k) {
+      EXPECT_NEAR(object.points[k].x, (k + 2) * 8.f);
+      EXPECT_NEAR(object.points[k].y, (1 - k) * 8.f);
+    }
+  }
+
+  // the threshold is exclusive, and proposals are appended
+  yolox::GenerateProposals(
+      Layout(), grid, output.data(), 0.375f, &proposals);
+  EXPECT_TRUE(proposals.size() == 1);
+  yolox::GenerateProposals(
+      Layout(), grid, output.data(), 0.2f, &proposals);
+  EXPECT_TRUE(proposals.size() == 3);
+}
+
+// Random head output with mostly low scores, a few negative objectness
+// values and NaN class scores
+template <typename Layout>
+std::vector<float> RandomOutput(int num_anchors, std::mt19937* generator) {
+  std::uniform_real_distribution<float> score(0.f, 1.f);
+  std::vector<float> output(num_anchors * Layout::kNumChannels);
+  for (float& value : output) {
+    value = score(*generator);
+    value = value * value * value;
+  }
+  for (int anchor = 0; anchor < num_anchors; anchor += 7) {
+    float* row = &output[anchor * Layout::kNumChannels];
+    if (anchor % 3 == 0) {
+      row[Layout::kObjectnessChannel] = -0.5f;
+    } else {
+      row[Layout::kClassChannel + anchor % Layout::kNumClasses] = NAN;
+    }
+  }
+  return output;
+}
+
+template <int NumClasses, bool WithCorners>
+void CheckCandidateKernels(int num_anchors) {
+  typedef yolox::OutputLayout<NumClasses, WithCorners> Layout;
+  std::mt19937 generator(NumClasses * 1000 + num_anchors);
+  const std::vector<float> output =
+      RandomOutput<Layout>(num_anchors, &generator);
+  const yolox::SimdLevel levels[] = {
+      yolox::SimdLevel::kNeon,
+      yolox::SimdLevel::kAvx2,
+      yolox::SimdLevel::kAvx512};
+  for (const float threshold : {0.f, 0.1f, 0.3f}) {
+    // every anchor that yields a proposal, and every negative objectness
+    std::vector<int> expected;
+    for (int anchor = 0; anchor < num_anchors; ++anchor) {
+      const float* row = &output[anchor * Layout::kNumChannels];
+      bool candidate = row[Layout::kObjectnessChannel] < 0.f;
+      for (int c = 0; c < NumClasses; ++c) {
+        candidate |= row[Layout::kObjectnessChannel] *
+                row[Layout::kClassChannel + c] > threshold;
+      }
+      if (candidate) {
+        expected.push_back(anchor);
+      }
+    }
+    std::vector<int> candidates;
+    yolox::FindCandidateAnchors(
+        Layout(),
+        output.data(),
+        num_anchors,
+        threshold,
+        &candidates,
+        yolox::SimdLevel::kScalar);
+    EXPECT_TRUE(candidates == expected);
+    for (const yolox::SimdLevel level : levels) {
+      if (!yolox::SimdLevelSupported(level)) {
+        continue;
+      }
+      yolox::FindCandidateAnchors(
+          Layout(), output.data(), num_anchors, threshold, &candidates, level);
+      std::vector<int> dynamic_candidates;
+      yolox::FindCandidateAnchors(
+          yolox::DynamicOutputLayout<WithCorners>(NumClasses),
+          output.data(),
+          num_anchors,
+          threshold,
+          &dynamic_candidates,
+          level);
+      if (candidates != expected || dynamic_candidates != expected) {
+        std::fprintf(
+            stderr,
+            "%s kernel differs for %d classes, %d anchors\n",
+            yolox::SimdLevelName(level),
+            NumClasses,
+            num_anchors);
+        ++failures;
+      }
+    }
+  }
+}
+
+void TestCandidateKernels() {
+  CheckCandidateKernels<80, false>(8400);
+  CheckCandidateKernels<80, false>(37);
+  CheckCandidateKernels<6, true>(8400);
+  CheckCandidateKernels<1, false>(100);
+  CheckCandidateKernels<17, true>(531);
+  CheckCandidateKernels<32, false>(16);
+}
+
+template <bool WithCorners>
+bool SameObjects(
+    const std::vector<yolox::Object<WithCorners>>& a,
+    const std::vector<yolox::Object<WithCorners>>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].label != b[i].label || a[i].prob != b[i].prob ||
+        a[i].rect.x != b[i].rect.x || a[i].rect.y != b[i].rect.y ||
+        a[i].rect.width != b[i].rect.width ||
+        a[i].rect.height != b[i].rect.height) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The dispatcher must give the results of the compile time instantiation,
+// both for the deployed class counts and through the generic path
+template <int NumClasses, bool WithCorners>
+void CheckDispatch() {
+  typedef yolox::OutputLayout<NumClasses, WithCorners> Layout;
+  std::mt19937 generator(NumClasses);
+  const std::vector<float> output = RandomOutput<Layout>(8400, &generator);
+  std::vector<yolox::Object<WithCorners>> expected;
+  yolox::DecodeOutputs<NumClasses, WithCorners>(
+      output.data(), 640, 640, 0.3f, 0.45f, 0.5f, 1280, 960, &expected);
+  std::vector<yolox::Object<WithCorners>> objects;
+  EXPECT_TRUE(yolox::DispatchDecodeOutputs<WithCorners>(
+      8400,
+      Layout::kNumChannels,
+      output.data(),
+      640,
+      640,
+      0.3f,
+      0.45f,
+      0.5f,
+      1280,
+      960,
+      &objects));
+  EXPECT_TRUE(!expected.empty());
+  EXPECT_TRUE(SameObjects(objects, expected));
+
+  // a decoder kept across frames gives the same objects on every frame
+  yolox::Decoder<WithCorners> decoder(640, 640);
+  for (int frame = 0; frame < 2; ++frame) {
+    EXPECT_TRUE(decoder.Decode(
+        8400,
+        Layout::kNumChannels,
+        output.data(),
+        0.3f,
+        0.45f,
+        0.5f,
+        1280,
+        960,
+        &objects));
+    EXPECT_TRUE(SameObjects(objects, expected));
+  }
+}
+
+void TestDispatch() {
+  CheckDispatch<80, false>();
+  CheckDispatch<6, true>();
+  CheckDispatch<20, false>();
+  CheckDispatch<1, true>();
+
+  std::vector<yolox::Object<true>> objects;
+  EXPECT_TRUE(!yolox::DispatchDecodeOutputs<true>(
+      8400, 13, nullptr, 640, 640, 0.3f, 0.45f, 1.f, 640, 640, &objects));
+  // the output of a model run at 416 x 416 does not match a 640 x 640 grid
+  const std::vector<float> output = EmptyOutput<6, true>(3549);
+  EXPECT_TRUE(!yolox::DispatchDecodeOutputs<true>(
+      3549, 19, output.data(), 640, 640, 0.3f, 0.45f, 1.f, 640, 640, &objects));
+}
+
+// Once a decoder has seen the frames of a stream, decoding them again must
+// not allocate: its buffers and the objects vector keep their capacity
+template <int NumClasses, bool WithCorners>
+void CheckSteadyStateAllocations() {
+  typedef yolox::OutputLayout<NumClasses, WithCorners> Layout;
+  std::mt19937 generator(NumClasses);
+  std::vector<std::vector<float>> frames;
+  for (int frame = 0; frame < 4; ++frame) {
+    frames.push_back(RandomOutput<Layout>(8400, &generator));
+  }
+  yolox::Decoder<WithCorners> decoder(640, 640);
+  std::vector<yolox::Object<WithCorners>> objects;
+  // warm up on every frame
+  for (const std::vector<float>& output : frames) {
+    decoder.Decode(
+        8400,
+        Layout::kNumChannels,
+        output.data(),
+        0.3f,
+        0.45f,
+        0.5f,
+        1280,
+        960,
+        &objects);
+  }
+  const size_t warm_allocation_count = allocation_count;
+  for (int run = 0; run < 3; ++run) {
+    for (const std::vector<float>& output : frames) {
+      decoder.Decode(
+          8400,
+          Layout::kNumChannels,
+          output.data(),
+          0.3f,
+          0.45f,
+          0.5f,
+          1280,
+          960,
+          &objects);
+    }
+  }
+  if (allocation_count != warm_allocation_count) {
+    std::fprintf(
+        stderr,
+        "%zu allocations after warmup for %d classes\n",
+        allocation_count - warm_allocation_count,
+        NumClasses);
+    ++failures;
+  }
+}
+
+void TestSteadyStateAllocations() {
+  CheckSteadyStateAllocations<80, false>();
+  CheckSteadyStateAllocations<6, true>();
+  // the generic layout of a class count without instantiation
+  CheckSteadyStateAllocations<20, false>();
+}
+
+void TestNms() {
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> position(0.f, 200.f);
+  std::uniform_real_distribution<float> size(10.f, 80.f);
+  std::uniform_real_distribution<float> score(0.f, 1.f);
+  std::vector<yolox::Object<false>> objects(500);
+  for (yolox::Object<false>& object : objects) {
+    object.rect = yolox::Rect{position(generator), position(generator),
+                              size(generator), size(generator)};
+    object.label = 0;
+    object.prob = score(generator);
+  }
+  yolox::SortByScore(&objects);
+  for (size_t i = 1; i < objects.size(); ++i) {
+    EXPECT_TRUE(objects[i - 1].prob >= objects[i].prob);
+  }
+
+  const float nms_threshold = 0.45f;
+  std::vector<int> picked;
+  yolox::NmsSortedBoxes(objects, nms_threshold, &picked);
+  EXPECT_TRUE(!picked.empty() && picked[0] == 0);
+  std::vector<bool> kept(objects.size(), false);
+  for (const int i : picked) {
+    kept[i] = true;
+  }
+  // kept objects overlap no earlier kept object, and every dropped object
+  // overlaps one
+  for (size_t i = 0; i < objects.size(); ++i) {
+    bool suppressed = false;
+    for (size_t j = 0; j < i; ++j) {
+      if (kept[j] && Iou(objects[i].rect, objects[j].rect) > nms_threshold) {
+        suppressed = true;
+      }
+    }
+    EXPECT_TRUE(kept[i] != suppressed);
+  }
+}
+
+void TestScaleAndClip() {
+  yolox::Object<true> object;
+  object.rect = yolox::Rect{-10.f, 20.f, 100.f, 300.f};
+  object.points[0] = yolox::Point{-4.f, 8.f};
+  object.points[1] = yolox::Point{40.f, 8.f};
+  object.points[2] = yolox::Point{40.f, 500.f};
+  object.points[3] = yolox::Point{-4.f, 500.f};
+  yolox::ScaleAndClip(0.5f, 300, 400, &object);
+  EXPECT_NEAR(object.rect.x, 0.f);
+  EXPECT_NEAR(object.rect.y, 40.f);
+  EXPECT_NEAR(object.rect.width, 180.f);
+  EXPECT_NEAR(object.rect.height, 399.f - 40.f);
+  EXPECT_NEAR(object.points[0].x, 0.f);
+  EXPECT_NEAR(object.points[1].x, 80.f);
+  EXPECT_NEAR(object.points[2].y, 399.f);
+  EXPECT_NEAR(object.points[3].y, 399.f);
+}
+
+void TestDecodeOutputs() {
+  typedef yolox::OutputLayout<80, false> Layout;
+  std::vector<float> output = EmptyOutput<80, false>(8400);
+  // two overlapping detections of class 7 on neighbouring cells and one of
+  // class 3 on the stride 32 map
+  const int anchors[] = {0, 1, 8399};
+  const int labels[] = {7, 7, 3};
+  const float scores[] = {0.9f, 0.6f, 0.5f};
+  for (int k = 0; k < 3; ++k) {
+    float* row = &output[anchors[k] * Layout::kNumChannels];
+    row[2] = std::log(4.f);
+    row[3] = std::log(4.f);
+    row[Layout::kObjectnessChannel] = 1.f;
+    row[Layout::kClassChannel + labels[k]] = scores[k];
+  }
+
+  std::vector<yolox::Object<false>> objects;
+  yolox::DecodeOutputs<80, false>(
+      output.data(), 640, 640, 0.3f, 0.45f, 0.5f, 1280, 960, &objects);
+  EXPECT_TRUE(objects.size() == 2);
+  if (objects.size() == 2) {
+    EXPECT_TRUE(objects[0].label == 7);
+    EXPECT_NEAR(objects[0].prob, 0.9f);
+    EXPECT_NEAR(objects[0].rect.x, 0.f);
+    EXPECT_NEAR(objects[0].rect.width, 32.f);
+    EXPECT_TRUE(objects[1].label == 3);
+    EXPECT_NEAR(objects[1].rect.x, (19.f * 32.f - 64.f) * 2.f);
+    EXPECT_NEAR(objects[1].rect.width, 1279.f - objects[1].rect.x);
+  }
+}
+
+} // namespace
+
+int main() {
+  TestLayout();
+  TestGrids();
+  TestProposals();
+  TestCandidateKernels();
+  TestDispatch();
+  TestSteadyStateAllocations();
+  TestNms();
+  TestScaleAndClip();
+  TestDecodeOutputs();
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf(
+      "all checks passed, best kernel %s\n",
+      yolox::SimdLevelName(yolox::BestSimdLevel()));
+  return 0;
+}
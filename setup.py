@@ -49,8 +49,9 @@ def get_ext_modules():
     if sys.platform != "win32":  # pre-compile ops on linux
         assert TORCH_AVAILABLE, "torch is required for pre-compiling ops, please install it first."
         # if any other op is added, please also add it here
-        from yolox.layers import FastCOCOEvalOp
+        from yolox.layers import FastCOCOEvalOp, FastVOCEvalOp
         ext_module.append(FastCOCOEvalOp().build_op())
+        ext_module.append(FastVOCEvalOp().build_op())
     return ext_module
 
 
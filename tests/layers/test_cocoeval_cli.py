@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# -*- coding:utf-8 -*-
+# Copyright (c) Megvii, Inc. and its affiliates.
+
+import json
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+import numpy as np
+
+from tests.layers.test_fast_coco_eval import make_coco_data, run_pycocotools
+
+TOOLS_DIR = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), os.pardir, os.pardir,
+    "yolox", "layers", "cocoeval", "tools",
+)
+
+
+class TestCOCOevalCLI(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        if shutil.which("cmake") is None:
+            raise unittest.SkipTest("cmake is required to build cocoeval_cli")
+        cls.build_dir = tempfile.TemporaryDirectory()
+        for command in (
+            ["cmake", "-S", TOOLS_DIR, "-B", cls.build_dir.name],
+            ["cmake", "--build", cls.build_dir.name],
+        ):
+            subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+        cls.cli = os.path.join(cls.build_dir.name, "cocoeval_cli")
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.build_dir.cleanup()
+
+    def setUp(self):
+        self.coco_gt, self.detections = make_coco_data()
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.annotations = self.write("annotations.json", json.dumps(self.coco_gt.dataset))
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def write(self, name, text):
+        path = os.path.join(self.tempdir.name, name)
+        with open(path, "w") as f:
+            f.write(text)
+        return path
+
+    def run_cli(self, *args):
+        return subprocess.run(
+            [self.cli, "--brief"] + list(args), stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            universal_newlines=True,
+        )
+
+    def brief_stats(self, *args):
+        result = self.run_cli(*args)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        lines = result.stdout.splitlines()
+        return [np.array([float(v) for v in line.split()[1:]]) for line in lines]
+
+    def test_stats(self):
+        expected = run_pycocotools(self.coco_gt, self.detections).stats
+        results = self.write("results.json", json.dumps(self.detections))
+        # one line of the 12 summarize() numbers per result file, printed with 6 decimals
+        for num_threads in ("1", "3"):
+            stats = self.brief_stats(
+                "--num-threads", num_threads, self.annotations, results, results
+            )
+            self.assertEqual(len(stats), 2)
+            for actual in stats:
+                np.testing.assert_allclose(actual, expected, rtol=0, atol=1e-6)
+
+    def test_string_escapes(self):
+        # escaped quotes, brackets and backslashes in skipped strings must not end them early, and
+        # escaped keys match like their decoded text
+        dataset = dict(self.coco_gt.dataset)
+        dataset["info"] = {"description": 'a "quoted" ] } , \\ name\n\t\u00e9\U0001f600'}
+        dataset["categories"] = [
+            dict(category, name='c"\\{}\u00e9'.format(category["id"]))
+            for category in dataset["categories"]
+        ]
+        text = json.dumps(dataset).replace('"image_id"', '"image\\u005fid"')
+        self.assertIn("\\ud83d\\ude00", text)
+        annotations = self.write("escaped.json", text)
+        results = self.write("results.json", json.dumps(self.detections))
+        np.testing.assert_array_equal(
+            self.brief_stats(annotations, results), self.brief_stats(self.annotations, results)
+        )
+
+        invalid = self.write("invalid.json", text.replace("\\u005f", "\\u00zz", 1))
+        result = self.run_cli(invalid, results)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("invalid unicode escape", result.stderr)
+
+    def test_errors(self):
+        detection = {"image_id": 1, "category_id": 1, "bbox": [1, 2, 30, 40], "score": 0.5}
+        unknown_image = dict(detection, image_id=max(self.coco_gt.getImgIds()) + 1)
+        for name, text, message in (
+            ("unknown_image", json.dumps([unknown_image]), "does not correspond"),
+            ("truncated", json.dumps(self.detections)[:-1], "unexpected end of input"),
+            ("truncated_number", json.dumps([detection])[:-4], "unexpected end of input"),
+            ("short_bbox", json.dumps([dict(detection, bbox=[1, 2, 3])]), "less than 4 values"),
+            ("long_bbox", json.dumps([dict(detection, bbox=[1, 2, 3, 4, 5])]),
+             "more than 4 values"),
+        ):
+            result = self.run_cli(self.annotations, self.write(name + ".json", text))
+            self.assertNotEqual(result.returncode, 0, name)
+            self.assertIn(message, result.stderr, name)
+
+        truncated = self.write("truncated.json", json.dumps(self.coco_gt.dataset)[:-100])
+        result = self.run_cli(truncated, self.write("results.json", json.dumps([detection])))
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("json:", result.stderr)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,376 @@
+#!/usr/bin/env python3
+# -*- coding:utf-8 -*-
+# Copyright (c) Megvii, Inc. and its affiliates.
+
+import contextlib
+import copy
+import io
+import unittest
+
+import numpy as np
+from pycocotools.coco import COCO
+from pycocotools.cocoeval import COCOeval
+
+from yolox.layers import COCOeval_opt, COCOevalStream
+from yolox.layers.fast_coco_eval_api import iou_threshold_index
+
+
+def quiet():
+    return contextlib.redirect_stdout(io.StringIO())
+
+
+def box_corners(bbox):
+    x, y, w, h = bbox
+    return [x, y, x + w, y, x + w, y + h, x, y + h]
+
+
+def make_coco_data(
+    num_images=24, num_categories=3, seed=0, extent=500, num_background=4, crowd_rate=0.05
+):
+    """
+    A small synthetic dataset: the ground truth COCO object and a list of bbox results that
+    mix jittered ground truth boxes, wrong categories and background boxes.  Boxes start in
+    [0, extent) and the "points" of every instance are its box corners.
+    """
+    rng = np.random.RandomState(seed)
+    images = [{"id": i + 1, "width": 640, "height": 480} for i in range(num_images)]
+    categories = [{"id": c + 1, "name": str(c + 1)} for c in range(num_categories)]
+    annotations, detections = [], []
+    for image in images:
+        for _ in range(rng.randint(0, 8)):
+            x, y = rng.uniform(0, extent), rng.uniform(0, extent)
+            w, h = rng.uniform(4, 140), rng.uniform(4, 130)
+            category_id = int(rng.randint(num_categories)) + 1
+            annotations.append({
+                "id": len(annotations) + 1,
+                "image_id": image["id"],
+                "category_id": category_id,
+                "bbox": [x, y, w, h],
+                "area": w * h,
+                "iscrowd": int(rng.rand() < crowd_rate),
+            })
+            for _ in range(rng.randint(0, 3)):
+                if rng.rand() < 0.1:
+                    category_id = int(rng.randint(num_categories)) + 1
+                detections.append({
+                    "image_id": image["id"],
+                    "category_id": category_id,
+                    "bbox": [
+                        x + rng.uniform(-0.2, 0.2) * w,
+                        y + rng.uniform(-0.2, 0.2) * h,
+                        w * rng.uniform(0.7, 1.3),
+                        h * rng.uniform(0.7, 1.3),
+                    ],
+                    "score": float(rng.rand()),
+                })
+        for _ in range(rng.randint(0, num_background + 1)):
+            detections.append({
+                "image_id": image["id"],
+                "category_id": int(rng.randint(num_categories)) + 1,
+                "bbox": [
+                    rng.uniform(0, extent), rng.uniform(0, extent),
+                    rng.uniform(4, 140), rng.uniform(4, 130),
+                ],
+                "score": float(rng.rand()),
+            })
+    for instance in annotations + detections:
+        instance["points"] = box_corners(instance["bbox"])
+
+    coco_gt = COCO()
+    coco_gt.dataset = {"images": images, "categories": categories, "annotations": annotations}
+    with quiet():
+        coco_gt.createIndex()
+    return coco_gt, detections
+
+
+def load_results(coco_gt, detections):
+    with quiet():
+        return coco_gt.loadRes(copy.deepcopy(detections))
+
+
+def run_eval(coco_eval):
+    with quiet():
+        coco_eval.evaluate()
+        coco_eval.accumulate()
+        coco_eval.summarize()
+    return coco_eval.stats
+
+
+def run_pycocotools(coco_gt, detections, iou_type="bbox", set_params=None):
+    coco_eval = COCOeval(coco_gt, load_results(coco_gt, detections), iou_type)
+    if set_params is not None:
+        set_params(coco_eval.params)
+    run_eval(coco_eval)
+    return coco_eval
+
+
+def run_opt(coco_gt, detections, iou_type="bbox", set_params=None, **kwargs):
+    coco_eval = COCOeval_opt(coco_gt, load_results(coco_gt, detections), iou_type, **kwargs)
+    if set_params is not None:
+        set_params(coco_eval.params)
+    run_eval(coco_eval)
+    return coco_eval
+
+
+def add_detections(stream, detections, image_ids):
+    image_ids = set(image_ids)
+    dets = [d for d in detections if d["image_id"] in image_ids]
+    stream.add_detections(
+        [d["image_id"] for d in dets],
+        [d["category_id"] for d in dets],
+        np.array([d["bbox"] for d in dets]).reshape(-1, 4),
+        [d["score"] for d in dets],
+    )
+
+
+class TestFastCOCOEval(unittest.TestCase):
+
+    def setUp(self):
+        self.coco_gt, self.detections = make_coco_data()
+        self.image_ids = sorted(self.coco_gt.getImgIds())
+
+    def assert_same_eval(self, actual, expected, exact=True):
+        """
+        Compare the accumulated results and stats of two evaluators, bit for bit if exact and
+        up to rounding otherwise.
+        """
+        for key in ("precision", "recall", "scores"):
+            if exact:
+                np.testing.assert_array_equal(actual.eval[key], expected.eval[key], err_msg=key)
+            else:
+                np.testing.assert_allclose(
+                    actual.eval[key], expected.eval[key], rtol=0, atol=1e-12, err_msg=key
+                )
+        np.testing.assert_allclose(actual.stats, expected.stats, rtol=0, atol=0 if exact else 1e-12)
+
+    def test_num_threads(self):
+        expected = run_pycocotools(self.coco_gt, self.detections)
+        single = run_opt(self.coco_gt, self.detections)
+        self.assert_same_eval(single, expected, exact=False)
+        # evaluate() and accumulate() give the same results with any number of threads
+        for num_threads in (3, 0):
+            multi = run_opt(self.coco_gt, self.detections, num_threads=num_threads)
+            self.assert_same_eval(multi, single)
+
+    def test_array_ingest(self):
+        coco_eval = run_opt(self.coco_gt, self.detections)
+        p = coco_eval._paramsEval
+        module = coco_eval.module
+
+        # the nested InstanceAnnotation input of the C++ evaluation before the array ingest,
+        # with IoUs from python and from C++
+        def nested_instances(instances, is_det=False):
+            return [
+                [
+                    [
+                        module.InstanceAnnotation(
+                            int(o["id"]),
+                            o["score"] if is_det else o.get("score", 0.0),
+                            o["area"],
+                            bool(o.get("iscrowd", 0)),
+                            bool(o.get("ignore", 0)),
+                            o["bbox"],
+                        )
+                        for o in instances[img_id, cat_id]
+                    ]
+                    for cat_id in p.catIds
+                ]
+                for img_id in p.imgIds
+            ]
+
+        gts = nested_instances(coco_eval._gts)
+        dts = nested_instances(coco_eval._dts, is_det=True)
+        ious = [
+            [coco_eval.computeIoU(img_id, cat_id) for cat_id in p.catIds] for img_id in p.imgIds
+        ]
+        for evaluations in (
+            module.COCOevalEvaluateImages(p.areaRng, p.maxDets[-1], p.iouThrs, ious, gts, dts),
+            module.COCOevalEvaluateBoxImages(p.areaRng, p.maxDets[-1], p.iouThrs, gts, dts),
+        ):
+            accumulated = module.COCOevalAccumulate(p, evaluations)
+            for key in ("precision", "recall", "scores"):
+                np.testing.assert_array_equal(accumulated[key], coco_eval.eval[key], err_msg=key)
+
+    def test_top_k_detections(self):
+        # far more detections per image and category than the largest maxDets, with many tied
+        # scores, which must be kept in the order of the stable sort of pycocotools
+        coco_gt, detections = make_coco_data(num_background=80)
+        for detection in detections:
+            detection["score"] = round(detection["score"], 1)
+
+        def set_params(p):
+            p.maxDets = [1, 3, 5]
+
+        expected = run_pycocotools(coco_gt, detections, set_params=set_params)
+        actual = run_opt(coco_gt, detections, set_params=set_params)
+        self.assert_same_eval(actual, expected, exact=False)
+
+    def test_sparse_and_dense_ious(self):
+        # mostly disjoint boxes keep sparse IoU tables, boxes crowded into a small region
+        # switch them to dense, and an IoU threshold of 0, where zero IoUs can match, builds
+        # dense tables from the start
+        crowded_gt, crowded_detections = make_coco_data(extent=40)
+
+        def set_params(p):
+            p.iouThrs = np.array([0.0, 0.5, 0.75])
+
+        for coco_gt, detections, params in (
+            (self.coco_gt, self.detections, None),
+            (crowded_gt, crowded_detections, None),
+            (self.coco_gt, self.detections, set_params),
+            (crowded_gt, crowded_detections, set_params),
+        ):
+            expected = run_pycocotools(coco_gt, detections, set_params=params)
+            actual = run_opt(coco_gt, detections, set_params=params)
+            self.assert_same_eval(actual, expected, exact=False)
+
+    def test_quad_ious(self):
+        # the quadrilaterals of box corners, listed clockwise in image coordinates, have the IoUs
+        # of the boxes, up to the rounding of the polygon clipping
+        expected = run_pycocotools(self.coco_gt, self.detections)
+        actual = run_opt(self.coco_gt, self.detections, iou_type="quad")
+        self.assert_same_eval(actual, expected, exact=False)
+
+    def test_corner_similarities(self):
+        # "corners" matches like the pycocotools keypoint OKS of the four corners, evaluated with
+        # the bbox area ranges and maxDets
+        for instance in self.coco_gt.dataset["annotations"] + self.detections:
+            points = instance["points"]
+            instance["keypoints"] = [
+                v for x, y in zip(points[0::2], points[1::2]) for v in (x, y, 2)
+            ]
+        for annotation in self.coco_gt.dataset["annotations"]:
+            annotation["num_keypoints"] = 4
+
+        def set_params(p):
+            p.maxDets = [1, 10, 100]
+            p.areaRng = [[0, 1e10], [0, 32 ** 2], [32 ** 2, 96 ** 2], [96 ** 2, 1e10]]
+            p.areaRngLbl = ["all", "small", "medium", "large"]
+            p.kpt_oks_sigmas = np.full(4, 0.025)
+
+        expected = run_pycocotools(
+            self.coco_gt, self.detections, iou_type="keypoints", set_params=set_params
+        )
+        actual = run_opt(self.coco_gt, self.detections, iou_type="corners")
+        # the stats differ, since pycocotools summarizes keypoints with its own maxDets
+        for key in ("precision", "recall", "scores"):
+            np.testing.assert_allclose(
+                actual.eval[key], expected.eval[key], rtol=0, atol=1e-12, err_msg=key
+            )
+
+    def test_bootstrap(self):
+        single = run_opt(self.coco_gt, self.detections)
+        multi = run_opt(self.coco_gt, self.detections, num_threads=4)
+        with quiet():
+            samples = single.bootstrap(num_samples=50, seed=3)["samples"]
+            repeated = single.bootstrap(num_samples=50, seed=3)["samples"]
+            threaded = multi.bootstrap(num_samples=50, seed=3)["samples"]
+            reseeded = single.bootstrap(num_samples=50, seed=4)["samples"]
+        self.assertEqual(samples.shape, (50, 12))
+        # the samples only depend on the seed, not on the number of threads
+        np.testing.assert_array_equal(repeated, samples)
+        np.testing.assert_array_equal(threaded, samples)
+        self.assertFalse(np.array_equal(reseeded, samples, equal_nan=True))
+
+        # without the IoU thresholds 0.5 and 0.75, AP50 and AP75 are undefined like in summarize()
+        def set_params(p):
+            p.iouThrs = np.array([0.6, 0.7, 0.8])
+
+        coco_eval = run_opt(self.coco_gt, self.detections, set_params=set_params)
+        np.testing.assert_array_equal(coco_eval.stats[1:3], [-1, -1])
+        with quiet():
+            samples = coco_eval.bootstrap(num_samples=20)["samples"]
+        self.assertTrue(np.all(np.isnan(samples[:, 1:3])))
+        self.assertFalse(np.any(np.isnan(samples[:, 0])))
+
+    def test_operating_points(self):
+        coco_eval = run_opt(self.coco_gt, self.detections)
+        # the last point of every curve keeps all detections, so its recall is that of accumulate()
+        for iou_thr in (0.5, 0.75):
+            t = iou_threshold_index(coco_eval.params.iouThrs, iou_thr)
+            with quiet():
+                curves = coco_eval.operating_points(iouThr=iou_thr)
+            for k, recalls in enumerate(curves["recall"]):
+                if len(recalls) > 0:
+                    self.assertAlmostEqual(recalls[-1], coco_eval.eval["recall"][t, k, 0, 2])
+        with self.assertRaises(ValueError):
+            coco_eval.operating_points(iouThr=0.3)
+
+    def test_analyze_errors(self):
+        single = run_opt(self.coco_gt, self.detections)
+        multi = run_opt(self.coco_gt, self.detections, num_threads=4)
+        with quiet():
+            errors = single.analyze_errors()
+            threaded = multi.analyze_errors()
+        num_categories = len(self.coco_gt.getCatIds())
+        self.assertEqual(errors["counts"].shape, (num_categories, len(errors["error_types"])))
+        self.assertTrue(np.all(errors["counts"] >= 0))
+        for key in ("counts", "ap", "fixed_ap", "dAP"):
+            np.testing.assert_array_equal(threaded[key], errors[key], err_msg=key)
+        # the background threshold must lie strictly between 0 and the IoU threshold
+        for bg_thr in (0.0, 0.5, 0.6):
+            with self.assertRaises(ValueError):
+                single.analyze_errors(iouThr=0.5, bgThr=bg_thr)
+        # an IoU threshold that is not evaluated is an error, not the breakdown at another one
+        with self.assertRaises(ValueError):
+            single.analyze_errors(iouThr=0.3, bgThr=0.1)
+        self.assertEqual(iou_threshold_index(single.params.iouThrs, 0.75), 5)
+
+    def test_stream_batches(self):
+        # batches of images in random order, where some images never get any detection
+        rng = np.random.RandomState(1)
+        image_ids = [i for i in rng.permutation(self.image_ids) if i % 5 != 0]
+        with quiet():
+            stream = COCOevalStream(self.coco_gt, num_threads=2)
+        added = []
+        for begin in range(0, len(image_ids), 4):
+            batch = image_ids[begin:begin + 4]
+            add_detections(stream, self.detections, batch)
+            added.extend(batch)
+            if len(added) == 8 or begin + 4 >= len(image_ids):
+                # images without added detections are evaluated as having none
+                detections = [d for d in self.detections if d["image_id"] in set(added)]
+                self.assertEqual(stream.num_detections, len(detections))
+                expected = run_opt(self.coco_gt, detections)
+                run_eval(stream)
+                self.assert_same_eval(stream, expected)
+
+    def test_stream_serialize_merge(self):
+        expected = run_eval(
+            COCOeval_opt(self.coco_gt, load_results(self.coco_gt, self.detections), "bbox")
+        )
+
+        # two ranks with alternating images in batches of three, where the second rank is
+        # padded with the first image like by a distributed sampler
+        shards = [self.image_ids[0::2], self.image_ids[1::2] + self.image_ids[:1]]
+        with quiet():
+            ranks = [COCOevalStream(self.coco_gt)]
+            ranks.append(COCOevalStream(self.coco_gt, prepared_gt=ranks[0].prepared_gt))
+            merged = COCOevalStream(self.coco_gt, prepared_gt=ranks[0].prepared_gt)
+        for rank, shard in zip(ranks, shards):
+            for begin in range(0, len(shard), 3):
+                add_detections(rank, self.detections, shard[begin:begin + 3])
+        for rank in ranks:
+            merged.merge(rank.serialize())
+
+        # the padded image is counted once
+        self.assertEqual(merged.num_detections, len(self.detections))
+        np.testing.assert_array_equal(run_eval(merged), expected)
+
+    def test_stream_merge_different_ground_truth(self):
+        coco_gt, _ = make_coco_data()
+        annotations = coco_gt.dataset["annotations"]
+        coco_gt.dataset["annotations"] = [
+            a for a in annotations if a["id"] != annotations[0]["id"]
+        ]
+        with quiet():
+            coco_gt.createIndex()
+            rank = COCOevalStream(self.coco_gt)
+            merged = COCOevalStream(coco_gt)
+        add_detections(rank, self.detections, self.image_ids)
+        with self.assertRaises(ValueError):
+            merged.merge(rank.serialize())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+# -*- coding:utf-8 -*-
+# Copyright (c) Megvii, Inc. and its affiliates.
+
+import contextlib
+import io
+import os
+import tempfile
+import unittest
+
+import numpy as np
+
+from yolox.evaluators.voc_eval import voc_eval, voc_eval_opt
+from yolox.layers import FastVOCEvalOp
+
+ANNOTATION = """<?xml version="1.0" encoding="utf-8"?>
+<!-- a comment with an <object> in it -->
+<annotation>
+  <filename>000001.jpg</filename>
+  <object>
+    <name> dog </name>
+    <difficult>0</difficult>
+    <bndbox>
+      <xmin>10.9</xmin><ymin>20</ymin><xmax>110</xmax><ymax>120</ymax>
+    </bndbox>
+    <part>
+      <name>head</name>
+      <bndbox><xmin>1</xmin><ymin>1</ymin><xmax>5</xmax><ymax>5</ymax></bndbox>
+    </part>
+  </object>
+  <object/>
+  <object>
+    <name>cat</name>
+    <difficult>1</difficult>
+    <bndbox><xmin>200</xmin><ymin>50</ymin><xmax>260</xmax><ymax>90</ymax></bndbox>
+  </object>
+  <object>
+    <name>horse</name>
+    <difficult>0</difficult>
+    <bndbox><xmin>0</xmin><ymin>0</ymin><xmax>50</xmax><ymax>50</ymax></bndbox>
+  </object>
+</annotation>
+"""
+
+OBJECT = """  <object>
+    <name>{}</name>
+    <pose>Unspecified</pose>
+    <truncated>0</truncated>
+    <difficult>{}</difficult>
+    <bndbox><xmin>{}</xmin><ymin>{}</ymin><xmax>{}</xmax><ymax>{}</ymax></bndbox>
+  </object>
+"""
+
+CLASSES = ("cat", "dog", "person")
+
+
+class TestFastVOCEval(unittest.TestCase):
+
+    def setUp(self):
+        self.module = FastVOCEvalOp().load()
+        self.tempdir = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def write_annotation(self, name, text):
+        path = os.path.join(self.tempdir.name, name + ".xml")
+        with open(path, "w") as f:
+            f.write(text)
+        return path
+
+    def test_parse_annotation(self):
+        path = self.write_annotation("000001", ANNOTATION)
+        annots = self.module.VOCevalLoadAnnotations(["000001"], [path], ["cat", "dog"])
+        # the empty object, the part box and the unknown class are skipped
+        self.assertEqual(annots.num_objects, 2)
+
+        # the dog box is truncated to integers like by the dataset loader, so only a detection
+        # of the truncated box matches at an IoU threshold close to 1
+        detections = {
+            "image_index": np.zeros(2, dtype=np.int64),
+            "label": np.array([1, 1], dtype=np.int64),
+            "score": np.array([0.9, 0.8]),
+            "bbox": np.array([[10, 20, 110, 120], [1, 1, 5, 5]], dtype=np.float64),
+        }
+        result = self.module.VOCevalEvaluate(annots, detections, [0.5, 0.995])
+        np.testing.assert_array_equal(result["num_positives"], [0, 1])
+        np.testing.assert_array_equal(result["ap"][:, 1], [1.0, 1.0])
+
+    def make_voc_data(self, num_images=16, seed=0):
+        """
+        Write the annotation files of a small synthetic image set, and return the image names,
+        the annotation paths and the detections of jittered and random boxes as
+        (image index, label, score, x1, y1, x2, y2) tuples.
+        """
+        rng = np.random.RandomState(seed)
+        names, paths, detections = [], [], []
+        for i in range(num_images):
+            objects = []
+            # the first image has a detected, non-difficult instance of every class
+            if i == 0:
+                labels = range(len(CLASSES))
+            else:
+                labels = rng.randint(len(CLASSES), size=rng.randint(1, 6))
+            for label in labels:
+                x1, y1 = rng.randint(0, 400, size=2)
+                x2, y2 = x1 + rng.randint(10, 150), y1 + rng.randint(10, 150)
+                difficult = int(i > 0 and rng.rand() < 0.15)
+                objects.append(OBJECT.format(CLASSES[label], difficult, x1, y1, x2, y2))
+                for _ in range(rng.randint(int(i == 0), 3)):
+                    box = np.array([x1, y1, x2, y2]) + rng.uniform(-4, 4, size=4)
+                    detections.append((i, label, rng.rand(), *box))
+            for _ in range(rng.randint(0, 4)):
+                x1, y1 = rng.uniform(0, 400, size=2)
+                box = (x1, y1, x1 + rng.uniform(10, 150), y1 + rng.uniform(10, 150))
+                detections.append((i, rng.randint(len(CLASSES)), rng.rand(), *box))
+            names.append("{:06d}".format(i))
+            paths.append(self.write_annotation(
+                names[-1], "<annotation>\n" + "".join(objects) + "</annotation>\n"
+            ))
+        # the boxes are rounded like in the results files read by voc_eval()
+        detections = [
+            (i, label, score, *(float("{:.1f}".format(v)) for v in box))
+            for i, label, score, *box in detections
+        ]
+        return names, paths, detections
+
+    def test_voc_eval(self):
+        names, paths, detections = self.make_voc_data()
+        root = self.tempdir.name
+        imageset = os.path.join(root, "imageset.txt")
+        with open(imageset, "w") as f:
+            f.write("\n".join(names) + "\n")
+        for label, cls in enumerate(CLASSES):
+            with open(os.path.join(root, "det_{}.txt".format(cls)), "w") as f:
+                for i, det_label, score, *box in detections:
+                    if det_label == label:
+                        line = "{} {!r} {:.1f} {:.1f} {:.1f} {:.1f}\n"
+                        f.write(line.format(names[i], score, *box))
+
+        columns = np.array(detections, dtype=np.float64).reshape(-1, 7)
+        arrays = {
+            "image_index": columns[:, 0].astype(np.int64),
+            "label": columns[:, 1].astype(np.int64),
+            "score": columns[:, 2],
+            "bbox": columns[:, 3:],
+        }
+        iou_thresholds = (0.5, 0.7)
+        for use_07_metric in (False, True):
+            recs, precs, aps = voc_eval_opt(
+                self.module, arrays, paths, names, CLASSES, os.path.join(root, "cache_opt"),
+                ovthreshs=iou_thresholds, use_07_metric=use_07_metric, num_threads=2,
+            )
+            for t, iou in enumerate(iou_thresholds):
+                for k, cls in enumerate(CLASSES):
+                    with contextlib.redirect_stdout(io.StringIO()):
+                        rec, prec, ap = voc_eval(
+                            os.path.join(root, "det_{}.txt"),
+                            os.path.join(root, "{}.xml"),
+                            imageset,
+                            cls,
+                            os.path.join(root, "cache"),
+                            ovthresh=iou,
+                            use_07_metric=use_07_metric,
+                        )
+                    np.testing.assert_allclose(recs[t][k], rec, rtol=0, atol=1e-12)
+                    np.testing.assert_allclose(precs[t][k], prec, rtol=0, atol=1e-12)
+                    self.assertAlmostEqual(aps[t][k], ap, places=12)
+
+    def test_parse_malformed_annotation(self):
+        path = self.write_annotation("000002", "<annotation><object><name>dog</name>")
+        with self.assertRaises(RuntimeError):
+            self.module.VOCevalLoadAnnotations(["000002"], [path], ["dog"])
+
+
+if __name__ == "__main__":
+    unittest.main()
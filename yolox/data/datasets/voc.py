@@ -15,7 +15,7 @@ from loguru import logger
 import cv2
 import numpy as np
 
-from yolox.evaluators.voc_eval import voc_eval
+from yolox.evaluators.voc_eval import voc_eval, voc_eval_opt
 
 from .datasets_wrapper import Dataset
 from .voc_classes import VOC_CLASSES
@@ -288,7 +288,56 @@ class VOCDetection(Dataset):
         for iou in IouTh:
             mAP = self._do_python_eval(output_dir, iou)
             mAPs.append(mAP)
+        return self._summarize_maps(mAPs)
 
+    def evaluate_detection_arrays(self, module, detections, output_dir=None):
+        """
+        Same as evaluate_detections() with the C++ VOC evaluator, which takes
+        the detections of all classes as flat arrays instead of results files.
+
+        module is the extension loaded by `yolox.layers.FastVOCEvalOp`, and
+        detections is a dict of the arrays "image_index" (index into
+        self.ids), "label", "score" and "bbox" (#dets x 4, x1y1x2y2).
+        """
+        name = self.image_set[0][1]
+        cachedir = os.path.join(
+            self.root, "annotations_cache", "VOC" + self._year, name
+        )
+        if not os.path.exists(cachedir):
+            os.makedirs(cachedir)
+        # match the +1 offset of the boxes in the results files
+        detections = dict(detections, bbox=detections["bbox"] + 1)
+        IouTh = np.linspace(
+            0.5, 0.95, int(np.round((0.95 - 0.5) / 0.05)) + 1, endpoint=True
+        )
+        # The PASCAL VOC metric changed in 2010
+        use_07_metric = True if int(self._year) < 2010 else False
+        recs, precs, aps = voc_eval_opt(
+            module,
+            detections,
+            [self._annopath % index for index in self.ids],
+            [index[1] for index in self.ids],
+            VOC_CLASSES,
+            cachedir,
+            ovthreshs=IouTh,
+            use_07_metric=use_07_metric,
+        )
+        for cls, ap in zip(VOC_CLASSES, aps[0]):
+            print("AP for {} = {:.4f}".format(cls, ap))
+        if output_dir is not None:
+            if not os.path.isdir(output_dir):
+                os.mkdir(output_dir)
+            for i, cls in enumerate(VOC_CLASSES):
+                with open(os.path.join(output_dir, cls + "_pr.pkl"), "wb") as f:
+                    pickle.dump({"rec": recs[0][i], "prec": precs[0][i], "ap": aps[0][i]}, f)
+        return self._summarize_maps(aps.mean(axis=1))
+
+    @staticmethod
+    def _summarize_maps(mAPs):
+        """
+        Print and return the mAP over IoU thresholds 0.5:0.95 and the mAP at 0.5, given the mAP
+        at each threshold.
+        """
         print("--------------------------------------------------------------")
         print("map_5095:", np.mean(mAPs))
         print("map_50:", mAPs[0])
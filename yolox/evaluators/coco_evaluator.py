@@ -76,6 +76,29 @@ def per_class_AP_table(coco_eval, class_names=COCO_CLASSES, headers=["class", "A
     return table
 
 
+def per_class_threshold_table(
+    coco_eval, class_names=COCO_CLASSES,
+    headers=["class", "score", "precision", "recall", "F1"], iou_thr=0.5,
+):
+    """
+    Confidence threshold with the best F1 score of every class at IoU iou_thr, e.g. for the
+    per class filtering of the deployed models.  Raises ValueError if iou_thr is not one of the
+    evaluated IoU thresholds.
+    """
+    curves = coco_eval.operating_points(iouThr=iou_thr)
+    assert len(class_names) == len(curves["best_score"])
+
+    keys = ("best_score", "best_precision", "best_recall", "best_f1")
+    rows = [
+        [name] + [float(curves[key][idx]) for key in keys]
+        for idx, name in enumerate(class_names)
+    ]
+    table = tabulate(
+        rows, tablefmt="pipe", floatfmt=".3f", headers=headers, numalign="left",
+    )
+    return table
+
+
 class COCOEvaluator:
     """
     COCO AP Evaluation class.  All the data in the val2017 dataset are processed
@@ -92,6 +115,8 @@ class COCOEvaluator:
         testdev: bool = False,
         per_class_AP: bool = False,
         per_class_AR: bool = False,
+        per_class_threshold: bool = False,
+        num_threads: int = 0,
     ):
         """
         Args:
@@ -103,6 +128,11 @@ class COCOEvaluator:
             nmsthre: IoU threshold of non-max supression ranging from 0 to 1.
             per_class_AP: Show per class AP during evalution or not. Default to False.
             per_class_AR: Show per class AR during evalution or not. Default to False.
+            per_class_threshold: Show the per class confidence threshold with the best F1 score
+                during evaluation or not, which needs COCOeval_opt. Default to False.
+            num_threads: threads of the C++ COCO evaluation once inference is done.
+                Non-positive values use all hardware threads. The detections evaluated
+                while inference runs use a single thread. Default to 0.
         """
         self.dataloader = dataloader
         self.img_size = img_size
@@ -112,6 +142,10 @@ class COCOEvaluator:
         self.testdev = testdev
         self.per_class_AP = per_class_AP
         self.per_class_AR = per_class_AR
+        self.per_class_threshold = per_class_threshold
+        self.num_threads = num_threads
+        # ground truth prepared by the first evaluation and reused by later ones
+        self.prepared_gt = None
 
     def evaluate(
         self, model, distributed=False, half=False, trt_file=None,
@@ -139,6 +173,11 @@ class COCOEvaluator:
         ids = []
         data_list = []
         output_data = defaultdict()
+        # detections are evaluated batch by batch by each rank, which only sends the
+        # results of its images to the main process
+        coco_eval = None
+        if not self.testdev:
+            coco_eval = self.create_stream_eval()
         progress_bar = tqdm if is_main_process() else iter
 
         inference_time = 0
@@ -181,20 +220,33 @@ class COCOEvaluator:
                     nms_end = time_synchronized()
                     nms_time += nms_end - infer_end
 
-            data_list_elem, image_wise_data = self.convert_to_coco_format(
-                outputs, info_imgs, ids, return_outputs=True)
-            data_list.extend(data_list_elem)
-            output_data.update(image_wise_data)
+            if coco_eval is not None:
+                coco_eval.add_detections(*self.convert_to_arrays(outputs, info_imgs, ids))
+                if return_outputs:
+                    _, image_wise_data = self.convert_to_coco_format(
+                        outputs, info_imgs, ids, return_outputs=True)
+                    output_data.update(image_wise_data)
+            else:
+                data_list_elem, image_wise_data = self.convert_to_coco_format(
+                    outputs, info_imgs, ids, return_outputs=True)
+                data_list.extend(data_list_elem)
+                output_data.update(image_wise_data)
 
         statistics = torch.cuda.FloatTensor([inference_time, nms_time, n_samples])
         if distributed:
-            data_list = gather(data_list, dst=0)
-            output_data = gather(output_data, dst=0)
-            data_list = list(itertools.chain(*data_list))
-            output_data = dict(ChainMap(*output_data))
+            if coco_eval is not None:
+                partials = gather(coco_eval.serialize(), dst=0)
+                for partial in partials[1:]:
+                    coco_eval.merge(partial)
+            else:
+                data_list = gather(data_list, dst=0)
+                data_list = list(itertools.chain(*data_list))
+            if return_outputs:
+                output_data = gather(output_data, dst=0)
+                output_data = dict(ChainMap(*output_data))
             torch.distributed.reduce(statistics, dst=0)
 
-        eval_results = self.evaluate_prediction(data_list, statistics)
+        eval_results = self.evaluate_prediction(data_list, statistics, coco_eval)
         synchronize()
 
         if return_outputs:
@@ -249,7 +301,51 @@ class COCOEvaluator:
             return data_list, image_wise_data
         return data_list
 
-    def evaluate_prediction(self, data_dict, statistics):
+    def create_stream_eval(self):
+        try:
+            from yolox.layers import COCOevalStream
+        except ImportError:
+            return None
+        # a single thread, not to compete with the inference and the dataloader workers
+        coco_eval = COCOevalStream(
+            self.dataloader.dataset.coco, num_threads=1, prepared_gt=self.prepared_gt
+        )
+        self.prepared_gt = coco_eval.prepared_gt
+        return coco_eval
+
+    def convert_to_arrays(self, outputs, info_imgs, ids):
+        """
+        Convert the outputs of a batch to the image ids, category ids, COCO format bboxes and
+        scores of all its detections, as taken by COCOevalStream.add_detections().
+        """
+        class_ids = np.asarray(self.dataloader.dataset.class_ids, dtype=np.int64)
+        image_ids, category_ids, bboxes, scores = [], [], [], []
+        for (output, img_h, img_w, img_id) in zip(
+            outputs, info_imgs[0], info_imgs[1], ids
+        ):
+            if output is None:
+                continue
+            output = output.cpu()
+
+            # preprocessing: resize
+            scale = min(
+                self.img_size[0] / float(img_h), self.img_size[1] / float(img_w)
+            )
+            bboxes.append(xyxy2xywh(output[:, 0:4] / scale).numpy())
+            scores.append((output[:, 4] * output[:, 5]).numpy())
+            category_ids.append(class_ids[output[:, 6].numpy().astype(np.int64)])
+            image_ids.append(np.full(output.shape[0], int(img_id), dtype=np.int64))
+
+        if not bboxes:
+            return [], [], np.zeros((0, 4)), []
+        return (
+            np.concatenate(image_ids),
+            np.concatenate(category_ids),
+            np.concatenate(bboxes),
+            np.concatenate(scores),
+        )
+
+    def evaluate_prediction(self, data_dict, statistics, coco_eval=None):
         if not is_main_process():
             return 0, 0, None
 
@@ -277,8 +373,13 @@ class COCOEvaluator:
         info = time_info + "\n"
 
         # Evaluate the Dt (detection) json comparing with the ground truth
-        if len(data_dict) > 0:
-            cocoGt = self.dataloader.dataset.coco
+        cocoGt = self.dataloader.dataset.coco
+        if coco_eval is not None:
+            # detections were already evaluated batch by batch
+            if coco_eval.num_detections == 0:
+                return 0, 0, info
+            cocoEval = coco_eval
+        elif len(data_dict) > 0:
             # TODO: since pycocotools can't process dict in py36, write data to json file.
             if self.testdev:
                 json.dump(data_dict, open("./yolox_testdev_2017.json", "w"))
@@ -288,27 +389,34 @@ class COCOEvaluator:
                 json.dump(data_dict, open(tmp, "w"))
                 cocoDt = cocoGt.loadRes(tmp)
             try:
-                from yolox.layers import COCOeval_opt as COCOeval
+                from yolox.layers import COCOeval_opt
+
+                cocoEval = COCOeval_opt(
+                    cocoGt, cocoDt, annType[1], num_threads=self.num_threads
+                )
             except ImportError:
                 from pycocotools.cocoeval import COCOeval
 
                 logger.warning("Use standard COCOeval.")
-
-            cocoEval = COCOeval(cocoGt, cocoDt, annType[1])
-            cocoEval.evaluate()
-            cocoEval.accumulate()
-            redirect_string = io.StringIO()
-            with contextlib.redirect_stdout(redirect_string):
-                cocoEval.summarize()
-            info += redirect_string.getvalue()
-            cat_ids = list(cocoGt.cats.keys())
-            cat_names = [cocoGt.cats[catId]['name'] for catId in sorted(cat_ids)]
-            if self.per_class_AP:
-                AP_table = per_class_AP_table(cocoEval, class_names=cat_names)
-                info += "per class AP:\n" + AP_table + "\n"
-            if self.per_class_AR:
-                AR_table = per_class_AR_table(cocoEval, class_names=cat_names)
-                info += "per class AR:\n" + AR_table + "\n"
-            return cocoEval.stats[0], cocoEval.stats[1], info
+                cocoEval = COCOeval(cocoGt, cocoDt, annType[1])
         else:
             return 0, 0, info
+
+        cocoEval.evaluate()
+        cocoEval.accumulate()
+        redirect_string = io.StringIO()
+        with contextlib.redirect_stdout(redirect_string):
+            cocoEval.summarize()
+        info += redirect_string.getvalue()
+        cat_ids = list(cocoGt.cats.keys())
+        cat_names = [cocoGt.cats[catId]['name'] for catId in sorted(cat_ids)]
+        if self.per_class_AP:
+            AP_table = per_class_AP_table(cocoEval, class_names=cat_names)
+            info += "per class AP:\n" + AP_table + "\n"
+        if self.per_class_AR:
+            AR_table = per_class_AR_table(cocoEval, class_names=cat_names)
+            info += "per class AR:\n" + AR_table + "\n"
+        if self.per_class_threshold and hasattr(cocoEval, "operating_points"):
+            threshold_table = per_class_threshold_table(cocoEval, class_names=cat_names)
+            info += "per class best F1 threshold:\n" + threshold_table + "\n"
+        return cocoEval.stats[0], cocoEval.stats[1], info
@@ -107,7 +107,7 @@ def voc_eval(
     for imagename in imagenames:
         R = [obj for obj in recs[imagename] if obj["name"] == classname]
         bbox = np.array([x["bbox"] for x in R])
-        difficult = np.array([x["difficult"] for x in R]).astype(np.bool)
+        difficult = np.array([x["difficult"] for x in R]).astype(bool)
         det = [False] * len(R)
         npos = npos + sum(~difficult)
         class_recs[imagename] = {"bbox": bbox, "difficult": difficult, "det": det}
@@ -181,3 +181,44 @@ def voc_eval(
     ap = voc_ap(rec, prec, use_07_metric)
 
     return rec, prec, ap
+
+
+def voc_eval_opt(
+    module,
+    detections,
+    annopaths,
+    imagenames,
+    classnames,
+    cachedir,
+    ovthreshs=(0.5,),
+    use_07_metric=False,
+    num_threads=0,
+):
+    """
+    Same as voc_eval() for all classes and IoU thresholds at once, implemented
+    in C++. The annotations are cached in a binary file, which is rebuilt when
+    the image set or the classes change.
+
+    Args:
+        module: extension loaded by `yolox.layers.FastVOCEvalOp`.
+        detections (dict): 1-D arrays "image_index" (index into imagenames),
+            "label" (index into classnames), "score" and the N x 4 array "bbox"
+            of all detections, in the pixel coordinates of the annotations.
+        annopaths (list): annotation file path of every image.
+        ovthreshs (tuple): IoU thresholds.
+        num_threads (int): non-positive values use all hardware threads.
+
+    Returns:
+        recs, precs (list): T x K nested lists of recall and precision arrays.
+        aps (ndarray): T x K average precisions.
+    """
+    if not os.path.isdir(cachedir):
+        os.mkdir(cachedir)
+    annots = module.VOCevalLoadAnnotations(
+        list(imagenames), list(annopaths), list(classnames),
+        os.path.join(cachedir, "annots.bin"), num_threads,
+    )
+    result = module.VOCevalEvaluate(
+        annots, detections, list(ovthreshs), use_07_metric, num_threads
+    )
+    return result["recall"], result["precision"], result["ap"]
@@ -37,6 +37,12 @@ class VOCEvaluator:
         self.nmsthre = nmsthre
         self.num_classes = num_classes
         self.num_images = len(dataloader.dataset)
+        try:
+            from yolox.layers import FastVOCEvalOp
+            self.voc_eval_module = FastVOCEvalOp().load()
+        except Exception:  # op can not be built, e.g., without a compiler
+            self.voc_eval_module = None
+            logger.warning("Use python VOC evaluation.")
 
     def evaluate(
         self, model, distributed=False, half=False, trt_file=None,
@@ -121,7 +127,7 @@ class VOCEvaluator:
         predictions = {}
         for output, img_h, img_w, img_id in zip(outputs, info_imgs[0], info_imgs[1], ids):
             if output is None:
-                predictions[int(img_id)] = (None, None, None)
+                predictions[int(img_id)] = (None, None, None, None)
                 continue
             output = output.cpu()
 
@@ -137,6 +143,27 @@ class VOCEvaluator:
             predictions[int(img_id)] = (bboxes, points, cls, scores)
         return predictions
 
+    def convert_to_arrays(self, data_dict):
+        """Concatenate the predictions of all images into flat numpy arrays."""
+        image_index = [np.zeros(0, dtype=np.int64)]
+        label = [np.zeros(0, dtype=np.int64)]
+        score = [np.zeros(0)]
+        bbox = [np.zeros((0, 4))]
+        for img_num in range(self.num_images):
+            bboxes, points, cls, scores = data_dict[img_num]
+            if bboxes is None:
+                continue
+            image_index.append(np.full(len(bboxes), img_num, dtype=np.int64))
+            label.append(cls.numpy().astype(np.int64))
+            score.append(scores.numpy().astype(np.float64))
+            bbox.append(bboxes.numpy().astype(np.float64))
+        return {
+            "image_index": np.concatenate(image_index),
+            "label": np.concatenate(label),
+            "score": np.concatenate(score),
+            "bbox": np.concatenate(bbox),
+        }
+
     def evaluate_prediction(self, data_dict, statistics):
         if not is_main_process():
             return 0, 0, None
@@ -161,6 +188,13 @@ class VOCEvaluator:
         )
         info = time_info + "\n"
 
+        if self.voc_eval_module is not None:
+            with tempfile.TemporaryDirectory() as tempdir:
+                mAP50, mAP70 = self.dataloader.dataset.evaluate_detection_arrays(
+                    self.voc_eval_module, self.convert_to_arrays(data_dict), tempdir
+                )
+                return mAP50, mAP70, info
+
         all_boxes = [
             [[] for _ in range(self.num_images)] for _ in range(self.num_classes)
         ]
@@ -5,9 +5,9 @@
 # import torch first to make jit op work without `ImportError of libc10.so`
 import torch  # noqa
 
-from .jit_ops import FastCOCOEvalOp, JitOp
+from .jit_ops import FastCOCOEvalOp, FastVOCEvalOp, JitOp
 
 try:
-    from .fast_coco_eval_api import COCOeval_opt
+    from .fast_coco_eval_api import COCOeval_opt, COCOevalStream
 except ImportError:  #  exception will be raised when users build yolox from source
     pass
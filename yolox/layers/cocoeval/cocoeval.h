@@ -5,94 +5,298 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
+#include "cocoeval_core.h"
 
 namespace py = pybind11;
 
 namespace COCOeval {
 
-// Annotation data for a single object instance in an image
-struct InstanceAnnotation {
-  InstanceAnnotation(
-      uint64_t id,
-      double score,
-      double area,
-      bool is_crowd,
-      bool ignore)
-      : id{id}, score{score}, area{area}, is_crowd{is_crowd}, ignore{ignore} {}
-  uint64_t id;
-  double score = 0.;
-  double area = 0.;
-  bool is_crowd = false;
-  bool ignore = false;
-};
+// Python entry point of PrepareGroundTruth() for a dict of instance arrays
+// like in EvaluateImageArrays().  The GIL is released once the arrays are read
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruthArrays(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    int num_images,
+    int num_categories,
+    bool use_categories,
+    const py::dict& ground_truth_arrays,
+    int num_threads = 1);
 
-// Stores intermediate results for evaluating detection results for a single
-// image that has D detected instances and G ground truth instances. This stores
-// matches between detected and ground truth instances
-struct ImageEvaluation {
-  // For each of the D detected instances, the id of the matched ground truth
-  // instance, or 0 if unmatched
-  std::vector<uint64_t> detection_matches;
+// Python entry point of EvaluateImages() for instances given as flat numpy
+// arrays rather than nested vectors of InstanceAnnotation objects, so that no
+// python object is created per instance.  ground_truth_arrays and
+// detection_arrays are dicts of equally long 1-D arrays with the keys
+// "image_index" (in [0, num_images)), "category_index" (in [0,
+// num_categories)), "id", and optionally "score", "area", "is_crowd",
+// "ignore", plus an N X 4 array "bbox" and an N X 8 array "corners".  The
+// instances are grouped with GroupInstances().  If image_category_ious is
+// None, IOUs are computed natively, of the bounding boxes if iou_type is
+// "bbox" or of the corner quadrilaterals (see EvaluateQuadrilateralImages())
+// if it is "quad".  If iou_type is "corners", the object keypoint similarity
+// of the corners with the 4 corner_sigmas is used instead (see
+// EvaluateCornerImages()).  Otherwise image_category_ious is used like in the
+// first version of EvaluateImages().  The GIL is released once the arrays are
+// read
+ImageEvaluations EvaluateImageArrays(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    int num_images,
+    int num_categories,
+    bool use_categories,
+    const py::dict& ground_truth_arrays,
+    const py::dict& detection_arrays,
+    const py::object& image_category_ious,
+    int num_threads = 1,
+    const std::string& iou_type = "bbox",
+    const std::vector<double>& corner_sigmas = {});
 
-  // The detection score of each of the D detected instances
-  std::vector<double> detection_scores;
+// Python entry point of IncrementalEvaluator::AddDetections() for a dict of
+// instance arrays like in EvaluateImageArrays().  The GIL is released once the
+// arrays are read
+void AddDetectionArrays(
+    IncrementalEvaluator& evaluator,
+    const py::dict& detection_arrays);
 
-  // Marks whether or not each of G instances was ignored from evaluation (e.g.,
-  // because it's outside area_range)
-  std::vector<bool> ground_truth_ignores;
+// Read the parameters used by COCOeval::Accumulate() from a python
+// COCOeval.Params object
+AccumulateParams ReadAccumulateParams(const py::object& params);
 
-  // Marks whether or not each of D instances was ignored from evaluation (e.g.,
-  // because it's outside aRng)
-  std::vector<bool> detection_ignores;
-};
+// Python entry point of COCOeval::Accumulate(), which releases the GIL while
+// accumulating and returns the results in the format of COCOeval.eval.  The
+// precision, recall and scores entries are numpy arrays that own the C++
+// buffers and already have their final shapes
+py::dict Accumulate(
+    const py::object& params,
+    const ImageEvaluations& evaluations,
+    int num_threads = 1);
 
-template <class T>
-using ImageCategoryInstances = std::vector<std::vector<std::vector<T>>>;
+// Python entry point of COCOeval::Bootstrap(), where each summary statistic is
+// a (average_precision, iou_threshold_index, area_range_index,
+// max_detections_index) tuple.  Releases the GIL while resampling and returns
+// the num_samples X len(stats) numpy array of the sampled statistics
+py::array_t<double> Bootstrap(
+    const py::object& params,
+    const ImageEvaluations& evaluations,
+    const std::vector<std::tuple<bool, int, int, int>>& stats,
+    int num_samples,
+    uint64_t seed = 0,
+    int num_threads = 1);
 
-// C++ implementation of COCO API cocoeval.py::COCOeval.evaluateImg().  For each
-// combination of image, category, area range settings, and IOU thresholds to
-// evaluate, it matches detected instances to ground truth instances and stores
-// the results into a vector of ImageEvaluation results, which will be
-// interpreted by the COCOeval::Accumulate() function to produce precion-recall
-// curves.  The parameters of nested vectors have the following semantics:
-//   image_category_ious[i][c][d][g] is the intersection over union of the d'th
-//     detected instance and g'th ground truth instance of
-//     category category_ids[c] in image image_ids[i]
-//   image_category_ground_truth_instances[i][c] is a vector of ground truth
-//     instances in image image_ids[i] of category category_ids[c]
-//   image_category_detection_instances[i][c] is a vector of detected
-//     instances in image image_ids[i] of category category_ids[c]
-std::vector<ImageEvaluation> EvaluateImages(
-    const std::vector<std::array<double, 2>>& area_ranges, // vector of 2-tuples
-    int max_detections,
-    const std::vector<double>& iou_thresholds,
-    const ImageCategoryInstances<std::vector<double>>& image_category_ious,
-    const ImageCategoryInstances<InstanceAnnotation>&
-        image_category_ground_truth_instances,
-    const ImageCategoryInstances<InstanceAnnotation>&
-        image_category_detection_instances);
+// Python entry point of COCOeval::ComputeOperatingCurves(), which releases the
+// GIL while computing the curves.  Returns a dict with the per category numpy
+// arrays "num_ground_truth", "best_score", "best_precision", "best_recall" and
+// "best_f1", and the per category lists of curve arrays "scores", "precision",
+// "recall" and "f1"
+py::dict OperatingCurves(
+    const py::object& params,
+    const ImageEvaluations& evaluations,
+    int iou_threshold_index,
+    int area_range_index,
+    int max_detections_index,
+    int num_threads = 1);
 
-// C++ implementation of COCOeval.accumulate(), which generates precision
-// recall curves for each set of category, IOU threshold, detection area range,
-// and max number of detections parameters.  It is assumed that the parameter
-// evaluations is the return value of the functon COCOeval::EvaluateImages(),
-// which was called with the same parameter settings params
-py::dict Accumulate(
+// Python entry point of COCOeval::AnalyzeErrors() for the bounding box
+// detections given as a dict of instance arrays like in EvaluateImageArrays(),
+// which must be the detections evaluations were computed from.  Releases the
+// GIL once the arrays are read, and returns a dict with the error type names
+// "error_types", and the numpy arrays "counts" and "fixed_ap" (num_categories
+// X num_error_types) and "ap" (num_categories)
+py::dict AnalyzeErrorArrays(
+    const PreparedGroundTruth& ground_truth,
+    const py::dict& detection_arrays,
+    const ImageEvaluations& evaluations,
     const py::object& params,
-    const std::vector<ImageEvaluation>& evalutations);
+    int iou_threshold_index,
+    double background_iou = 0.1,
+    int area_range_index = 0,
+    int num_threads = 1);
 
 } // namespace COCOeval
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
-    m.def("COCOevalAccumulate", &COCOeval::Accumulate, "COCOeval::Accumulate");
+    m.def(
+        "COCOevalAccumulate",
+        pybind11::overload_cast<
+            const pybind11::object&,
+            const COCOeval::ImageEvaluations&,
+            int>(&COCOeval::Accumulate),
+        "COCOeval::Accumulate",
+        pybind11::arg("params"),
+        pybind11::arg("evaluations"),
+        pybind11::arg("num_threads") = 1);
+    m.def(
+        "COCOevalBootstrap",
+        pybind11::overload_cast<
+            const pybind11::object&,
+            const COCOeval::ImageEvaluations&,
+            const std::vector<std::tuple<bool, int, int, int>>&,
+            int,
+            uint64_t,
+            int>(&COCOeval::Bootstrap),
+        "COCOeval::Bootstrap",
+        pybind11::arg("params"),
+        pybind11::arg("evaluations"),
+        pybind11::arg("stats"),
+        pybind11::arg("num_samples"),
+        pybind11::arg("seed") = 0,
+        pybind11::arg("num_threads") = 1);
+    m.def(
+        "COCOevalOperatingCurves",
+        &COCOeval::OperatingCurves,
+        "COCOeval::ComputeOperatingCurves",
+        pybind11::arg("params"),
+        pybind11::arg("evaluations"),
+        pybind11::arg("iou_threshold_index"),
+        pybind11::arg("area_range_index"),
+        pybind11::arg("max_detections_index"),
+        pybind11::arg("num_threads") = 1);
+    m.def(
+        "COCOevalAnalyzeErrors",
+        &COCOeval::AnalyzeErrorArrays,
+        "COCOeval::AnalyzeErrors with detections given as numpy arrays",
+        pybind11::arg("ground_truth"),
+        pybind11::arg("detection_arrays"),
+        pybind11::arg("evaluations"),
+        pybind11::arg("params"),
+        pybind11::arg("iou_threshold_index"),
+        pybind11::arg("background_iou") = 0.1,
+        pybind11::arg("area_range_index") = 0,
+        pybind11::arg("num_threads") = 1);
     m.def(
         "COCOevalEvaluateImages",
-        &COCOeval::EvaluateImages,
-        "COCOeval::EvaluateImages");
+        pybind11::overload_cast<
+            const std::vector<std::array<double, 2>>&,
+            int,
+            const std::vector<double>&,
+            const COCOeval::ImageCategoryInstances<std::vector<double>>&,
+            const COCOeval::ImageCategoryInstances<
+                COCOeval::InstanceAnnotation>&,
+            const COCOeval::ImageCategoryInstances<
+                COCOeval::InstanceAnnotation>&,
+            int>(&COCOeval::EvaluateImages),
+        "COCOeval::EvaluateImages",
+        pybind11::arg("area_ranges"),
+        pybind11::arg("max_detections"),
+        pybind11::arg("iou_thresholds"),
+        pybind11::arg("image_category_ious"),
+        pybind11::arg("image_category_ground_truth_instances"),
+        pybind11::arg("image_category_detection_instances"),
+        pybind11::arg("num_threads") = 1,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def(
+        "COCOevalEvaluateBoxImages",
+        pybind11::overload_cast<
+            const std::vector<std::array<double, 2>>&,
+            int,
+            const std::vector<double>&,
+            const COCOeval::ImageCategoryInstances<
+                COCOeval::InstanceAnnotation>&,
+            const COCOeval::ImageCategoryInstances<
+                COCOeval::InstanceAnnotation>&,
+            int>(&COCOeval::EvaluateImages),
+        "COCOeval::EvaluateImages with bounding box IOUs computed in C++",
+        pybind11::arg("area_ranges"),
+        pybind11::arg("max_detections"),
+        pybind11::arg("iou_thresholds"),
+        pybind11::arg("image_category_ground_truth_instances"),
+        pybind11::arg("image_category_detection_instances"),
+        pybind11::arg("num_threads") = 1,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def(
+        "COCOevalEvaluateImageArrays",
+        &COCOeval::EvaluateImageArrays,
+        "COCOeval::EvaluateImages with instances given as numpy arrays",
+        pybind11::arg("area_ranges"),
+        pybind11::arg("max_detections"),
+        pybind11::arg("iou_thresholds"),
+        pybind11::arg("num_images"),
+        pybind11::arg("num_categories"),
+        pybind11::arg("use_categories"),
+        pybind11::arg("ground_truth_arrays"),
+        pybind11::arg("detection_arrays"),
+        pybind11::arg("image_category_ious") = pybind11::none(),
+        pybind11::arg("num_threads") = 1,
+        pybind11::arg("iou_type") = "bbox",
+        pybind11::arg("corner_sigmas") = std::vector<double>());
+    m.def(
+        "COCOevalPrepareGroundTruth",
+        &COCOeval::PrepareGroundTruthArrays,
+        "COCOeval::PrepareGroundTruth with instances given as numpy arrays",
+        pybind11::arg("area_ranges"),
+        pybind11::arg("num_images"),
+        pybind11::arg("num_categories"),
+        pybind11::arg("use_categories"),
+        pybind11::arg("ground_truth_arrays"),
+        pybind11::arg("num_threads") = 1);
+    pybind11::class_<
+        COCOeval::PreparedGroundTruth,
+        std::shared_ptr<COCOeval::PreparedGroundTruth>>(
+        m, "PreparedGroundTruth")
+        .def_readonly("area_ranges", &COCOeval::PreparedGroundTruth::area_ranges)
+        .def_readonly("num_images", &COCOeval::PreparedGroundTruth::num_images)
+        .def_readonly(
+            "num_categories", &COCOeval::PreparedGroundTruth::num_categories)
+        .def_readonly(
+            "use_categories", &COCOeval::PreparedGroundTruth::use_categories);
+    pybind11::class_<COCOeval::IncrementalEvaluator>(
+        m, "COCOevalIncrementalEvaluator")
+        .def(
+            pybind11::init<
+                std::shared_ptr<COCOeval::PreparedGroundTruth>,
+                int,
+                const std::vector<double>&,
+                int>(),
+            pybind11::arg("ground_truth"),
+            pybind11::arg("max_detections"),
+            pybind11::arg("iou_thresholds"),
+            pybind11::arg("num_threads") = 1)
+        .def(
+            "add_detections",
+            &COCOeval::AddDetectionArrays,
+            pybind11::arg("detection_arrays"))
+        .def(
+            "serialize",
+            [](const COCOeval::IncrementalEvaluator& evaluator) {
+              std::string partial;
+              {
+                pybind11::gil_scoped_release release;
+                partial = evaluator.SerializePartial();
+              }
+              return pybind11::bytes(partial);
+            })
+        .def(
+            "merge",
+            [](COCOeval::IncrementalEvaluator& evaluator,
+               const pybind11::bytes& partial) {
+              std::string data = partial;
+              pybind11::gil_scoped_release release;
+              evaluator.MergePartial(data);
+            },
+            pybind11::arg("partial"))
+        .def(
+            "evaluations",
+            &COCOeval::IncrementalEvaluator::Evaluations,
+            pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def_property_readonly(
+            "num_evaluated_images",
+            &COCOeval::IncrementalEvaluator::num_evaluated_images)
+        .def_property_readonly(
+            "num_detections", &COCOeval::IncrementalEvaluator::num_detections);
     pybind11::class_<COCOeval::InstanceAnnotation>(m, "InstanceAnnotation")
-        .def(pybind11::init<uint64_t, double, double, bool, bool>());
-    pybind11::class_<COCOeval::ImageEvaluation>(m, "ImageEvaluation")
+        .def(pybind11::init<uint64_t, double, double, bool, bool>())
+        .def(pybind11::init<
+             uint64_t,
+             double,
+             double,
+             bool,
+             bool,
+             const std::array<double, 4>&>());
+    pybind11::class_<COCOeval::ImageEvaluations>(m, "ImageEvaluations")
         .def(pybind11::init<>());
 }
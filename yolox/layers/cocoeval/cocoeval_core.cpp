@@ -0,0 +1,2541 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved
+#include "cocoeval_core.h"
+#include "../common/eval_utils.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace COCOeval {
+
+using EvalCommon::ParallelFor;
+using EvalCommon::ReadValues;
+using EvalCommon::ResolveNumThreads;
+using EvalCommon::WriteValues;
+
+// Sort detections from highest score to lowest, such that
+// detection_instances[detection_sorted_indices[t]] >=
+// detection_instances[detection_sorted_indices[t+1]], and keep at most the
+// max_detections highest scoring ones.  Use stable_sort to match original COCO
+// API.  When only a small prefix is kept, a partial sort that breaks ties by
+// index selects the same prefix in the same order at a fraction of the cost
+// (it is only faster once the prefix is less than about a quarter of the list)
+void SortInstancesByDetectionScore(
+    const std::vector<InstanceAnnotation>& detection_instances,
+    int max_detections,
+    std::vector<uint64_t>* detection_sorted_indices) {
+  const size_t num_kept =
+      std::min<size_t>(detection_instances.size(), std::max(max_detections, 0));
+  detection_sorted_indices->resize(detection_instances.size());
+  std::iota(
+      detection_sorted_indices->begin(), detection_sorted_indices->end(), 0);
+  if (4 * num_kept < detection_instances.size()) {
+    std::partial_sort(
+        detection_sorted_indices->begin(),
+        detection_sorted_indices->begin() + num_kept,
+        detection_sorted_indices->end(),
+        [&detection_instances](size_t j1, size_t j2) {
+          return detection_instances[j1].score >
+              detection_instances[j2].score ||
+              (detection_instances[j1].score ==
+                   detection_instances[j2].score &&
+               j1 < j2);
+        });
+    detection_sorted_indices->resize(num_kept);
+    return;
+  }
+  std::stable_sort(
+      detection_sorted_indices->begin(),
+      detection_sorted_indices->end(),
+      [&detection_instances](size_t j1, size_t j2) {
+        return detection_instances[j1].score > detection_instances[j2].score;
+      });
+  detection_sorted_indices->resize(num_kept);
+}
+
+// Partition the ground truth objects based on whether or not to ignore them
+// based on area.  Both outputs have one element per ground truth instance
+void SortInstancesByIgnore(
+    const std::array<double, 2>& area_range,
+    const std::vector<InstanceAnnotation>& ground_truth_instances,
+    uint64_t* ground_truth_sorted_indices,
+    uint8_t* ignores) {
+  const int num_ground_truth = ground_truth_instances.size();
+  for (auto g = 0; g < num_ground_truth; ++g) {
+    const InstanceAnnotation& o = ground_truth_instances[g];
+    ignores[g] = o.ignore || o.area < area_range[0] || o.area > area_range[1];
+  }
+
+  std::iota(
+      ground_truth_sorted_indices,
+      ground_truth_sorted_indices + num_ground_truth,
+      0);
+  std::stable_sort(
+      ground_truth_sorted_indices,
+      ground_truth_sorted_indices + num_ground_truth,
+      [ignores](size_t j1, size_t j2) {
+        return (int)ignores[j1] < (int)ignores[j2];
+      });
+}
+
+// Intersection over unions of the D sorted detected instances and the G ground
+// truth instances of one image and category.  In dense scenes most pairs do
+// not overlap at all, so the IOUs are collected in compressed sparse row
+// format, where row d holds the nonzero IOUs values[row_offsets[d]] to
+// values[row_offsets[d + 1] - 1] of ground truth instances columns[...], as
+// long as few enough of them are nonzero.  Otherwise they are written to the
+// row-major D X G matrix dense (see AppendIouRow())
+struct IouMatrix {
+  int num_detections = 0;
+  int num_ground_truth = 0;
+  // Matching in sparse format skips the zero IOUs, which is only exact as long
+  // as a zero IOU can never be a match, i.e. every IOU threshold is positive
+  bool allow_sparse = true;
+  bool sparse = false;
+  // Number of rows appended so far
+  int num_rows = 0;
+  std::vector<double> dense;
+  std::vector<int64_t> row_offsets;
+  std::vector<int> columns;
+  std::vector<double> values;
+};
+
+// Start collecting the IOUs of num_detections X num_ground_truth instances,
+// in sparse format if allowed
+void ResetIouMatrix(int num_detections, int num_ground_truth, IouMatrix* ious) {
+  ious->num_detections = num_detections;
+  ious->num_ground_truth = num_ground_truth;
+  ious->sparse = ious->allow_sparse;
+  ious->num_rows = 0;
+  ious->row_offsets.assign(1, 0);
+  ious->columns.clear();
+  ious->values.clear();
+  if (!ious->sparse) {
+    ious->dense.resize(static_cast<int64_t>(num_detections) * num_ground_truth);
+  }
+}
+
+// Storage for the num_ground_truth IOUs of the next detected instance, which
+// is the next row of the dense matrix once it is dense, so that the row is
+// written in place, and else row
+double* IouRowStorage(std::vector<double>* row, IouMatrix* ious) {
+  if (!ious->sparse) {
+    return ious->dense.data() +
+        static_cast<int64_t>(ious->num_rows) * ious->num_ground_truth;
+  }
+  row->resize(ious->num_ground_truth);
+  return row->data();
+}
+
+// Switch a sparse matrix to the dense format, with its rows so far expanded
+void ExpandIouMatrix(IouMatrix* ious) {
+  ious->sparse = false;
+  ious->dense.assign(
+      static_cast<int64_t>(ious->num_detections) * ious->num_ground_truth, 0.);
+  for (auto d = 0; d < ious->num_rows; ++d) {
+    for (auto k = ious->row_offsets[d]; k < ious->row_offsets[d + 1]; ++k) {
+      ious->dense[d * ious->num_ground_truth + ious->columns[k]] =
+          ious->values[k];
+    }
+  }
+}
+
+// Append the next detected instance, given all of its num_ground_truth IOUs
+// in row, e.g. the storage of IouRowStorage().  Sparse matching pays off when
+// less than about a quarter of the IOUs are nonzero, so once more of them are
+// nonzero, the matrix switches to the dense format for good and the later
+// rows are written to it directly
+void AppendIouRow(const double* row, IouMatrix* ious) {
+  const int num_ground_truth = ious->num_ground_truth;
+  if (ious->sparse) {
+    for (auto g = 0; g < num_ground_truth; ++g) {
+      if (row[g] != 0.) {
+        ious->columns.push_back(g);
+        ious->values.push_back(row[g]);
+      }
+    }
+    ious->row_offsets.push_back(ious->values.size());
+    ++ious->num_rows;
+    if (4 * static_cast<int64_t>(ious->values.size()) >
+        static_cast<int64_t>(ious->num_detections) * num_ground_truth) {
+      ExpandIouMatrix(ious);
+    }
+    return;
+  }
+  double* dense_row = ious->dense.data() +
+      static_cast<int64_t>(ious->num_rows) * num_ground_truth;
+  if (row != dense_row) {
+    std::copy(row, row + num_ground_truth, dense_row);
+  }
+  ++ious->num_rows;
+}
+
+// Unpack the bounding boxes of ground truth instances into the columns x0,
+// y0, x1, y1, area, and crowd flag of ComputeBoxIous(), each holding one value
+// per instance
+void ComputeBoxColumns(
+    const std::vector<InstanceAnnotation>& ground_truth_instances,
+    double* ground_truth_columns) {
+  const int num_ground_truth = ground_truth_instances.size();
+  double* ground_truth_x0 = ground_truth_columns;
+  double* ground_truth_y0 = ground_truth_x0 + num_ground_truth;
+  double* ground_truth_x1 = ground_truth_y0 + num_ground_truth;
+  double* ground_truth_y1 = ground_truth_x1 + num_ground_truth;
+  double* ground_truth_areas = ground_truth_y1 + num_ground_truth;
+  double* ground_truth_crowds = ground_truth_areas + num_ground_truth;
+  for (auto g = 0; g < num_ground_truth; ++g) {
+    const std::array<double, 4>& bbox = ground_truth_instances[g].bbox;
+    ground_truth_x0[g] = bbox[0];
+    ground_truth_y0[g] = bbox[1];
+    ground_truth_x1[g] = bbox[0] + bbox[2];
+    ground_truth_y1[g] = bbox[1] + bbox[3];
+    ground_truth_areas[g] = bbox[2] * bbox[3];
+    ground_truth_crowds[g] = ground_truth_instances[g].is_crowd ? 1. : 0.;
+  }
+}
+
+// Compute the bounding box intersection over union of each sorted detected
+// instance detection_instances[detection_sorted_indices[d]] and each of the
+// num_ground_truth ground truth instances, and collect them in ious.
+// Follows pycocotools.mask.iou(), including that the union of a detection with
+// a crowd ground truth instance is the area of the detection.  The ground
+// truth boxes are given as the columns of ComputeBoxColumns(), so that the
+// inner loop over ground truth instances is branch free and can be vectorized
+// by the compiler.  row is temporary storage
+void ComputeBoxIous(
+    const std::vector<InstanceAnnotation>& detection_instances,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    int num_ground_truth,
+    const double* ground_truth_columns,
+    std::vector<double>* row,
+    IouMatrix* ious) {
+  const int num_detections = detection_sorted_indices.size();
+  ResetIouMatrix(num_detections, num_ground_truth, ious);
+  if (num_ground_truth == 0) {
+    ious->row_offsets.assign(num_detections + 1, 0);
+    return;
+  }
+
+  const double* ground_truth_x0 = ground_truth_columns;
+  const double* ground_truth_y0 = ground_truth_x0 + num_ground_truth;
+  const double* ground_truth_x1 = ground_truth_y0 + num_ground_truth;
+  const double* ground_truth_y1 = ground_truth_x1 + num_ground_truth;
+  const double* ground_truth_areas = ground_truth_y1 + num_ground_truth;
+  const double* ground_truth_crowds = ground_truth_areas + num_ground_truth;
+  for (auto d = 0; d < num_detections; ++d) {
+    double* row_ious = IouRowStorage(row, ious);
+    const std::array<double, 4>& bbox =
+        detection_instances[detection_sorted_indices[d]].bbox;
+    const double x0 = bbox[0];
+    const double y0 = bbox[1];
+    const double x1 = bbox[0] + bbox[2];
+    const double y1 = bbox[1] + bbox[3];
+    const double area = bbox[2] * bbox[3];
+    for (auto g = 0; g < num_ground_truth; ++g) {
+      const double width =
+          std::min(x1, ground_truth_x1[g]) - std::max(x0, ground_truth_x0[g]);
+      const double height =
+          std::min(y1, ground_truth_y1[g]) - std::max(y0, ground_truth_y0[g]);
+      const double intersection = width * height;
+      const double union_area = ground_truth_crowds[g] != 0.
+          ? area
+          : area + ground_truth_areas[g] - intersection;
+      row_ious[g] =
+          (width > 0. && height > 0.) ? intersection / union_area : 0.;
+    }
+    AppendIouRow(row_ious, ious);
+  }
+}
+
+// A convex quadrilateral with its vertices in counter-clockwise order, its
+// area, and its bounding box x0, y0, x1, y1
+struct Quadrilateral {
+  std::array<double, 4> x;
+  std::array<double, 4> y;
+  double area;
+  std::array<double, 4> bbox;
+};
+
+// Order the corners x1, y1, ..., x4, y4 counter-clockwise by their angle
+// around the centroid, so that any vertex order of a convex quadrilateral
+// gives a simple polygon
+Quadrilateral MakeQuadrilateral(const std::array<double, 8>& corners) {
+  double center_x = 0.;
+  double center_y = 0.;
+  for (auto v = 0; v < 4; ++v) {
+    center_x += corners[2 * v] / 4.;
+    center_y += corners[2 * v + 1] / 4.;
+  }
+  std::array<double, 4> angles;
+  std::array<int, 4> order = {{0, 1, 2, 3}};
+  for (auto v = 0; v < 4; ++v) {
+    angles[v] = std::atan2(
+        corners[2 * v + 1] - center_y, corners[2 * v] - center_x);
+  }
+  std::sort(order.begin(), order.end(), [&angles](int v1, int v2) {
+    return angles[v1] < angles[v2];
+  });
+
+  Quadrilateral quadrilateral;
+  for (auto v = 0; v < 4; ++v) {
+    quadrilateral.x[v] = corners[2 * order[v]];
+    quadrilateral.y[v] = corners[2 * order[v] + 1];
+  }
+  double twice_area = 0.;
+  for (auto v = 0; v < 4; ++v) {
+    const int w = (v + 1) % 4;
+    twice_area += quadrilateral.x[v] * quadrilateral.y[w] -
+        quadrilateral.x[w] * quadrilateral.y[v];
+  }
+  quadrilateral.area = twice_area / 2.;
+  quadrilateral.bbox = {{*std::min_element(
+                             quadrilateral.x.begin(), quadrilateral.x.end()),
+                         *std::min_element(
+                             quadrilateral.y.begin(), quadrilateral.y.end()),
+                         *std::max_element(
+                             quadrilateral.x.begin(), quadrilateral.x.end()),
+                         *std::max_element(
+                             quadrilateral.y.begin(), quadrilateral.y.end())}};
+  return quadrilateral;
+}
+
+// Area of the intersection of two convex quadrilaterals, computed by clipping
+// subject against the four edges of clip (Sutherland-Hodgman).  Every edge adds
+// at most one vertex, so the polygons fit into fixed size arrays
+double QuadrilateralIntersection(
+    const Quadrilateral& subject,
+    const Quadrilateral& clip) {
+  constexpr int kMaxVertices = 8;
+  double x[kMaxVertices], y[kMaxVertices];
+  double clipped_x[kMaxVertices], clipped_y[kMaxVertices];
+  int num_vertices = 4;
+  std::copy(subject.x.begin(), subject.x.end(), x);
+  std::copy(subject.y.begin(), subject.y.end(), y);
+  for (auto e = 0; e < 4 && num_vertices > 0; ++e) {
+    const double ax = clip.x[e];
+    const double ay = clip.y[e];
+    const double edge_x = clip.x[(e + 1) % 4] - ax;
+    const double edge_y = clip.y[(e + 1) % 4] - ay;
+    // Positive on the inner (left) side of the counter-clockwise edge
+    auto side = [&](int v) {
+      return edge_x * (y[v] - ay) - edge_y * (x[v] - ax);
+    };
+    int num_clipped = 0;
+    for (auto v = 0; v < num_vertices; ++v) {
+      const int w = (v + 1) % num_vertices;
+      const double side_v = side(v);
+      const double side_w = side(w);
+      if (side_v >= 0.) {
+        clipped_x[num_clipped] = x[v];
+        clipped_y[num_clipped] = y[v];
+        ++num_clipped;
+      }
+      if ((side_v >= 0.) != (side_w >= 0.) && num_clipped < kMaxVertices) {
+        const double t = side_v / (side_v - side_w);
+        clipped_x[num_clipped] = x[v] + t * (x[w] - x[v]);
+        clipped_y[num_clipped] = y[v] + t * (y[w] - y[v]);
+        ++num_clipped;
+      }
+    }
+    num_vertices = std::min(num_clipped, kMaxVertices);
+    std::copy(clipped_x, clipped_x + num_vertices, x);
+    std::copy(clipped_y, clipped_y + num_vertices, y);
+  }
+
+  double twice_area = 0.;
+  for (auto v = 0; v < num_vertices; ++v) {
+    const int w = (v + 1) % num_vertices;
+    twice_area += x[v] * y[w] - x[w] * y[v];
+  }
+  return std::max(twice_area / 2., 0.);
+}
+
+// Same as ComputeBoxIous() for the quadrilaterals given by the corners of the
+// instances.  Pairs whose bounding boxes do not overlap are skipped before
+// clipping, which is most pairs in dense scenes.  quadrilaterals is temporary
+// storage
+void ComputeQuadrilateralIous(
+    const std::vector<InstanceAnnotation>& detection_instances,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<InstanceAnnotation>& ground_truth_instances,
+    std::vector<double>* row,
+    std::vector<Quadrilateral>* quadrilaterals,
+    IouMatrix* ious) {
+  const int num_detections = detection_sorted_indices.size();
+  const int num_ground_truth = ground_truth_instances.size();
+  ResetIouMatrix(num_detections, num_ground_truth, ious);
+  if (num_ground_truth == 0) {
+    ious->row_offsets.assign(num_detections + 1, 0);
+    return;
+  }
+
+  quadrilaterals->clear();
+  for (const InstanceAnnotation& instance : ground_truth_instances) {
+    quadrilaterals->push_back(MakeQuadrilateral(instance.corners));
+  }
+  for (auto d = 0; d < num_detections; ++d) {
+    double* row_ious = IouRowStorage(row, ious);
+    const Quadrilateral detection = MakeQuadrilateral(
+        detection_instances[detection_sorted_indices[d]].corners);
+    for (auto g = 0; g < num_ground_truth; ++g) {
+      const Quadrilateral& ground_truth = (*quadrilaterals)[g];
+      row_ious[g] = 0.;
+      if (detection.bbox[2] <= ground_truth.bbox[0] ||
+          ground_truth.bbox[2] <= detection.bbox[0] ||
+          detection.bbox[3] <= ground_truth.bbox[1] ||
+          ground_truth.bbox[3] <= detection.bbox[1]) {
+        continue;
+      }
+      const double intersection =
+          QuadrilateralIntersection(detection, ground_truth);
+      const double union_area = ground_truth_instances[g].is_crowd
+          ? detection.area
+          : detection.area + ground_truth.area - intersection;
+      if (intersection > 0. && union_area > 0.) {
+        row_ious[g] = intersection / union_area;
+      }
+    }
+    AppendIouRow(row_ious, ious);
+  }
+}
+
+// Compute the object keypoint similarity of the corners of each sorted
+// detected instance and each ground truth instance (see
+// EvaluateCornerImages()), and collect them in ious.  Like in
+// ComputeBoxIous(), the ground truth corners are unpacked into columns first,
+// here the 8 coordinates and the factor 1 / (2 * area) of every instance, so
+// that the inner loop is branch free.  columns is temporary storage
+void ComputeCornerSimilarities(
+    const std::vector<InstanceAnnotation>& detection_instances,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<InstanceAnnotation>& ground_truth_instances,
+    const std::array<double, 4>& corner_sigmas,
+    std::vector<double>* row,
+    std::vector<double>* columns,
+    IouMatrix* ious) {
+  const int num_detections = detection_sorted_indices.size();
+  const int num_ground_truth = ground_truth_instances.size();
+  ResetIouMatrix(num_detections, num_ground_truth, ious);
+  if (num_ground_truth == 0) {
+    ious->row_offsets.assign(num_detections + 1, 0);
+    return;
+  }
+
+  columns->resize(9 * num_ground_truth);
+  double* ground_truth_corners = columns->data();
+  double* ground_truth_scales = ground_truth_corners + 8 * num_ground_truth;
+  for (auto g = 0; g < num_ground_truth; ++g) {
+    const InstanceAnnotation& instance = ground_truth_instances[g];
+    for (auto k = 0; k < 8; ++k) {
+      ground_truth_corners[k * num_ground_truth + g] = instance.corners[k];
+    }
+    // np.spacing(1) like in COCOeval.computeOks()
+    ground_truth_scales[g] =
+        1. / (2. * (instance.area + std::numeric_limits<double>::epsilon()));
+  }
+  std::array<double, 4> inverse_variances;
+  for (auto v = 0; v < 4; ++v) {
+    inverse_variances[v] = 1. / (4. * corner_sigmas[v] * corner_sigmas[v]);
+  }
+
+  for (auto d = 0; d < num_detections; ++d) {
+    double* row_similarities = IouRowStorage(row, ious);
+    const std::array<double, 8>& corners =
+        detection_instances[detection_sorted_indices[d]].corners;
+    for (auto g = 0; g < num_ground_truth; ++g) {
+      row_similarities[g] = 0.;
+    }
+    for (auto v = 0; v < 4; ++v) {
+      const double* ground_truth_x =
+          ground_truth_corners + 2 * v * num_ground_truth;
+      const double* ground_truth_y = ground_truth_x + num_ground_truth;
+      const double x = corners[2 * v];
+      const double y = corners[2 * v + 1];
+      for (auto g = 0; g < num_ground_truth; ++g) {
+        const double dx = x - ground_truth_x[g];
+        const double dy = y - ground_truth_y[g];
+        row_similarities[g] += std::exp(
+                                   -(dx * dx + dy * dy) *
+                                   inverse_variances[v] *
+                                   ground_truth_scales[g]) /
+            4.;
+      }
+    }
+    AppendIouRow(row_similarities, ious);
+  }
+}
+
+// Temporary storage of the compute_ious functions of EvaluateImages(), see
+// the corresponding arguments of ComputeBoxIous(), ComputeQuadrilateralIous()
+// and ComputeCornerSimilarities()
+struct IouScratch {
+  std::vector<double> row;
+  std::vector<Quadrilateral> quadrilaterals;
+  std::vector<double> columns;
+};
+
+// Temporary storage of MatchDetectionsToGroundTruth()
+struct MatchingScratch {
+  // The dense IOU matrix with its columns permuted into ground truth sorted
+  // order
+  std::vector<double> ious;
+  // The rows of a sparse IOU matrix as (ground truth sorted position, IOU)
+  // pairs in increasing position order, and the position of each ground truth
+  // instance in sorted order
+  std::vector<std::pair<int, double>> sparse_ious;
+  std::vector<int> ground_truth_positions;
+  // Crowd flags and ids of the ground truth instances in sorted order
+  std::vector<uint8_t> ground_truth_crowds;
+  std::vector<uint64_t> ground_truth_ids;
+  // For each IOU threshold, the id of the detection matched to each sorted
+  // ground truth instance, or 0 if unmatched
+  std::vector<uint64_t> ground_truth_matches;
+};
+
+// For each IOU threshold, greedily match each detected instance to a ground
+// truth instance (if possible) and store the results into the slices of
+// results reserved for entry evaluation_index.  ious holds the intersection
+// over unions of sorted detected instances and ground truth instances.  A
+// dense matrix is first copied into a tile whose columns are in ground truth
+// sorted order, and the rows of a sparse matrix are remapped and sorted into
+// ground truth sorted order.  Then all IOU thresholds are matched in a single
+// sweep over the detections that reads each contiguous row while it is in
+// cache.  The greedy matches of each threshold only depend on the detections
+// before it, so this gives the same results as matching one threshold at a
+// time.  Sparse rows only visit the overlapping ground truth instances, which
+// gives the same matches since an instance with zero IOU is never matched
+void MatchDetectionsToGroundTruth(
+    const std::vector<InstanceAnnotation>& detection_instances,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<InstanceAnnotation>& ground_truth_instances,
+    const uint64_t* ground_truth_sorted_indices,
+    const uint8_t* ignores,
+    const IouMatrix& ious,
+    const std::vector<double>& iou_thresholds,
+    const std::array<double, 2>& area_range,
+    const int64_t evaluation_index,
+    MatchingScratch* scratch,
+    ImageEvaluations* results) {
+  // Locate the memory reserved for the returned matches and ignores
+  const int num_iou_thresholds = iou_thresholds.size();
+  const int num_ground_truth = ground_truth_instances.size();
+  const int num_detections = detection_sorted_indices.size();
+  const uint64_t detection_offset =
+      results->detection_offsets[evaluation_index];
+  assert(
+      results->detection_offsets[evaluation_index + 1] - detection_offset ==
+      (uint64_t)num_detections);
+  assert(
+      results->ground_truth_offsets[evaluation_index + 1] -
+          results->ground_truth_offsets[evaluation_index] ==
+      (uint64_t)num_ground_truth);
+  uint64_t* detection_matches =
+      &results->detection_matches[num_iou_thresholds * detection_offset];
+  uint8_t* detection_ignores =
+      &results->detection_ignores[num_iou_thresholds * detection_offset];
+  uint8_t* ground_truth_ignores = &results->ground_truth_ignores
+                                       [results->ground_truth_offsets
+                                            [evaluation_index]];
+
+  // Gather the ground truth attributes and the IOU tile in sorted order
+  std::vector<uint64_t>& ground_truth_matches = scratch->ground_truth_matches;
+  std::vector<uint8_t>& ground_truth_crowds = scratch->ground_truth_crowds;
+  std::vector<uint64_t>& ground_truth_ids = scratch->ground_truth_ids;
+  std::vector<double>& sorted_ious = scratch->ious;
+  ground_truth_matches.assign(num_iou_thresholds * num_ground_truth, 0);
+  ground_truth_crowds.resize(num_ground_truth);
+  ground_truth_ids.resize(num_ground_truth);
+  for (auto g = 0; g < num_ground_truth; ++g) {
+    const InstanceAnnotation& ground_truth =
+        ground_truth_instances[ground_truth_sorted_indices[g]];
+    ground_truth_ignores[g] = ignores[ground_truth_sorted_indices[g]];
+    ground_truth_crowds[g] = ground_truth.is_crowd;
+    ground_truth_ids[g] = ground_truth.id;
+  }
+  std::vector<std::pair<int, double>>& sparse_ious = scratch->sparse_ious;
+  if (ious.sparse) {
+    std::vector<int>& ground_truth_positions = scratch->ground_truth_positions;
+    ground_truth_positions.resize(num_ground_truth);
+    for (auto g = 0; g < num_ground_truth; ++g) {
+      ground_truth_positions[ground_truth_sorted_indices[g]] = g;
+    }
+    sparse_ious.resize(ious.values.size());
+    for (auto d = 0; d < num_detections; ++d) {
+      for (auto k = ious.row_offsets[d]; k < ious.row_offsets[d + 1]; ++k) {
+        sparse_ious[k] = std::make_pair(
+            ground_truth_positions[ious.columns[k]], ious.values[k]);
+      }
+      std::sort(
+          sparse_ious.begin() + ious.row_offsets[d],
+          sparse_ious.begin() + ious.row_offsets[d + 1]);
+    }
+  } else {
+    sorted_ious.resize(num_detections * num_ground_truth);
+    for (auto d = 0; d < num_detections; ++d) {
+      const double* row = &ious.dense[d * num_ground_truth];
+      double* sorted_row = &sorted_ious[d * num_ground_truth];
+      for (auto g = 0; g < num_ground_truth; ++g) {
+        sorted_row[g] = row[ground_truth_sorted_indices[g]];
+      }
+    }
+  }
+
+  for (auto d = 0; d < num_detections; ++d) {
+    const InstanceAnnotation& detection =
+        detection_instances[detection_sorted_indices[d]];
+    const bool outside_area_range =
+        detection.area < area_range[0] || detection.area > area_range[1];
+
+    for (auto t = 0; t < num_iou_thresholds; ++t) {
+      uint64_t* threshold_matches = &ground_truth_matches[t * num_ground_truth];
+
+      // information about best match so far (match=-1 -> unmatched)
+      double best_iou = std::min(iou_thresholds[t], 1 - 1e-10);
+      int match = -1;
+      // consider ground truth instance g with the given IOU as a match, and
+      // return false once no later ground truth instance needs to be
+      // considered
+      auto consider_match = [&](int g, double iou) {
+        // if this ground truth instance is already matched and not a
+        // crowd, it cannot be matched to another detection
+        if (threshold_matches[g] > 0 && !ground_truth_crowds[g]) {
+          return true;
+        }
+
+        // if detected instance matched to a regular ground truth
+        // instance, we can break on the first ground truth instance
+        // tagged as ignore (because they are sorted by the ignore tag)
+        if (match >= 0 && !ground_truth_ignores[match] &&
+            ground_truth_ignores[g]) {
+          return false;
+        }
+
+        // if IOU overlap is the best so far, store the match appropriately
+        if (iou >= best_iou) {
+          best_iou = iou;
+          match = g;
+        }
+        return true;
+      };
+      if (ious.sparse) {
+        for (auto k = ious.row_offsets[d]; k < ious.row_offsets[d + 1]; ++k) {
+          if (!consider_match(sparse_ious[k].first, sparse_ious[k].second)) {
+            break;
+          }
+        }
+      } else {
+        const double* detection_ious = &sorted_ious[d * num_ground_truth];
+        for (auto g = 0; g < num_ground_truth; ++g) {
+          if (!consider_match(g, detection_ious[g])) {
+            break;
+          }
+        }
+      }
+
+      // if match was made, store id of match for both detection and
+      // ground truth
+      const int64_t result_index = t * num_detections + d;
+      detection_matches[result_index] = 0;
+      detection_ignores[result_index] = false;
+      if (match >= 0) {
+        detection_ignores[result_index] = ground_truth_ignores[match];
+        detection_matches[result_index] = ground_truth_ids[match];
+        threshold_matches[match] = detection.id;
+      }
+
+      // set unmatched detections outside of area range to ignore
+      detection_ignores[result_index] = detection_ignores[result_index] ||
+          (detection_matches[result_index] == 0 && outside_area_range);
+    }
+  }
+
+  // store detection score results
+  double* detection_scores = &results->detection_scores[detection_offset];
+  for (size_t d = 0; d < detection_sorted_indices.size(); ++d) {
+    detection_scores[d] =
+        detection_instances[detection_sorted_indices[d]].score;
+  }
+}
+
+// Shared implementation of both versions of PrepareGroundTruth()
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruthInstances(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    std::shared_ptr<const ImageCategoryInstances<InstanceAnnotation>>
+        instances,
+    int num_threads) {
+  auto ground_truth = std::make_shared<PreparedGroundTruth>();
+  ground_truth->area_ranges = area_ranges;
+  ground_truth->num_images = instances->size();
+  ground_truth->num_categories =
+      ground_truth->num_images > 0 ? (*instances)[0].size() : 0;
+  ground_truth->instances = std::move(instances);
+
+  const int num_area_ranges = area_ranges.size();
+  const int num_categories = ground_truth->num_groups();
+  const int64_t num_groups =
+      static_cast<int64_t>(ground_truth->num_images) * num_categories;
+  ground_truth->offsets.resize(num_groups + 1);
+  ground_truth->offsets[0] = 0;
+  for (int64_t k = 0; k < num_groups; ++k) {
+    ground_truth->offsets[k + 1] = ground_truth->offsets[k] +
+        (*ground_truth->instances)[k / num_categories][k % num_categories]
+            .size();
+  }
+  const uint64_t total_ground_truth = ground_truth->offsets.back();
+  ground_truth->ignores.resize(num_area_ranges * total_ground_truth);
+  ground_truth->sorted_indices.resize(num_area_ranges * total_ground_truth);
+  ground_truth->box_columns.resize(6 * total_ground_truth);
+
+  ParallelFor(
+      num_groups,
+      ResolveNumThreads(num_threads, num_groups),
+      [&](int /* worker_index */, int64_t k) {
+        const std::vector<InstanceAnnotation>& ground_truth_instances =
+            (*ground_truth->instances)[k / num_categories]
+                                      [k % num_categories];
+        const uint64_t offset = ground_truth->offsets[k];
+        const int64_t num_ground_truth = ground_truth_instances.size();
+        for (auto a = 0; a < num_area_ranges; ++a) {
+          const uint64_t begin = num_area_ranges * offset + a * num_ground_truth;
+          SortInstancesByIgnore(
+              area_ranges[a],
+              ground_truth_instances,
+              &ground_truth->sorted_indices[begin],
+              &ground_truth->ignores[begin]);
+        }
+        ComputeBoxColumns(
+            ground_truth_instances, &ground_truth->box_columns[6 * offset]);
+      });
+  return ground_truth;
+}
+
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruth(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    ImageCategoryInstances<InstanceAnnotation>&&
+        image_category_ground_truth_instances,
+    int num_threads) {
+  return PrepareGroundTruthInstances(
+      area_ranges,
+      std::make_shared<const ImageCategoryInstances<InstanceAnnotation>>(
+          std::move(image_category_ground_truth_instances)),
+      num_threads);
+}
+
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruth(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    int num_threads) {
+  // Borrowed, so nothing is deleted along with the prepared ground truth
+  return PrepareGroundTruthInstances(
+      area_ranges,
+      std::shared_ptr<const ImageCategoryInstances<InstanceAnnotation>>(
+          &image_category_ground_truth_instances,
+          [](const ImageCategoryInstances<InstanceAnnotation>*) {}),
+      num_threads);
+}
+
+// Shared implementation of all versions of EvaluateImages(), where
+// compute_ious(b, c, detection_sorted_indices, iou_scratch, ious) collects the
+// intersection over unions of the sorted detected instances of image b and
+// category c and the corresponding ground truth instances into ious (see
+// AppendIouRow()), using the calling thread's iou_scratch as temporary storage
+template <typename ComputeIous>
+ImageEvaluations EvaluateImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads,
+    const ComputeIous& compute_ious) {
+  const std::vector<std::array<double, 2>>& area_ranges =
+      ground_truth.area_ranges;
+  const int num_area_ranges = area_ranges.size();
+  const int num_images = ground_truth_images.size();
+  const int num_categories = ground_truth.num_groups();
+  const int num_iou_thresholds = iou_thresholds.size();
+  assert(image_category_detection_instances.size() == (size_t)num_images);
+
+  // The number of detected and ground truth instances of every image,
+  // category, and area range combination is known in advance, so the results
+  // of all of them are laid out and allocated at once
+  const int64_t num_evaluations =
+      static_cast<int64_t>(num_images) * num_area_ranges * num_categories;
+  ImageEvaluations results_all;
+  results_all.num_iou_thresholds = num_iou_thresholds;
+  results_all.detection_offsets.resize(num_evaluations + 1);
+  results_all.ground_truth_offsets.resize(num_evaluations + 1);
+  results_all.detection_offsets[0] = 0;
+  results_all.ground_truth_offsets[0] = 0;
+  for (auto c = 0; c < num_categories; ++c) {
+    for (auto a = 0; a < num_area_ranges; ++a) {
+      for (auto i = 0; i < num_images; ++i) {
+        const int64_t e =
+            c * num_area_ranges * num_images + a * num_images + i;
+        const uint64_t num_detections = std::min<uint64_t>(
+            image_category_detection_instances[i][c].size(),
+            std::max(max_detections, 0));
+        results_all.detection_offsets[e + 1] =
+            results_all.detection_offsets[e] + num_detections;
+        results_all.ground_truth_offsets[e + 1] =
+            results_all.ground_truth_offsets[e] +
+            (*ground_truth.instances)[ground_truth_images[i]][c].size();
+      }
+    }
+  }
+  const uint64_t total_detections = results_all.detection_offsets.back();
+  results_all.detection_matches.resize(num_iou_thresholds * total_detections);
+  results_all.detection_ignores.resize(num_iou_thresholds * total_detections);
+  results_all.detection_scores.resize(total_detections);
+  results_all.ground_truth_ignores.resize(
+      results_all.ground_truth_offsets.back());
+
+  // Each (image, category) pair is an independent work item that writes to its
+  // own num_area_ranges entries of results_all, so work items can be evaluated
+  // concurrently.  Each thread owns its own scratch buffers
+  struct Scratch {
+    std::vector<uint64_t> detection_sorted_indices;
+    MatchingScratch matching;
+    IouScratch iou_scratch;
+    IouMatrix ious;
+  };
+  const bool allow_sparse_ious = iou_thresholds.empty() ||
+      *std::min_element(iou_thresholds.begin(), iou_thresholds.end()) > 0.;
+  const int64_t num_work_items =
+      static_cast<int64_t>(num_images) * num_categories;
+  num_threads = ResolveNumThreads(num_threads, num_work_items);
+  std::vector<Scratch> scratches(num_threads);
+  for (Scratch& scratch : scratches) {
+    scratch.ious.allow_sparse = allow_sparse_ious;
+  }
+
+  // Store results for each image, category, and area range combination. Results
+  // for each IOU threshold are packed into the same entry
+  ParallelFor(
+      num_work_items, num_threads, [&](int worker_index, int64_t work_item) {
+        const int i = work_item / num_categories;
+        const int c = work_item % num_categories;
+        Scratch& scratch = scratches[worker_index];
+        const int ground_truth_image = ground_truth_images[i];
+        const std::vector<InstanceAnnotation>& ground_truth_instances =
+            (*ground_truth.instances)[ground_truth_image][c];
+        const std::vector<InstanceAnnotation>& detection_instances =
+            image_category_detection_instances[i][c];
+        const uint64_t ground_truth_offset = ground_truth.offsets
+            [static_cast<int64_t>(ground_truth_image) * num_categories + c];
+        const int64_t num_ground_truth = ground_truth_instances.size();
+
+        SortInstancesByDetectionScore(
+            detection_instances,
+            max_detections,
+            &scratch.detection_sorted_indices);
+        compute_ious(
+            i,
+            c,
+            scratch.detection_sorted_indices,
+            &scratch.iou_scratch,
+            &scratch.ious);
+
+        for (auto a = 0; a < num_area_ranges; ++a) {
+          const uint64_t begin = num_area_ranges * ground_truth_offset +
+              a * num_ground_truth;
+          MatchDetectionsToGroundTruth(
+              detection_instances,
+              scratch.detection_sorted_indices,
+              ground_truth_instances,
+              &ground_truth.sorted_indices[begin],
+              &ground_truth.ignores[begin],
+              scratch.ious,
+              iou_thresholds,
+              area_ranges[a],
+              c * num_area_ranges * num_images + a * num_images + i,
+              &scratch.matching,
+              &results_all);
+        }
+      });
+
+  return results_all;
+}
+
+// All images of ground truth in order
+std::vector<int> AllImages(const PreparedGroundTruth& ground_truth) {
+  std::vector<int> images(ground_truth.num_images);
+  std::iota(images.begin(), images.end(), 0);
+  return images;
+}
+
+ImageEvaluations EvaluateImages(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<std::vector<double>>& image_category_ious,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads) {
+  const std::shared_ptr<PreparedGroundTruth> ground_truth = PrepareGroundTruth(
+      area_ranges, image_category_ground_truth_instances, num_threads);
+  return EvaluateImages(
+      *ground_truth,
+      AllImages(*ground_truth),
+      max_detections,
+      iou_thresholds,
+      image_category_detection_instances,
+      num_threads,
+      [&](int i,
+          int c,
+          const std::vector<uint64_t>& detection_sorted_indices,
+          IouScratch* /* iou_scratch */,
+          IouMatrix* ious) {
+        const int num_ground_truth = (*ground_truth->instances)[i][c].size();
+        const int num_detections = detection_sorted_indices.size();
+        ResetIouMatrix(num_detections, num_ground_truth, ious);
+        for (auto d = 0; d < num_detections; ++d) {
+          AppendIouRow(
+              num_ground_truth > 0 ? image_category_ious[i][c][d].data()
+                                   : nullptr,
+              ious);
+        }
+      });
+}
+
+ImageEvaluations EvaluateImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads) {
+  return EvaluateImages(
+      ground_truth,
+      ground_truth_images,
+      max_detections,
+      iou_thresholds,
+      image_category_detection_instances,
+      num_threads,
+      [&](int i,
+          int c,
+          const std::vector<uint64_t>& detection_sorted_indices,
+          IouScratch* iou_scratch,
+          IouMatrix* ious) {
+        const int64_t k =
+            static_cast<int64_t>(ground_truth_images[i]) *
+                ground_truth.num_groups() +
+            c;
+        ComputeBoxIous(
+            image_category_detection_instances[i][c],
+            detection_sorted_indices,
+            ground_truth.offsets[k + 1] - ground_truth.offsets[k],
+            &ground_truth.box_columns[6 * ground_truth.offsets[k]],
+            &iou_scratch->row,
+            ious);
+      });
+}
+
+ImageEvaluations EvaluateImages(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads) {
+  const std::shared_ptr<PreparedGroundTruth> ground_truth = PrepareGroundTruth(
+      area_ranges, image_category_ground_truth_instances, num_threads);
+  return EvaluateImages(
+      *ground_truth,
+      AllImages(*ground_truth),
+      max_detections,
+      iou_thresholds,
+      image_category_detection_instances,
+      num_threads);
+}
+
+ImageEvaluations EvaluateQuadrilateralImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads) {
+  return EvaluateImages(
+      ground_truth,
+      ground_truth_images,
+      max_detections,
+      iou_thresholds,
+      image_category_detection_instances,
+      num_threads,
+      [&](int i,
+          int c,
+          const std::vector<uint64_t>& detection_sorted_indices,
+          IouScratch* iou_scratch,
+          IouMatrix* ious) {
+        ComputeQuadrilateralIous(
+            image_category_detection_instances[i][c],
+            detection_sorted_indices,
+            (*ground_truth.instances)[ground_truth_images[i]][c],
+            &iou_scratch->row,
+            &iou_scratch->quadrilaterals,
+            ious);
+      });
+}
+
+ImageEvaluations EvaluateCornerImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    const std::array<double, 4>& corner_sigmas,
+    int num_threads) {
+  for (const double sigma : corner_sigmas) {
+    if (!(sigma > 0.)) {
+      throw std::invalid_argument("corner sigmas must be positive");
+    }
+  }
+  return EvaluateImages(
+      ground_truth,
+      ground_truth_images,
+      max_detections,
+      iou_thresholds,
+      image_category_detection_instances,
+      num_threads,
+      [&](int i,
+          int c,
+          const std::vector<uint64_t>& detection_sorted_indices,
+          IouScratch* iou_scratch,
+          IouMatrix* ious) {
+        ComputeCornerSimilarities(
+            image_category_detection_instances[i][c],
+            detection_sorted_indices,
+            (*ground_truth.instances)[ground_truth_images[i]][c],
+            corner_sigmas,
+            &iou_scratch->row,
+            &iou_scratch->columns,
+            ious);
+      });
+}
+
+// Gather the results of entry source_indices[e] of sources[e] into entry e of
+// the returned evaluations, for instance to merge the evaluations of disjoint
+// sets of images into the evaluations of all of them
+ImageEvaluations ConcatenateEvaluations(
+    const std::vector<const ImageEvaluations*>& sources,
+    const std::vector<int64_t>& source_indices,
+    int num_iou_thresholds) {
+  const int64_t num_evaluations = sources.size();
+  ImageEvaluations results;
+  results.num_iou_thresholds = num_iou_thresholds;
+  results.detection_offsets.resize(num_evaluations + 1);
+  results.ground_truth_offsets.resize(num_evaluations + 1);
+  results.detection_offsets[0] = 0;
+  results.ground_truth_offsets[0] = 0;
+  for (int64_t e = 0; e < num_evaluations; ++e) {
+    const ImageEvaluations& source = *sources[e];
+    const int64_t s = source_indices[e];
+    results.detection_offsets[e + 1] = results.detection_offsets[e] +
+        source.detection_offsets[s + 1] - source.detection_offsets[s];
+    results.ground_truth_offsets[e + 1] = results.ground_truth_offsets[e] +
+        source.ground_truth_offsets[s + 1] - source.ground_truth_offsets[s];
+  }
+  const uint64_t total_detections = results.detection_offsets.back();
+  results.detection_matches.resize(num_iou_thresholds * total_detections);
+  results.detection_ignores.resize(num_iou_thresholds * total_detections);
+  results.detection_scores.resize(total_detections);
+  results.ground_truth_ignores.resize(results.ground_truth_offsets.back());
+
+  for (int64_t e = 0; e < num_evaluations; ++e) {
+    const ImageEvaluations& source = *sources[e];
+    const int64_t s = source_indices[e];
+    const uint64_t detection_begin = source.detection_offsets[s];
+    const uint64_t detection_end = source.detection_offsets[s + 1];
+    std::copy(
+        source.detection_matches.begin() +
+            num_iou_thresholds * detection_begin,
+        source.detection_matches.begin() + num_iou_thresholds * detection_end,
+        results.detection_matches.begin() +
+            num_iou_thresholds * results.detection_offsets[e]);
+    std::copy(
+        source.detection_ignores.begin() +
+            num_iou_thresholds * detection_begin,
+        source.detection_ignores.begin() + num_iou_thresholds * detection_end,
+        results.detection_ignores.begin() +
+            num_iou_thresholds * results.detection_offsets[e]);
+    std::copy(
+        source.detection_scores.begin() + detection_begin,
+        source.detection_scores.begin() + detection_end,
+        results.detection_scores.begin() + results.detection_offsets[e]);
+    std::copy(
+        source.ground_truth_ignores.begin() + source.ground_truth_offsets[s],
+        source.ground_truth_ignores.begin() +
+            source.ground_truth_offsets[s + 1],
+        results.ground_truth_ignores.begin() +
+            results.ground_truth_offsets[e]);
+  }
+  return results;
+}
+
+ImageCategoryInstances<InstanceAnnotation> GroupInstances(
+    const InstanceColumns& columns,
+    int num_images,
+    int num_categories,
+    bool use_categories) {
+  const int num_groups = use_categories ? num_categories : 1;
+  ImageCategoryInstances<InstanceAnnotation> instances(
+      num_images, std::vector<std::vector<InstanceAnnotation>>(num_groups));
+  if (num_images == 0 || num_categories == 0) {
+    return instances;
+  }
+
+  // Counting sort of the instances by (image, category) key, which is stable
+  // and keeps merged categories of an image in category order
+  const int64_t num_keys = static_cast<int64_t>(num_images) * num_categories;
+  std::vector<int64_t> key_offsets(num_keys + 1, 0);
+  for (int64_t n = 0; n < columns.size; ++n) {
+    const int64_t i = columns.image_indices[n];
+    const int64_t c = columns.category_indices[n];
+    if (i < 0 || i >= num_images || c < 0 || c >= num_categories) {
+      throw std::out_of_range(
+          "instance " + std::to_string(n) + " has image index " +
+          std::to_string(i) + " and category index " + std::to_string(c) +
+          " out of range");
+    }
+    ++key_offsets[i * num_categories + c + 1];
+  }
+  for (int64_t key = 0; key < num_keys; ++key) {
+    key_offsets[key + 1] += key_offsets[key];
+  }
+  for (auto i = 0; i < num_images; ++i) {
+    for (auto c = 0; c < num_groups; ++c) {
+      const int64_t key_begin = static_cast<int64_t>(i) * num_categories +
+          (use_categories ? c : 0);
+      const int64_t key_end = use_categories ? key_begin + 1
+                                             : key_begin + num_categories;
+      instances[i][c].reserve(key_offsets[key_end] - key_offsets[key_begin]);
+    }
+  }
+  std::vector<int64_t> sorted_instances(columns.size);
+  {
+    std::vector<int64_t> next(key_offsets.begin(), key_offsets.end() - 1);
+    for (int64_t n = 0; n < columns.size; ++n) {
+      sorted_instances
+          [next[columns.image_indices[n] * num_categories +
+                columns.category_indices[n]]++] = n;
+    }
+  }
+
+  for (auto n : sorted_instances) {
+    const int i = columns.image_indices[n];
+    const int c = use_categories ? columns.category_indices[n] : 0;
+    std::array<double, 4> bbox = {{0., 0., 0., 0.}};
+    if (columns.bboxes != nullptr) {
+      std::copy(
+          columns.bboxes + 4 * n, columns.bboxes + 4 * n + 4, bbox.begin());
+    }
+    instances[i][c].emplace_back(
+        static_cast<uint64_t>(columns.ids[n]),
+        columns.scores != nullptr ? columns.scores[n] : 0.,
+        columns.areas != nullptr ? columns.areas[n] : 0.,
+        columns.is_crowd != nullptr && columns.is_crowd[n],
+        columns.ignores != nullptr && columns.ignores[n],
+        bbox);
+    if (columns.corners != nullptr) {
+      std::copy(
+          columns.corners + 8 * n,
+          columns.corners + 8 * n + 8,
+          instances[i][c].back().corners.begin());
+    }
+  }
+  return instances;
+}
+
+IncrementalEvaluator::IncrementalEvaluator(
+    std::shared_ptr<PreparedGroundTruth> ground_truth,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    int num_threads)
+    : ground_truth_(std::move(ground_truth)),
+      max_detections_(max_detections),
+      iou_thresholds_(iou_thresholds),
+      num_threads_(num_threads),
+      image_batches_(ground_truth_->num_images, -1),
+      image_batch_positions_(ground_truth_->num_images, -1),
+      image_detections_(ground_truth_->num_images, 0) {}
+
+void IncrementalEvaluator::AddDetections(const InstanceColumns& columns) {
+  if (columns.bboxes == nullptr && columns.size > 0) {
+    throw std::invalid_argument("missing instance array bbox");
+  }
+
+  // Number the images of this batch in order of appearance, so that only the
+  // batch rather than the whole dataset is grouped and evaluated
+  std::vector<int> batch_images;
+  std::vector<int64_t> batch_image_indices(columns.size);
+  std::vector<int> batch_positions(ground_truth_->num_images, -1);
+  for (int64_t n = 0; n < columns.size; ++n) {
+    const int64_t i = columns.image_indices[n];
+    if (i < 0 || i >= ground_truth_->num_images) {
+      throw std::out_of_range(
+          "instance " + std::to_string(n) + " has image index " +
+          std::to_string(i) + " out of range");
+    }
+    if (image_batches_[i] >= 0) {
+      throw std::invalid_argument(
+          "detections of image index " + std::to_string(i) +
+          " were already added");
+    }
+    if (batch_positions[i] < 0) {
+      batch_positions[i] = batch_images.size();
+      batch_images.push_back(i);
+    }
+    batch_image_indices[n] = batch_positions[i];
+  }
+  const int num_batch_images = batch_images.size();
+
+  InstanceColumns batch_columns = columns;
+  batch_columns.image_indices = batch_image_indices.data();
+  const ImageCategoryInstances<InstanceAnnotation> detection_instances =
+      GroupInstances(
+          batch_columns,
+          num_batch_images,
+          ground_truth_->num_categories,
+          ground_truth_->use_categories);
+
+  batch_evaluations_.push_back(EvaluateImages(
+      *ground_truth_,
+      batch_images,
+      max_detections_,
+      iou_thresholds_,
+      detection_instances,
+      num_threads_));
+  for (auto b = 0; b < num_batch_images; ++b) {
+    image_batches_[batch_images[b]] = batch_evaluations_.size() - 1;
+    image_batch_positions_[batch_images[b]] = b;
+  }
+  for (int64_t n = 0; n < columns.size; ++n) {
+    ++image_detections_[columns.image_indices[n]];
+  }
+  num_evaluated_images_ += num_batch_images;
+  num_detections_ += columns.size;
+}
+
+ImageEvaluations IncrementalEvaluator::Evaluations() const {
+  // Images without added detections still contribute their ground truth
+  // instances, so they are evaluated as one more batch without detections
+  const int num_images = ground_truth_->num_images;
+  const int num_groups = ground_truth_->num_groups();
+  std::vector<int> missing_images;
+  for (auto i = 0; i < num_images; ++i) {
+    if (image_batches_[i] < 0) {
+      missing_images.push_back(i);
+    }
+  }
+  ImageEvaluations missing_evaluations;
+  if (!missing_images.empty()) {
+    missing_evaluations = EvaluateImages(
+        *ground_truth_,
+        missing_images,
+        max_detections_,
+        iou_thresholds_,
+        ImageCategoryInstances<InstanceAnnotation>(
+            missing_images.size(),
+            std::vector<std::vector<InstanceAnnotation>>(num_groups)),
+        num_threads_);
+  }
+
+  std::vector<int> images(num_images);
+  std::iota(images.begin(), images.end(), 0);
+  std::vector<int> missing_positions(num_images, -1);
+  for (size_t m = 0; m < missing_images.size(); ++m) {
+    missing_positions[missing_images[m]] = m;
+  }
+  return GatherEvaluations(images, missing_evaluations, missing_positions);
+}
+
+ImageEvaluations IncrementalEvaluator::GatherEvaluations(
+    const std::vector<int>& images,
+    const ImageEvaluations& missing_evaluations,
+    const std::vector<int>& missing_positions) const {
+  // The evaluations and entry index within them of each entry of the results
+  const int num_images = images.size();
+  const int num_groups = ground_truth_->num_groups();
+  const int num_area_ranges = ground_truth_->area_ranges.size();
+  const int64_t num_evaluations =
+      static_cast<int64_t>(num_groups) * num_area_ranges * num_images;
+  std::vector<const ImageEvaluations*> sources(num_evaluations);
+  std::vector<int64_t> source_indices(num_evaluations);
+  for (auto c = 0; c < num_groups; ++c) {
+    for (auto a = 0; a < num_area_ranges; ++a) {
+      for (auto n = 0; n < num_images; ++n) {
+        const int i = images[n];
+        const int64_t e =
+            c * num_area_ranges * num_images + a * num_images + n;
+        const ImageEvaluations& source = image_batches_[i] >= 0
+            ? batch_evaluations_[image_batches_[i]]
+            : missing_evaluations;
+        const int position = image_batches_[i] >= 0
+            ? image_batch_positions_[i]
+            : missing_positions[i];
+        const int64_t num_source_images =
+            source.size() / (num_groups * num_area_ranges);
+        sources[e] = &source;
+        source_indices[e] = c * num_area_ranges * num_source_images +
+            a * num_source_images + position;
+      }
+    }
+  }
+  return ConcatenateEvaluations(
+      sources, source_indices, iou_thresholds_.size());
+}
+
+// Identifies the binary partial results of IncrementalEvaluator, followed by
+// the format version
+constexpr uint32_t kPartialMagic = 0x45435859;  // "YXCE"
+constexpr uint32_t kPartialVersion = 2;
+
+// Read count values of a partial result with ReadValues(), or throw if the
+// partial result is truncated
+template <typename Values>
+void ReadPartialValues(
+    const std::string& partial,
+    size_t count,
+    size_t* position,
+    Values values) {
+  if (!ReadValues(partial, count, position, values)) {
+    throw std::invalid_argument("truncated partial evaluation result");
+  }
+}
+
+// The partial result format is the magic number and version, the int64_t
+// values num_images, num_groups, num_area_ranges, num_iou_thresholds,
+// num_detections and the number of evaluated images B, the B int32_t image
+// indices, the B int64_t numbers of detected instances of those images, and
+// the columns of the ImageEvaluations of those images
+std::string IncrementalEvaluator::SerializePartial() const {
+  std::vector<int> images;
+  std::vector<int64_t> image_detections;
+  for (auto i = 0; i < ground_truth_->num_images; ++i) {
+    if (image_batches_[i] >= 0) {
+      images.push_back(i);
+      image_detections.push_back(image_detections_[i]);
+    }
+  }
+  const ImageEvaluations evaluations = GatherEvaluations(
+      images,
+      ImageEvaluations(),
+      std::vector<int>(ground_truth_->num_images, -1));
+
+  const uint32_t magic[2] = {kPartialMagic, kPartialVersion};
+  const int64_t sizes[6] = {ground_truth_->num_images,
+                            ground_truth_->num_groups(),
+                            static_cast<int64_t>(
+                                ground_truth_->area_ranges.size()),
+                            static_cast<int64_t>(iou_thresholds_.size()),
+                            num_detections_,
+                            static_cast<int64_t>(images.size())};
+  std::string partial;
+  WriteValues(magic, 2, &partial);
+  WriteValues(sizes, 6, &partial);
+  WriteValues(images.data(), images.size(), &partial);
+  WriteValues(image_detections.data(), image_detections.size(), &partial);
+  WriteValues(
+      evaluations.detection_offsets.data(),
+      evaluations.detection_offsets.size(),
+      &partial);
+  WriteValues(
+      evaluations.ground_truth_offsets.data(),
+      evaluations.ground_truth_offsets.size(),
+      &partial);
+  WriteValues(
+      evaluations.detection_matches.data(),
+      evaluations.detection_matches.size(),
+      &partial);
+  WriteValues(
+      evaluations.detection_ignores.data(),
+      evaluations.detection_ignores.size(),
+      &partial);
+  WriteValues(
+      evaluations.detection_scores.data(),
+      evaluations.detection_scores.size(),
+      &partial);
+  WriteValues(
+      evaluations.ground_truth_ignores.data(),
+      evaluations.ground_truth_ignores.size(),
+      &partial);
+  return partial;
+}
+
+void IncrementalEvaluator::MergePartial(const std::string& partial) {
+  size_t position = 0;
+  uint32_t magic[2];
+  ReadPartialValues(partial, 2, &position, magic);
+  if (magic[0] != kPartialMagic || magic[1] != kPartialVersion) {
+    throw std::invalid_argument("not a partial evaluation result");
+  }
+  int64_t sizes[6];
+  ReadPartialValues(partial, 6, &position, sizes);
+  const int num_iou_thresholds = iou_thresholds_.size();
+  const int64_t num_area_ranges = ground_truth_->area_ranges.size();
+  if (sizes[0] != ground_truth_->num_images ||
+      sizes[1] != ground_truth_->num_groups() ||
+      sizes[2] != num_area_ranges || sizes[3] != num_iou_thresholds) {
+    throw std::invalid_argument(
+        "partial evaluation result has different parameters");
+  }
+  const int64_t num_partial_images = sizes[5];
+  if (num_partial_images < 0 || num_partial_images > sizes[0]) {
+    throw std::invalid_argument("corrupt partial evaluation result");
+  }
+  std::vector<int> images;
+  std::vector<int64_t> image_detections;
+  ReadPartialValues(partial, num_partial_images, &position, &images);
+  ReadPartialValues(partial, num_partial_images, &position, &image_detections);
+  int64_t num_partial_detections = 0;
+  for (auto b = 0; b < num_partial_images; ++b) {
+    if (images[b] < 0 || images[b] >= ground_truth_->num_images ||
+        image_detections[b] < 0) {
+      throw std::invalid_argument("corrupt partial evaluation result");
+    }
+    num_partial_detections += image_detections[b];
+  }
+  if (num_partial_detections != sizes[4]) {
+    throw std::invalid_argument("corrupt partial evaluation result");
+  }
+
+  const int num_groups = ground_truth_->num_groups();
+  ImageEvaluations evaluations;
+  evaluations.num_iou_thresholds = num_iou_thresholds;
+  const int64_t num_evaluations =
+      num_groups * num_area_ranges * num_partial_images;
+  ReadPartialValues(
+      partial, num_evaluations + 1, &position, &evaluations.detection_offsets);
+  ReadPartialValues(
+      partial,
+      num_evaluations + 1,
+      &position,
+      &evaluations.ground_truth_offsets);
+  for (int64_t e = 0; e < num_evaluations; ++e) {
+    if (evaluations.detection_offsets[e + 1] <
+            evaluations.detection_offsets[e] ||
+        evaluations.ground_truth_offsets[e + 1] <
+            evaluations.ground_truth_offsets[e]) {
+      throw std::invalid_argument("corrupt partial evaluation result");
+    }
+  }
+
+  // Entry e = c * num_area_ranges * B + a * B + b must hold the ground truth
+  // instances of image images[b] and category group c prepared here, or else
+  // the partial result was evaluated against different ground truth
+  for (auto c = 0; c < num_groups; ++c) {
+    for (auto a = 0; a < num_area_ranges; ++a) {
+      for (auto b = 0; b < num_partial_images; ++b) {
+        const int64_t e = (c * num_area_ranges + a) * num_partial_images + b;
+        const int64_t k = static_cast<int64_t>(images[b]) * num_groups + c;
+        if (evaluations.ground_truth_offsets[e + 1] -
+                evaluations.ground_truth_offsets[e] !=
+            ground_truth_->offsets[k + 1] - ground_truth_->offsets[k]) {
+          throw std::invalid_argument(
+              "partial evaluation result has different ground truth for "
+              "image index " +
+              std::to_string(images[b]));
+        }
+      }
+    }
+  }
+  const uint64_t total_detections = evaluations.detection_offsets.back();
+  ReadPartialValues(
+      partial,
+      num_iou_thresholds * total_detections,
+      &position,
+      &evaluations.detection_matches);
+  ReadPartialValues(
+      partial,
+      num_iou_thresholds * total_detections,
+      &position,
+      &evaluations.detection_ignores);
+  ReadPartialValues(
+      partial, total_detections, &position, &evaluations.detection_scores);
+  ReadPartialValues(
+      partial,
+      evaluations.ground_truth_offsets.back(),
+      &position,
+      &evaluations.ground_truth_ignores);
+  if (evaluations.detection_offsets[0] != 0 ||
+      evaluations.ground_truth_offsets[0] != 0 || position != partial.size()) {
+    throw std::invalid_argument("corrupt partial evaluation result");
+  }
+
+  // Only the detections of the adopted images count, the others were added
+  // here already
+  batch_evaluations_.push_back(std::move(evaluations));
+  for (auto b = 0; b < num_partial_images; ++b) {
+    if (image_batches_[images[b]] < 0) {
+      image_batches_[images[b]] = batch_evaluations_.size() - 1;
+      image_batch_positions_[images[b]] = b;
+      image_detections_[images[b]] = image_detections[b];
+      ++num_evaluated_images_;
+      num_detections_ += image_detections[b];
+    }
+  }
+}
+
+// Helper function to Accumulate()
+// Considers the evaluation results applicable to a particular category, area
+// range, and max_detections parameter setting, which begin at entry
+// evaluation_index of evaluations.  Extracts a sorted list of length n of all
+// applicable detection instances concatenated across all images in the dataset,
+// which are represented by the outputs evaluation_indices, detection_scores,
+// image_detection_indices, and detection_sorted_indices--all of which are
+// length n. evaluation_indices[i] stores the applicable entry of
+// evaluations for instance i, which has detection score detection_score[i],
+// and is the image_detection_indices[i]'th of the list of detections
+// for the image containing i.  detection_sorted_indices[] defines a sorted
+// permutation of the 3 other outputs
+int BuildSortedDetectionList(
+    const ImageEvaluations& evaluations,
+    const int64_t evaluation_index,
+    const int64_t num_images,
+    const int max_detections,
+    std::vector<uint64_t>* evaluation_indices,
+    std::vector<double>* detection_scores,
+    std::vector<uint64_t>* detection_sorted_indices,
+    std::vector<uint64_t>* image_detection_indices) {
+  assert((int64_t)evaluations.size() >= evaluation_index + num_images);
+
+  // Extract a list of object instances of the applicable category, area
+  // range, and max detections requirements such that they can be sorted
+  image_detection_indices->clear();
+  evaluation_indices->clear();
+  detection_scores->clear();
+  image_detection_indices->reserve(num_images * max_detections);
+  evaluation_indices->reserve(num_images * max_detections);
+  detection_scores->reserve(num_images * max_detections);
+  int num_valid_ground_truth = 0;
+  for (auto i = 0; i < num_images; ++i) {
+    const int64_t e = evaluation_index + i;
+    const uint64_t detection_begin = evaluations.detection_offsets[e];
+    const int num_detections =
+        evaluations.detection_offsets[e + 1] - detection_begin;
+
+    for (int d = 0; d < num_detections && d < max_detections;
+         ++d) { // detected instances
+      evaluation_indices->push_back(e);
+      image_detection_indices->push_back(d);
+      detection_scores->push_back(
+          evaluations.detection_scores[detection_begin + d]);
+    }
+    for (uint64_t g = evaluations.ground_truth_offsets[e];
+         g < evaluations.ground_truth_offsets[e + 1];
+         ++g) {
+      if (!evaluations.ground_truth_ignores[g]) {
+        ++num_valid_ground_truth;
+      }
+    }
+  }
+
+  // Sort detections by decreasing score, using stable sort to match
+  // python implementation
+  detection_sorted_indices->resize(detection_scores->size());
+  std::iota(
+      detection_sorted_indices->begin(), detection_sorted_indices->end(), 0);
+  std::stable_sort(
+      detection_sorted_indices->begin(),
+      detection_sorted_indices->end(),
+      [&detection_scores](size_t j1, size_t j2) {
+        return (*detection_scores)[j1] > (*detection_scores)[j2];
+      });
+
+  return num_valid_ground_truth;
+}
+
+// Helper function to Accumulate()
+// Compute a precision recall curve given a sorted list of detected instances
+// encoded in evaluations, evaluation_indices, detection_scores,
+// detection_sorted_indices, image_detection_indices (see
+// BuildSortedDetectionList()). Using vectors precisions and recalls
+// and temporary storage, output the results into precisions_out, recalls_out,
+// and scores_out, which are large buffers containing many precion/recall curves
+// for all possible parameter settings, with precisions_out_index and
+// recalls_out_index defining the applicable indices to store results.
+void ComputePrecisionRecallCurve(
+    const int64_t precisions_out_index,
+    const int64_t precisions_out_stride,
+    const int64_t recalls_out_index,
+    const std::vector<double>& recall_thresholds,
+    const int iou_threshold_index,
+    const int num_iou_thresholds,
+    const int num_valid_ground_truth,
+    const ImageEvaluations& evaluations,
+    const std::vector<uint64_t>& evaluation_indices,
+    const std::vector<double>& detection_scores,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<uint64_t>& image_detection_indices,
+    std::vector<double>* precisions,
+    std::vector<double>* recalls,
+    std::vector<double>* precisions_out,
+    std::vector<double>* scores_out,
+    std::vector<double>* recalls_out) {
+  assert(recalls_out->size() > static_cast<size_t>(recalls_out_index));
+
+  // Compute precision/recall for each instance in the sorted list of detections
+  int64_t true_positives_sum = 0, false_positives_sum = 0;
+  precisions->clear();
+  recalls->clear();
+  precisions->reserve(detection_sorted_indices.size());
+  recalls->reserve(detection_sorted_indices.size());
+  assert(evaluations.size() > 0 || detection_sorted_indices.empty());
+  for (auto detection_sorted_index : detection_sorted_indices) {
+    const int64_t e = evaluation_indices[detection_sorted_index];
+    const uint64_t detection_begin = evaluations.detection_offsets[e];
+    const auto num_detections =
+        evaluations.detection_offsets[e + 1] - detection_begin;
+    const auto detection_index = num_iou_thresholds * detection_begin +
+        iou_threshold_index * num_detections +
+        image_detection_indices[detection_sorted_index];
+    assert(evaluations.detection_matches.size() > detection_index);
+    assert(evaluations.detection_ignores.size() > detection_index);
+    const int64_t detection_match =
+        evaluations.detection_matches[detection_index];
+    const bool detection_ignores =
+        evaluations.detection_ignores[detection_index];
+    const auto true_positive = detection_match > 0 && !detection_ignores;
+    const auto false_positive = detection_match == 0 && !detection_ignores;
+    if (true_positive) {
+      ++true_positives_sum;
+    }
+    if (false_positive) {
+      ++false_positives_sum;
+    }
+
+    const double recall =
+        static_cast<double>(true_positives_sum) / num_valid_ground_truth;
+    recalls->push_back(recall);
+    const int64_t num_valid_detections =
+        true_positives_sum + false_positives_sum;
+    const double precision = num_valid_detections > 0
+        ? static_cast<double>(true_positives_sum) / num_valid_detections
+        : 0.0;
+    precisions->push_back(precision);
+  }
+
+  (*recalls_out)[recalls_out_index] = !recalls->empty() ? recalls->back() : 0;
+
+  for (int64_t i = static_cast<int64_t>(precisions->size()) - 1; i > 0; --i) {
+    if ((*precisions)[i] > (*precisions)[i - 1]) {
+      (*precisions)[i - 1] = (*precisions)[i];
+    }
+  }
+
+  // Sample the per instance precision/recall list at each recall threshold
+  for (size_t r = 0; r < recall_thresholds.size(); ++r) {
+    // first index in recalls >= recall_thresholds[r]
+    std::vector<double>::iterator low = std::lower_bound(
+        recalls->begin(), recalls->end(), recall_thresholds[r]);
+    size_t precisions_index = low - recalls->begin();
+
+    const auto results_ind = precisions_out_index + r * precisions_out_stride;
+    assert(results_ind < precisions_out->size());
+    assert(results_ind < scores_out->size());
+    if (precisions_index < precisions->size()) {
+      (*precisions_out)[results_ind] = (*precisions)[precisions_index];
+      (*scores_out)[results_ind] =
+          detection_scores[detection_sorted_indices[precisions_index]];
+    } else {
+      (*precisions_out)[results_ind] = 0;
+      (*scores_out)[results_ind] = 0;
+    }
+  }
+}
+
+void Accumulate(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    int num_threads,
+    std::vector<double>* precisions_out,
+    std::vector<double>* recalls_out,
+    std::vector<double>* scores_out) {
+  const std::vector<double>& recall_thresholds = params.recall_thresholds;
+  const std::vector<int>& max_detections = params.max_detections;
+  const int num_iou_thresholds = params.num_iou_thresholds;
+  const int num_recall_thresholds = recall_thresholds.size();
+  const int num_categories = params.num_categories;
+  const int num_area_ranges = params.num_area_ranges;
+  const int num_max_detections = max_detections.size();
+  const int num_images = params.num_images;
+
+  precisions_out->assign(
+      num_iou_thresholds * num_recall_thresholds * num_categories *
+          num_area_ranges * num_max_detections,
+      -1);
+  recalls_out->assign(
+      num_iou_thresholds * num_categories * num_area_ranges *
+          num_max_detections,
+      -1);
+  scores_out->assign(
+      num_iou_thresholds * num_recall_thresholds * num_categories *
+          num_area_ranges * num_max_detections,
+      -1);
+
+  // Consider the list of all detected instances in the entire dataset in one
+  // large list.  evaluation_indices, detection_scores,
+  // image_detection_indices, and detection_sorted_indices all have the same
+  // length as this list, such that each entry corresponds to one detected
+  // instance.  Every (category, area range, max detections) cell only writes
+  // its own entries of the output buffers, so cells are processed concurrently
+  // with one set of these buffers per thread
+  struct Scratch {
+    std::vector<uint64_t> evaluation_indices; // entries of evaluations
+    std::vector<double> detection_scores; // detection scores of each instance
+    std::vector<uint64_t> detection_sorted_indices; // sorted indices of all
+                                                    // instances in the dataset
+    std::vector<uint64_t>
+        image_detection_indices; // indices into the list of detected instances
+                                 // in the same image as each instance
+    std::vector<uint64_t>
+        max_detections_sorted_indices; // detection_sorted_indices limited to
+                                       // a smaller max detections setting
+    std::vector<double> precisions, recalls;
+  };
+  const int64_t num_cells =
+      static_cast<int64_t>(num_categories) * num_area_ranges;
+  num_threads = ResolveNumThreads(num_threads, num_cells);
+  std::vector<Scratch> scratches(num_threads);
+  const int largest_max_detections = num_max_detections > 0
+      ? *std::max_element(max_detections.begin(), max_detections.end())
+      : 0;
+
+  ParallelFor(num_cells, num_threads, [&](int worker_index, int64_t cell) {
+    const int c = cell / num_area_ranges;
+    const int a = cell % num_area_ranges;
+    Scratch& scratch = scratches[worker_index];
+
+    // The COCO PythonAPI assumes evaluations (the return value of
+    // COCOeval::EvaluateImages()) stores results for each combination of
+    // category, area range, and image id, with categories in the outermost
+    // loop and images in the innermost loop.  The detections are sorted only
+    // once for the largest max detections setting; the sorted lists of the
+    // other settings are the subsets of this list within their per image
+    // limit, in the same (stable) order
+    const int64_t evaluations_index =
+        c * num_area_ranges * num_images + a * num_images;
+    int num_valid_ground_truth = BuildSortedDetectionList(
+        evaluations,
+        evaluations_index,
+        num_images,
+        largest_max_detections,
+        &scratch.evaluation_indices,
+        &scratch.detection_scores,
+        &scratch.detection_sorted_indices,
+        &scratch.image_detection_indices);
+
+    if (num_valid_ground_truth == 0) {
+      return;
+    }
+
+    for (auto m = 0; m < num_max_detections; ++m) {
+      const std::vector<uint64_t>* detection_sorted_indices =
+          &scratch.detection_sorted_indices;
+      if (max_detections[m] < largest_max_detections) {
+        scratch.max_detections_sorted_indices.clear();
+        for (auto detection_sorted_index : scratch.detection_sorted_indices) {
+          if (scratch.image_detection_indices[detection_sorted_index] <
+              (uint64_t)std::max(max_detections[m], 0)) {
+            scratch.max_detections_sorted_indices.push_back(
+                detection_sorted_index);
+          }
+        }
+        detection_sorted_indices = &scratch.max_detections_sorted_indices;
+      }
+
+      for (auto t = 0; t < num_iou_thresholds; ++t) {
+        // recalls_out is a flattened vectors representing a
+        // num_iou_thresholds X num_categories X num_area_ranges X
+        // num_max_detections matrix
+        const int64_t recalls_out_index =
+            t * num_categories * num_area_ranges * num_max_detections +
+            c * num_area_ranges * num_max_detections +
+            a * num_max_detections + m;
+
+        // precisions_out and scores_out are flattened vectors
+        // representing a num_iou_thresholds X num_recall_thresholds X
+        // num_categories X num_area_ranges X num_max_detections matrix
+        const int64_t precisions_out_stride =
+            num_categories * num_area_ranges * num_max_detections;
+        const int64_t precisions_out_index = t * num_recall_thresholds *
+                num_categories * num_area_ranges * num_max_detections +
+            c * num_area_ranges * num_max_detections +
+            a * num_max_detections + m;
+
+        ComputePrecisionRecallCurve(
+            precisions_out_index,
+            precisions_out_stride,
+            recalls_out_index,
+            recall_thresholds,
+            t,
+            num_iou_thresholds,
+            num_valid_ground_truth,
+            evaluations,
+            scratch.evaluation_indices,
+            scratch.detection_scores,
+            *detection_sorted_indices,
+            scratch.image_detection_indices,
+            &scratch.precisions,
+            &scratch.recalls,
+            precisions_out,
+            scores_out,
+            recalls_out);
+      }
+    }
+  });
+}
+
+// Helper function to Bootstrap()
+// Same as ComputePrecisionRecallCurve() for a resample of the images, where
+// the detections of the image of entry evaluations_index + i count
+// image_weights[i] times and num_valid_ground_truth is the weighted number of
+// ground truth instances.  Only the sum of the precisions at all recall
+// thresholds is returned, and the final recall stored in *recall.  An image
+// drawn k times contributes k identical detections with the same score, which
+// gives the same interpolated precisions as adding its detections once with k
+// times the weight
+double SumResampledPrecisions(
+    const std::vector<double>& recall_thresholds,
+    const int iou_threshold_index,
+    const int num_iou_thresholds,
+    const int64_t num_valid_ground_truth,
+    const ImageEvaluations& evaluations,
+    const std::vector<uint64_t>& evaluation_indices,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<uint64_t>& image_detection_indices,
+    const int64_t evaluations_index,
+    const uint32_t* image_weights,
+    std::vector<double>* precisions,
+    std::vector<double>* recalls,
+    double* recall) {
+  int64_t true_positives_sum = 0, false_positives_sum = 0;
+  precisions->clear();
+  recalls->clear();
+  for (auto detection_sorted_index : detection_sorted_indices) {
+    const int64_t e = evaluation_indices[detection_sorted_index];
+    const int64_t weight = image_weights[e - evaluations_index];
+    if (weight == 0) {
+      continue;
+    }
+    const uint64_t detection_begin = evaluations.detection_offsets[e];
+    const auto num_detections =
+        evaluations.detection_offsets[e + 1] - detection_begin;
+    const auto detection_index = num_iou_thresholds * detection_begin +
+        iou_threshold_index * num_detections +
+        image_detection_indices[detection_sorted_index];
+    if (evaluations.detection_ignores[detection_index]) {
+      // Ignored detections leave the curve unchanged
+      continue;
+    }
+    if (evaluations.detection_matches[detection_index] > 0) {
+      true_positives_sum += weight;
+    } else {
+      false_positives_sum += weight;
+    }
+    recalls->push_back(
+        static_cast<double>(true_positives_sum) / num_valid_ground_truth);
+    precisions->push_back(
+        static_cast<double>(true_positives_sum) /
+        (true_positives_sum + false_positives_sum));
+  }
+  *recall = !recalls->empty() ? recalls->back() : 0;
+
+  for (int64_t i = static_cast<int64_t>(precisions->size()) - 1; i > 0; --i) {
+    if ((*precisions)[i] > (*precisions)[i - 1]) {
+      (*precisions)[i - 1] = (*precisions)[i];
+    }
+  }
+  double precisions_sum = 0.;
+  for (const double recall_threshold : recall_thresholds) {
+    const size_t precisions_index =
+        std::lower_bound(recalls->begin(), recalls->end(), recall_threshold) -
+        recalls->begin();
+    if (precisions_index < precisions->size()) {
+      precisions_sum += (*precisions)[precisions_index];
+    }
+  }
+  return precisions_sum;
+}
+
+void Bootstrap(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    const std::vector<SummaryStat>& stats,
+    int num_samples,
+    uint64_t seed,
+    int num_threads,
+    std::vector<double>* samples_out) {
+  const int num_iou_thresholds = params.num_iou_thresholds;
+  const int num_recall_thresholds = params.recall_thresholds.size();
+  const int num_categories = params.num_categories;
+  const int num_area_ranges = params.num_area_ranges;
+  const int num_max_detections = params.max_detections.size();
+  const int num_images = params.num_images;
+  const int num_stats = stats.size();
+  for (const SummaryStat& stat : stats) {
+    if (stat.iou_threshold_index >= num_iou_thresholds ||
+        stat.area_range_index < 0 ||
+        stat.area_range_index >= num_area_ranges ||
+        stat.max_detections_index < 0 ||
+        stat.max_detections_index >= num_max_detections) {
+      throw std::out_of_range("summary statistic parameter out of range");
+    }
+  }
+  num_samples = std::max(num_samples, 0);
+  samples_out->assign(static_cast<int64_t>(num_samples) * num_stats, -1.);
+  if (num_images == 0 || num_samples == 0) {
+    return;
+  }
+
+  // The number of times each image is drawn in each sample
+  std::vector<uint32_t> image_weights(
+      static_cast<int64_t>(num_samples) * num_images, 0);
+  ParallelFor(
+      num_samples,
+      ResolveNumThreads(num_threads, num_samples),
+      [&](int /* worker_index */, int64_t n) {
+        std::seed_seq seeds{
+            static_cast<uint32_t>(seed),
+            static_cast<uint32_t>(seed >> 32),
+            static_cast<uint32_t>(n)};
+        std::mt19937_64 generator(seeds);
+        std::uniform_int_distribution<int> draw(0, num_images - 1);
+        uint32_t* weights = &image_weights[n * num_images];
+        for (auto i = 0; i < num_images; ++i) {
+          ++weights[draw(generator)];
+        }
+      });
+
+  // Each (category, area range) cell writes the sums and counts of its
+  // contributions to each statistic and sample into its own slice, which are
+  // reduced in cell order afterwards so that the results are deterministic
+  const int64_t num_cells =
+      static_cast<int64_t>(num_categories) * num_area_ranges;
+  const int64_t cell_size = static_cast<int64_t>(num_samples) * num_stats;
+  std::vector<double> cell_sums(num_cells * cell_size, 0.);
+  std::vector<int64_t> cell_counts(num_cells * cell_size, 0);
+  struct Scratch {
+    std::vector<uint64_t> evaluation_indices;
+    std::vector<double> detection_scores;
+    std::vector<uint64_t> detection_sorted_indices;
+    std::vector<uint64_t> image_detection_indices;
+    std::vector<std::vector<uint64_t>> max_detections_sorted_indices;
+    std::vector<uint32_t> ground_truth_counts;
+    std::vector<double> precisions, recalls;
+    std::vector<bool> computed;
+    std::vector<double> precisions_sums, final_recalls;
+  };
+  num_threads = ResolveNumThreads(num_threads, num_cells);
+  std::vector<Scratch> scratches(num_threads);
+  const int largest_max_detections = num_max_detections > 0
+      ? *std::max_element(
+            params.max_detections.begin(), params.max_detections.end())
+      : 0;
+
+  ParallelFor(num_cells, num_threads, [&](int worker_index, int64_t cell) {
+    const int c = cell / num_area_ranges;
+    const int a = cell % num_area_ranges;
+    std::vector<int> cell_stats;
+    for (auto s = 0; s < num_stats; ++s) {
+      if (stats[s].area_range_index == a) {
+        cell_stats.push_back(s);
+      }
+    }
+    if (cell_stats.empty()) {
+      return;
+    }
+    Scratch& scratch = scratches[worker_index];
+
+    // Sort the detections once for all samples, like in Accumulate()
+    const int64_t evaluations_index =
+        c * num_area_ranges * num_images + a * num_images;
+    BuildSortedDetectionList(
+        evaluations,
+        evaluations_index,
+        num_images,
+        largest_max_detections,
+        &scratch.evaluation_indices,
+        &scratch.detection_scores,
+        &scratch.detection_sorted_indices,
+        &scratch.image_detection_indices);
+    scratch.max_detections_sorted_indices.resize(num_max_detections);
+    for (auto s : cell_stats) {
+      const int m = stats[s].max_detections_index;
+      std::vector<uint64_t>& sorted_indices =
+          scratch.max_detections_sorted_indices[m];
+      sorted_indices.clear();
+      for (auto detection_sorted_index : scratch.detection_sorted_indices) {
+        if (scratch.image_detection_indices[detection_sorted_index] <
+            (uint64_t)std::max(params.max_detections[m], 0)) {
+          sorted_indices.push_back(detection_sorted_index);
+        }
+      }
+    }
+    scratch.computed.assign(num_max_detections * num_iou_thresholds, false);
+    scratch.precisions_sums.resize(scratch.computed.size());
+    scratch.final_recalls.resize(scratch.computed.size());
+    scratch.ground_truth_counts.assign(num_images, 0);
+    for (auto i = 0; i < num_images; ++i) {
+      const int64_t e = evaluations_index + i;
+      for (uint64_t g = evaluations.ground_truth_offsets[e];
+           g < evaluations.ground_truth_offsets[e + 1];
+           ++g) {
+        scratch.ground_truth_counts[i] += !evaluations.ground_truth_ignores[g];
+      }
+    }
+
+    double* sums = &cell_sums[cell * cell_size];
+    int64_t* counts = &cell_counts[cell * cell_size];
+    for (auto n = 0; n < num_samples; ++n) {
+      const uint32_t* weights =
+          &image_weights[static_cast<int64_t>(n) * num_images];
+      int64_t num_valid_ground_truth = 0;
+      for (auto i = 0; i < num_images; ++i) {
+        num_valid_ground_truth +=
+            static_cast<int64_t>(weights[i]) * scratch.ground_truth_counts[i];
+      }
+      if (num_valid_ground_truth == 0) {
+        continue;
+      }
+      // Statistics often share curves (e.g., AP and AR at the same max
+      // detections), so each curve is computed at most once per sample
+      std::fill(scratch.computed.begin(), scratch.computed.end(), false);
+      for (auto s : cell_stats) {
+        const SummaryStat& stat = stats[s];
+        const int m = stat.max_detections_index;
+        const int t_begin =
+            stat.iou_threshold_index >= 0 ? stat.iou_threshold_index : 0;
+        const int t_end = stat.iou_threshold_index >= 0
+            ? stat.iou_threshold_index + 1
+            : num_iou_thresholds;
+        for (auto t = t_begin; t < t_end; ++t) {
+          const int curve = m * num_iou_thresholds + t;
+          if (!scratch.computed[curve]) {
+            scratch.precisions_sums[curve] = SumResampledPrecisions(
+                params.recall_thresholds,
+                t,
+                num_iou_thresholds,
+                num_valid_ground_truth,
+                evaluations,
+                scratch.evaluation_indices,
+                scratch.max_detections_sorted_indices[m],
+                scratch.image_detection_indices,
+                evaluations_index,
+                weights,
+                &scratch.precisions,
+                &scratch.recalls,
+                &scratch.final_recalls[curve]);
+            scratch.computed[curve] = true;
+          }
+          sums[n * num_stats + s] += stat.average_precision
+              ? scratch.precisions_sums[curve]
+              : scratch.final_recalls[curve];
+          counts[n * num_stats + s] +=
+              stat.average_precision ? num_recall_thresholds : 1;
+        }
+      }
+    }
+  });
+
+  for (int64_t k = 0; k < cell_size; ++k) {
+    double sum = 0.;
+    int64_t count = 0;
+    for (int64_t cell = 0; cell < num_cells; ++cell) {
+      sum += cell_sums[cell * cell_size + k];
+      count += cell_counts[cell * cell_size + k];
+    }
+    if (count > 0) {
+      (*samples_out)[k] = sum / count;
+    }
+  }
+}
+
+std::vector<OperatingCurve> ComputeOperatingCurves(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    int iou_threshold_index,
+    int area_range_index,
+    int max_detections_index,
+    int num_threads) {
+  const int num_iou_thresholds = params.num_iou_thresholds;
+  const int num_categories = params.num_categories;
+  const int num_area_ranges = params.num_area_ranges;
+  const int num_images = params.num_images;
+  if (iou_threshold_index < 0 || iou_threshold_index >= num_iou_thresholds ||
+      area_range_index < 0 || area_range_index >= num_area_ranges ||
+      max_detections_index < 0 ||
+      max_detections_index >= (int)params.max_detections.size()) {
+    throw std::out_of_range("operating curve parameter out of range");
+  }
+  const int max_detections =
+      std::max(params.max_detections[max_detections_index], 0);
+
+  struct Scratch {
+    std::vector<uint64_t> evaluation_indices;
+    std::vector<double> detection_scores;
+    std::vector<uint64_t> detection_sorted_indices;
+    std::vector<uint64_t> image_detection_indices;
+  };
+  num_threads = ResolveNumThreads(num_threads, num_categories);
+  std::vector<Scratch> scratches(num_threads);
+  std::vector<OperatingCurve> curves(num_categories);
+
+  ParallelFor(num_categories, num_threads, [&](int worker_index, int64_t c) {
+    Scratch& scratch = scratches[worker_index];
+    OperatingCurve& curve = curves[c];
+    const int64_t evaluations_index =
+        c * num_area_ranges * num_images + area_range_index * num_images;
+    curve.num_ground_truth = BuildSortedDetectionList(
+        evaluations,
+        evaluations_index,
+        num_images,
+        max_detections,
+        &scratch.evaluation_indices,
+        &scratch.detection_scores,
+        &scratch.detection_sorted_indices,
+        &scratch.image_detection_indices);
+    if (curve.num_ground_truth == 0) {
+      return;
+    }
+
+    // A threshold keeps all detections with the same score or none of them,
+    // so a point is added after the last detection of each score only
+    int64_t true_positives_sum = 0, false_positives_sum = 0;
+    int64_t last_num_valid_detections = 0;
+    const size_t num_detections = scratch.detection_sorted_indices.size();
+    for (size_t j = 0; j < num_detections; ++j) {
+      const uint64_t detection_sorted_index =
+          scratch.detection_sorted_indices[j];
+      const int64_t e = scratch.evaluation_indices[detection_sorted_index];
+      const uint64_t detection_begin = evaluations.detection_offsets[e];
+      const auto image_num_detections =
+          evaluations.detection_offsets[e + 1] - detection_begin;
+      const auto detection_index = num_iou_thresholds * detection_begin +
+          iou_threshold_index * image_num_detections +
+          scratch.image_detection_indices[detection_sorted_index];
+      if (!evaluations.detection_ignores[detection_index]) {
+        if (evaluations.detection_matches[detection_index] > 0) {
+          ++true_positives_sum;
+        } else {
+          ++false_positives_sum;
+        }
+      }
+
+      const double score = scratch.detection_scores[detection_sorted_index];
+      const int64_t num_valid_detections =
+          true_positives_sum + false_positives_sum;
+      if ((j + 1 < num_detections &&
+           scratch.detection_scores[scratch.detection_sorted_indices[j + 1]] ==
+               score) ||
+          num_valid_detections == last_num_valid_detections) {
+        continue;
+      }
+      last_num_valid_detections = num_valid_detections;
+      const double precision =
+          static_cast<double>(true_positives_sum) / num_valid_detections;
+      const double recall =
+          static_cast<double>(true_positives_sum) / curve.num_ground_truth;
+      const double f1 = true_positives_sum > 0
+          ? 2 * precision * recall / (precision + recall)
+          : 0.;
+      curve.scores.push_back(score);
+      curve.precisions.push_back(precision);
+      curve.recalls.push_back(recall);
+      curve.f1_scores.push_back(f1);
+      if (f1 > curve.best_f1) {
+        curve.best_score = score;
+        curve.best_precision = precision;
+        curve.best_recall = recall;
+        curve.best_f1 = f1;
+      }
+    }
+  });
+  return curves;
+}
+
+// Helper function to AnalyzeErrors()
+// Average precision of the sorted detections of one category (see
+// BuildSortedDetectionList()) at IOU threshold index iou_threshold_index
+// after fixing the errors of type fix, or of none if fix is kNumErrorTypes.
+// error_types and error_targets hold the error type of every false positive
+// and the unmatched ground truth instance it localizes (or -1), indexed like
+// evaluations.detection_scores.  claimed marks the instances claimed by fixed
+// localization errors, and is reset before returning
+double FixedAveragePrecision(
+    const std::vector<double>& recall_thresholds,
+    const int iou_threshold_index,
+    const int num_iou_thresholds,
+    const int64_t num_valid_ground_truth,
+    const ImageEvaluations& evaluations,
+    const std::vector<uint64_t>& evaluation_indices,
+    const std::vector<uint64_t>& detection_sorted_indices,
+    const std::vector<uint64_t>& image_detection_indices,
+    const std::vector<uint8_t>& error_types,
+    const std::vector<int64_t>& error_targets,
+    const int fix,
+    std::vector<uint8_t>* claimed,
+    std::vector<int64_t>* claimed_targets,
+    std::vector<double>* precisions,
+    std::vector<double>* recalls) {
+  if (num_valid_ground_truth <= 0 || recall_thresholds.empty()) {
+    return -1;
+  }
+  int64_t true_positives_sum = 0, false_positives_sum = 0;
+  precisions->clear();
+  recalls->clear();
+  claimed_targets->clear();
+  for (auto detection_sorted_index : detection_sorted_indices) {
+    const int64_t e = evaluation_indices[detection_sorted_index];
+    const uint64_t detection_begin = evaluations.detection_offsets[e];
+    const auto num_detections =
+        evaluations.detection_offsets[e + 1] - detection_begin;
+    const uint64_t detection =
+        detection_begin + image_detection_indices[detection_sorted_index];
+    const auto detection_index = num_iou_thresholds * detection_begin +
+        iou_threshold_index * num_detections +
+        image_detection_indices[detection_sorted_index];
+    if (evaluations.detection_ignores[detection_index]) {
+      continue;
+    }
+    if (evaluations.detection_matches[detection_index] > 0) {
+      ++true_positives_sum;
+    } else if (error_types[detection] != fix) {
+      ++false_positives_sum;
+    } else {
+      const int64_t target = error_targets[detection];
+      if (fix != kLocalizationError || target < 0 || (*claimed)[target]) {
+        // The error is removed
+        continue;
+      }
+      (*claimed)[target] = true;
+      claimed_targets->push_back(target);
+      ++true_positives_sum;
+    }
+    recalls->push_back(
+        static_cast<double>(true_positives_sum) / num_valid_ground_truth);
+    precisions->push_back(
+        static_cast<double>(true_positives_sum) /
+        (true_positives_sum + false_positives_sum));
+  }
+  for (const int64_t target : *claimed_targets) {
+    (*claimed)[target] = false;
+  }
+
+  for (int64_t i = static_cast<int64_t>(precisions->size()) - 1; i > 0; --i) {
+    if ((*precisions)[i] > (*precisions)[i - 1]) {
+      (*precisions)[i - 1] = (*precisions)[i];
+    }
+  }
+  double precisions_sum = 0.;
+  for (const double recall_threshold : recall_thresholds) {
+    const size_t precisions_index =
+        std::lower_bound(recalls->begin(), recalls->end(), recall_threshold) -
+        recalls->begin();
+    if (precisions_index < precisions->size()) {
+      precisions_sum += (*precisions)[precisions_index];
+    }
+  }
+  return precisions_sum / recall_thresholds.size();
+}
+
+ErrorBreakdown AnalyzeErrors(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    const ImageEvaluations& evaluations,
+    const AccumulateParams& params,
+    int iou_threshold_index,
+    double foreground_iou,
+    double background_iou,
+    int area_range_index,
+    int num_threads) {
+  const int num_iou_thresholds = params.num_iou_thresholds;
+  const int num_area_ranges = params.num_area_ranges;
+  const int num_images = ground_truth_images.size();
+  const int num_categories = ground_truth.num_groups();
+  const int a = area_range_index;
+  if (!ground_truth.use_categories) {
+    throw std::invalid_argument("error analysis needs categories");
+  }
+  if (iou_threshold_index < 0 || iou_threshold_index >= num_iou_thresholds ||
+      a < 0 || a >= num_area_ranges) {
+    throw std::out_of_range("error analysis parameter out of range");
+  }
+  if (!(background_iou > 0. && background_iou < foreground_iou)) {
+    throw std::invalid_argument(
+        "error analysis needs 0 < background IOU < foreground IOU");
+  }
+  if (image_category_detection_instances.size() != (size_t)num_images ||
+      params.num_categories != num_categories ||
+      params.num_images != num_images ||
+      evaluations.size() !=
+          static_cast<size_t>(num_categories) * num_area_ranges * num_images) {
+    throw std::invalid_argument(
+        "evaluations do not match the ground truth and detections");
+  }
+  const uint64_t total_ground_truth = ground_truth.offsets.back();
+
+  // Classify the false positives and missed instances of every image, which
+  // only touches the detections and ground truth instances of that image.
+  // Each worker counts the errors of its images separately
+  std::vector<uint8_t> error_types(
+      evaluations.detection_scores.size(), kNumErrorTypes);
+  std::vector<int64_t> error_targets(evaluations.detection_scores.size(), -1);
+  std::vector<uint8_t> matched(total_ground_truth, false);
+  std::vector<uint8_t> covered(total_ground_truth, false);
+  struct Scratch {
+    std::vector<int64_t> error_counts;
+    std::vector<uint64_t> detection_sorted_indices;
+    std::vector<std::pair<uint64_t, int>> ground_truth_ids;
+  };
+  num_threads = ResolveNumThreads(num_threads, num_images);
+  std::vector<Scratch> scratches(num_threads);
+  for (Scratch& scratch : scratches) {
+    scratch.error_counts.assign(num_categories * kNumErrorTypes, 0);
+  }
+
+  ParallelFor(num_images, num_threads, [&](int worker_index, int64_t i) {
+    Scratch& scratch = scratches[worker_index];
+    const int ground_truth_image = ground_truth_images[i];
+    const int64_t group_begin =
+        static_cast<int64_t>(ground_truth_image) * num_categories;
+    auto is_ignored = [&](int c, int g) {
+      const uint64_t offset = ground_truth.offsets[group_begin + c];
+      const int64_t num_ground_truth =
+          ground_truth.offsets[group_begin + c + 1] - offset;
+      return ground_truth
+          .ignores[num_area_ranges * offset + a * num_ground_truth + g];
+    };
+
+    // Mark the instances matched at the threshold
+    for (auto c = 0; c < num_categories; ++c) {
+      const std::vector<InstanceAnnotation>& ground_truth_instances =
+          (*ground_truth.instances)[ground_truth_image][c];
+      const uint64_t offset = ground_truth.offsets[group_begin + c];
+      const int64_t e = c * num_area_ranges * num_images + a * num_images + i;
+      const uint64_t detection_begin = evaluations.detection_offsets[e];
+      const uint64_t num_detections =
+          evaluations.detection_offsets[e + 1] - detection_begin;
+      scratch.ground_truth_ids.clear();
+      for (size_t g = 0; g < ground_truth_instances.size(); ++g) {
+        scratch.ground_truth_ids.emplace_back(ground_truth_instances[g].id, g);
+      }
+      std::sort(
+          scratch.ground_truth_ids.begin(), scratch.ground_truth_ids.end());
+      for (uint64_t d = 0; d < num_detections; ++d) {
+        const uint64_t match = evaluations.detection_matches
+            [num_iou_thresholds * detection_begin +
+             iou_threshold_index * num_detections + d];
+        auto it = std::lower_bound(
+            scratch.ground_truth_ids.begin(),
+            scratch.ground_truth_ids.end(),
+            std::make_pair(match, 0));
+        if (match > 0 && it != scratch.ground_truth_ids.end() &&
+            it->first == match) {
+          matched[offset + it->second] = true;
+        }
+      }
+    }
+
+    // Compare each false positive with the non-crowd instances of all
+    // categories of the image.  The IOUs of EvaluateImages() only cover the
+    // detection's own category and are discarded after each work item, so
+    // the box IOUs of the false positives are computed again here
+    for (auto c = 0; c < num_categories; ++c) {
+      const std::vector<InstanceAnnotation>& detection_instances =
+          image_category_detection_instances[i][c];
+      const int64_t e = c * num_area_ranges * num_images + a * num_images + i;
+      const uint64_t detection_begin = evaluations.detection_offsets[e];
+      const uint64_t num_detections =
+          evaluations.detection_offsets[e + 1] - detection_begin;
+      SortInstancesByDetectionScore(
+          detection_instances,
+          num_detections,
+          &scratch.detection_sorted_indices);
+      for (uint64_t d = 0; d < num_detections; ++d) {
+        const auto detection_index = num_iou_thresholds * detection_begin +
+            iou_threshold_index * num_detections + d;
+        if (evaluations.detection_ignores[detection_index] ||
+            evaluations.detection_matches[detection_index] > 0) {
+          continue;
+        }
+        const std::array<double, 4>& bbox =
+            detection_instances[scratch.detection_sorted_indices[d]].bbox;
+        const double x0 = bbox[0];
+        const double y0 = bbox[1];
+        const double x1 = bbox[0] + bbox[2];
+        const double y1 = bbox[1] + bbox[3];
+        const double area = bbox[2] * bbox[3];
+        double same_iou = 0., other_iou = 0.;
+        int64_t same_target = -1, other_target = -1;
+        for (auto c2 = 0; c2 < num_categories; ++c2) {
+          const uint64_t offset = ground_truth.offsets[group_begin + c2];
+          const int64_t num_ground_truth =
+              ground_truth.offsets[group_begin + c2 + 1] - offset;
+          const double* columns = &ground_truth.box_columns[6 * offset];
+          for (int64_t g = 0; g < num_ground_truth; ++g) {
+            if (columns[5 * num_ground_truth + g] != 0.) {
+              continue;
+            }
+            const double width =
+                std::min(x1, columns[2 * num_ground_truth + g]) -
+                std::max(x0, columns[g]);
+            const double height =
+                std::min(y1, columns[3 * num_ground_truth + g]) -
+                std::max(y0, columns[num_ground_truth + g]);
+            if (width <= 0. || height <= 0.) {
+              continue;
+            }
+            const double intersection = width * height;
+            const double iou = intersection /
+                (area + columns[4 * num_ground_truth + g] - intersection);
+            if (c2 == c && iou > same_iou) {
+              same_iou = iou;
+              same_target = offset + g;
+            } else if (c2 != c && iou > other_iou) {
+              other_iou = iou;
+              other_target = offset + g;
+            }
+          }
+        }
+
+        // Same order of tests as TIDE
+        int error_type;
+        int64_t target = -1;
+        if (std::max(same_iou, other_iou) <= background_iou) {
+          error_type = kBackgroundError;
+        } else if (
+            same_target >= 0 && same_iou >= background_iou &&
+            same_iou < foreground_iou) {
+          error_type = kLocalizationError;
+          target = same_target;
+        } else if (other_iou >= foreground_iou) {
+          error_type = kClassificationError;
+          target = other_target;
+        } else if (same_iou >= foreground_iou) {
+          error_type = kDuplicateError;
+        } else {
+          error_type = kBothError;
+          target = other_target;
+        }
+        if (target >= 0) {
+          covered[target] = true;
+        }
+        const uint64_t detection = detection_begin + d;
+        error_types[detection] = error_type;
+        if (error_type == kLocalizationError && target >= 0 &&
+            !matched[target] &&
+            !is_ignored(c, target - ground_truth.offsets[group_begin + c])) {
+          error_targets[detection] = target;
+        }
+        ++scratch.error_counts[c * kNumErrorTypes + error_type];
+      }
+    }
+
+    // Instances that were neither matched nor close to a false positive are
+    // missed
+    for (auto c = 0; c < num_categories; ++c) {
+      const uint64_t offset = ground_truth.offsets[group_begin + c];
+      const int64_t num_ground_truth =
+          ground_truth.offsets[group_begin + c + 1] - offset;
+      for (int64_t g = 0; g < num_ground_truth; ++g) {
+        if (!is_ignored(c, g) && !matched[offset + g] &&
+            !covered[offset + g]) {
+          ++scratch.error_counts[c * kNumErrorTypes + kMissedError];
+        }
+      }
+    }
+  });
+
+  ErrorBreakdown breakdown;
+  breakdown.error_counts.assign(num_categories * kNumErrorTypes, 0);
+  for (const Scratch& scratch : scratches) {
+    for (size_t k = 0; k < breakdown.error_counts.size(); ++k) {
+      breakdown.error_counts[k] += scratch.error_counts[k];
+    }
+  }
+
+  // Recompute the AP of every category with each type of error fixed, from
+  // the same sorted detection lists as Accumulate()
+  breakdown.average_precisions.assign(num_categories, -1);
+  breakdown.fixed_average_precisions.assign(
+      num_categories * kNumErrorTypes, -1);
+  struct CategoryScratch {
+    std::vector<uint64_t> evaluation_indices;
+    std::vector<double> detection_scores;
+    std::vector<uint64_t> detection_sorted_indices;
+    std::vector<uint64_t> image_detection_indices;
+    std::vector<int64_t> claimed_targets;
+    std::vector<double> precisions, recalls;
+  };
+  const int category_threads =
+      ResolveNumThreads(num_threads, num_categories);
+  std::vector<CategoryScratch> category_scratches(category_threads);
+  std::vector<uint8_t> claimed(total_ground_truth, false);
+  const int largest_max_detections = params.max_detections.empty()
+      ? 0
+      : *std::max_element(
+            params.max_detections.begin(), params.max_detections.end());
+
+  ParallelFor(
+      num_categories, category_threads, [&](int worker_index, int64_t c) {
+        CategoryScratch& scratch = category_scratches[worker_index];
+        const int64_t num_valid_ground_truth = BuildSortedDetectionList(
+            evaluations,
+            c * num_area_ranges * num_images + a * num_images,
+            num_images,
+            largest_max_detections,
+            &scratch.evaluation_indices,
+            &scratch.detection_scores,
+            &scratch.detection_sorted_indices,
+            &scratch.image_detection_indices);
+        // Instances of different categories never share a claimed flag
+        for (auto fix = 0; fix <= kNumErrorTypes; ++fix) {
+          const double average_precision = FixedAveragePrecision(
+              params.recall_thresholds,
+              iou_threshold_index,
+              num_iou_thresholds,
+              fix == kMissedError
+                  ? num_valid_ground_truth -
+                      breakdown.error_counts[c * kNumErrorTypes + kMissedError]
+                  : num_valid_ground_truth,
+              evaluations,
+              scratch.evaluation_indices,
+              scratch.detection_sorted_indices,
+              scratch.image_detection_indices,
+              error_types,
+              error_targets,
+              fix,
+              &claimed,
+              &scratch.claimed_targets,
+              &scratch.precisions,
+              &scratch.recalls);
+          if (fix == kNumErrorTypes) {
+            breakdown.average_precisions[c] = average_precision;
+          } else {
+            breakdown.fixed_average_precisions[c * kNumErrorTypes + fix] =
+                average_precision;
+          }
+        }
+      });
+  return breakdown;
+}
+
+} // namespace COCOeval
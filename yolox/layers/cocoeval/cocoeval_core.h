@@ -0,0 +1,481 @@
+// Copyright (c) Facebook, Inc. and its affiliates. All Rights Reserved
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The evaluation core of the cocoeval extension, which does not depend on
+// python, so that it can also be built into standalone tools
+
+namespace COCOeval {
+
+// Annotation data for a single object instance in an image
+struct InstanceAnnotation {
+  InstanceAnnotation(
+      uint64_t id,
+      double score,
+      double area,
+      bool is_crowd,
+      bool ignore)
+      : id{id}, score{score}, area{area}, is_crowd{is_crowd}, ignore{ignore} {}
+  InstanceAnnotation(
+      uint64_t id,
+      double score,
+      double area,
+      bool is_crowd,
+      bool ignore,
+      const std::array<double, 4>& bbox)
+      : id{id},
+        score{score},
+        area{area},
+        is_crowd{is_crowd},
+        ignore{ignore},
+        bbox(bbox) {}
+  uint64_t id;
+  double score = 0.;
+  double area = 0.;
+  bool is_crowd = false;
+  bool ignore = false;
+  // Bounding box in COCO [x, y, width, height] format, only used when IOUs are
+  // computed by EvaluateImages() itself
+  std::array<double, 4> bbox = {{0., 0., 0., 0.}};
+  // Corner points x1, y1, ..., x4, y4, only used by
+  // EvaluateQuadrilateralImages(), where they are the vertices of a convex
+  // quadrilateral in any order, and EvaluateCornerImages(), where corners of
+  // the same index correspond
+  std::array<double, 8> corners = {{0., 0., 0., 0., 0., 0., 0., 0.}};
+};
+
+// Stores intermediate results for evaluating detection results for every
+// combination of category, area range, and image.  Entry e, which has D
+// detected instances and G ground truth instances, stores matches between
+// detected and ground truth instances.  Rather than allocating vectors per
+// entry, the results of all entries are packed into contiguous columns, with
+// the slice of entry e located by detection_offsets and ground_truth_offsets
+struct ImageEvaluations {
+  // Number of IOU thresholds that results are stored for
+  int num_iou_thresholds = 0;
+
+  // Entry e owns detected instances [detection_offsets[e],
+  // detection_offsets[e + 1]) and ground truth instances
+  // [ground_truth_offsets[e], ground_truth_offsets[e + 1]).  Both have one
+  // element more than the number of entries
+  std::vector<uint64_t> detection_offsets;
+  std::vector<uint64_t> ground_truth_offsets;
+
+  // For each of the D detected instances and each IOU threshold t, the id of
+  // the matched ground truth instance, or 0 if unmatched.  The results of
+  // entry e are a num_iou_thresholds X D matrix starting at
+  // num_iou_thresholds * detection_offsets[e]
+  std::vector<uint64_t> detection_matches;
+
+  // Marks whether or not each of the D detected instances was ignored from
+  // evaluation (e.g., because it's outside aRng), laid out like
+  // detection_matches
+  std::vector<uint8_t> detection_ignores;
+
+  // The detection score of each of the D detected instances
+  std::vector<double> detection_scores;
+
+  // Marks whether or not each of G instances was ignored from evaluation (e.g.,
+  // because it's outside area_range)
+  std::vector<uint8_t> ground_truth_ignores;
+
+  // Number of entries
+  size_t size() const {
+    return detection_offsets.empty() ? 0 : detection_offsets.size() - 1;
+  }
+};
+
+template <class T>
+using ImageCategoryInstances = std::vector<std::vector<std::vector<T>>>;
+
+// Flat columns describing N object instances (e.g., all ground truth or all
+// detected instances of a dataset), such as the data of numpy arrays.  Instance
+// n belongs to image image_indices[n] and category category_indices[n], its
+// bounding box is bboxes[4 * n] to bboxes[4 * n + 3], and its quadrilateral
+// corners are corners[8 * n] to corners[8 * n + 7].  The optional columns
+// scores, areas, is_crowd, ignores, bboxes and corners may be null, in which
+// case all their values are 0/false
+struct InstanceColumns {
+  int64_t size = 0;
+  const int64_t* image_indices = nullptr;
+  const int64_t* category_indices = nullptr;
+  const int64_t* ids = nullptr;
+  const double* scores = nullptr;
+  const double* areas = nullptr;
+  const bool* is_crowd = nullptr;
+  const bool* ignores = nullptr;
+  const double* bboxes = nullptr;
+  const double* corners = nullptr;
+};
+
+// Group the instances described by columns by image and category, such that
+// the result [i][c] holds the instances of image index i and category index c.
+// Instances keep their relative order within each group.  If use_categories is
+// false, the categories of each image are merged into a single group [i][0],
+// concatenated in category index order like the COCO PythonAPI does
+ImageCategoryInstances<InstanceAnnotation> GroupInstances(
+    const InstanceColumns& columns,
+    int num_images,
+    int num_categories,
+    bool use_categories);
+
+// The ground truth side of EvaluateImages(), which only depends on the ground
+// truth instances and area ranges, so that it can be prepared once and reused
+// to evaluate different detections, e.g. after each training epoch
+struct PreparedGroundTruth {
+  std::vector<std::array<double, 2>> area_ranges;
+  int num_images = 0;
+  int num_categories = 0;
+  // If false, all categories of an image form a single group like in
+  // GroupInstances()
+  bool use_categories = true;
+
+  // Number of category groups per image
+  int num_groups() const {
+    return use_categories ? num_categories : 1;
+  }
+
+  // instances[i][c] holds the ground truth instances of image i and category
+  // group c, which are the instances [offsets[k], offsets[k + 1]) of the flat
+  // columns below, where k = i * num_groups() + c.  They are either owned or
+  // borrowed from the caller of PrepareGroundTruth()
+  std::shared_ptr<const ImageCategoryInstances<InstanceAnnotation>> instances;
+  std::vector<uint64_t> offsets;
+
+  // For the G instances of group k and area range a, their ignore flags and
+  // their indices sorted by ignore flag, starting at num_area_ranges *
+  // offsets[k] + a * G
+  std::vector<uint8_t> ignores;
+  std::vector<uint64_t> sorted_indices;
+
+  // The bounding box columns x0, y0, x1, y1, area and crowd flag of group k,
+  // each G long, starting at 6 * offsets[k]
+  std::vector<double> box_columns;
+};
+
+// Prepare the ground truth instances image_category_ground_truth_instances
+// (see EvaluateImages()) for evaluation with area_ranges
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruth(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    ImageCategoryInstances<InstanceAnnotation>&&
+        image_category_ground_truth_instances,
+    int num_threads = 1);
+
+// Same as above without copying image_category_ground_truth_instances, which
+// must outlive the prepared ground truth
+std::shared_ptr<PreparedGroundTruth> PrepareGroundTruth(
+    const std::vector<std::array<double, 2>>& area_ranges,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    int num_threads = 1);
+
+// C++ implementation of COCO API cocoeval.py::COCOeval.evaluateImg().  For each
+// combination of image, category, area range settings, and IOU thresholds to
+// evaluate, it matches detected instances to ground truth instances and stores
+// the results into an ImageEvaluations object, which will be
+// interpreted by the COCOeval::Accumulate() function to produce precion-recall
+// curves.  The parameters of nested vectors have the following semantics:
+//   image_category_ious[i][c][d][g] is the intersection over union of the d'th
+//     detected instance and g'th ground truth instance of
+//     category category_ids[c] in image image_ids[i]
+//   image_category_ground_truth_instances[i][c] is a vector of ground truth
+//     instances in image image_ids[i] of category category_ids[c]
+//   image_category_detection_instances[i][c] is a vector of detected
+//     instances in image image_ids[i] of category category_ids[c]
+// The (image, category) combinations are distributed over num_threads worker
+// threads (num_threads <= 0 uses all hardware threads); the returned results
+// are identical for any number of threads
+ImageEvaluations EvaluateImages(
+    const std::vector<std::array<double, 2>>& area_ranges, // vector of 2-tuples
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<std::vector<double>>& image_category_ious,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads = 1);
+
+// Same as above for bounding box evaluation, except that the intersection over
+// union of detected and ground truth instances is computed from their bbox
+// fields rather than passed in, following the semantics of
+// pycocotools.mask.iou(): the union of a detection with a crowd ground truth
+// instance is the area of the detection
+ImageEvaluations EvaluateImages(
+    const std::vector<std::array<double, 2>>& area_ranges, // vector of 2-tuples
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_ground_truth_instances,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads = 1);
+
+// Same as above with prepared ground truth instances, where image
+// image_category_detection_instances[b] is evaluated against image
+// ground_truth_images[b] of ground_truth.  The results are laid out like
+// those of the images ground_truth_images, in that order
+ImageEvaluations EvaluateImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads = 1);
+
+// Same as above, except that the intersection over union of a detected and a
+// ground truth instance is that of the convex quadrilaterals given by their
+// corners rather than of their bounding boxes, e.g. to evaluate the predicted
+// corner points of this fork's head.  The intersection is computed by clipping
+// one quadrilateral against the edges of the other, and the union of a
+// detection with a crowd ground truth instance is the area of the detection
+// like for boxes.  The area ranges still apply to the area fields
+ImageEvaluations EvaluateQuadrilateralImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    int num_threads = 1);
+
+// Same as above, except that detected and ground truth instances are matched
+// by the object keypoint similarity (OKS) of their corners rather than by an
+// IOU, following COCOeval.computeOks() with all four corners visible:
+//   OKS = sum_v exp(-d_v^2 / (2 * area * (2 * corner_sigmas[v])^2)) / 4
+// where d_v is the distance between the v'th corners and area is the area of
+// the ground truth instance.  iou_thresholds are OKS thresholds
+ImageEvaluations EvaluateCornerImages(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    int max_detections,
+    const std::vector<double>& iou_thresholds,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    const std::array<double, 4>& corner_sigmas,
+    int num_threads = 1);
+
+// Evaluates detected instances incrementally, e.g. batch by batch while a
+// model runs inference, against prepared ground truth instances, which may be
+// shared with other evaluators.  Each call of AddDetections() matches the
+// detections of the images it contains right away with bounding box IOUs, and
+// only keeps their compact ImageEvaluations.  Evaluations() then assembles the
+// results of all images as returned by EvaluateImages(), where images whose
+// detections were never added are evaluated without detections.  All
+// detections of an image must be added in the same call
+class IncrementalEvaluator {
+ public:
+  IncrementalEvaluator(
+      std::shared_ptr<PreparedGroundTruth> ground_truth,
+      int max_detections,
+      const std::vector<double>& iou_thresholds,
+      int num_threads = 1);
+
+  // Evaluate the detected instances described by columns, which hold all
+  // detections of the images they contain
+  void AddDetections(const InstanceColumns& columns);
+
+  // Serialize the results of all images evaluated so far into a compact
+  // binary partial result, e.g. to send the results of one distributed rank
+  // to another.  Detections are not included
+  std::string SerializePartial() const;
+
+  // Add the results of a partial result of SerializePartial() of an evaluator
+  // with the same prepared ground truth and parameters, e.g. the evaluator of
+  // another rank evaluating a different shard of the images.  Images that
+  // were already evaluated keep their results, as a distributed sampler may
+  // pad shards with images of other shards.  Throws std::invalid_argument if
+  // the partial result does not match the ground truth or parameters
+  void MergePartial(const std::string& partial);
+
+  // Number of images whose detections were added so far
+  int num_evaluated_images() const {
+    return num_evaluated_images_;
+  }
+
+  // Number of detected instances that were added so far
+  int64_t num_detections() const {
+    return num_detections_;
+  }
+
+  ImageEvaluations Evaluations() const;
+
+ private:
+  std::shared_ptr<const PreparedGroundTruth> ground_truth_;
+  int max_detections_;
+  std::vector<double> iou_thresholds_;
+  int num_threads_;
+
+  // Results of each AddDetections() call, and for each image the call and its
+  // image position within that call's results, or -1 if not added yet
+  std::vector<ImageEvaluations> batch_evaluations_;
+  std::vector<int> image_batches_;
+  std::vector<int> image_batch_positions_;
+  // Number of detected instances added for each image
+  std::vector<int64_t> image_detections_;
+  int num_evaluated_images_ = 0;
+  int64_t num_detections_ = 0;
+
+  // Gather the results of images, in that order, where images without added
+  // detections are image missing_positions[i] of missing_evaluations
+  ImageEvaluations GatherEvaluations(
+      const std::vector<int>& images,
+      const ImageEvaluations& missing_evaluations,
+      const std::vector<int>& missing_positions) const;
+};
+
+// Parameter settings of COCOeval.accumulate(), copied out of a python
+// COCOeval.Params object so they can be used without holding the GIL
+struct AccumulateParams {
+  std::vector<double> recall_thresholds;
+  std::vector<int> max_detections;
+  int num_iou_thresholds = 0;
+  int num_categories = 0;
+  int num_area_ranges = 0;
+  int num_images = 0;
+};
+
+// C++ implementation of COCOeval.accumulate(), which generates precision
+// recall curves for each set of category, IOU threshold, detection area range,
+// and max number of detections parameters.  It is assumed that the parameter
+// evaluations is the return value of the functon COCOeval::EvaluateImages(),
+// which was called with the same parameter settings params.  The (category,
+// area range) combinations are distributed over num_threads worker threads
+// (num_threads <= 0 uses all hardware threads).  precisions_out and scores_out
+// are flattened num_iou_thresholds X num_recall_thresholds X
+// num_categories X num_area_ranges X num_max_detections matrices, and
+// recalls_out is a flattened num_iou_thresholds X num_categories X
+// num_area_ranges X num_max_detections matrix
+void Accumulate(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    int num_threads,
+    std::vector<double>* precisions_out,
+    std::vector<double>* recalls_out,
+    std::vector<double>* scores_out);
+
+// One number of COCOeval.summarize(), which is the mean of the precisions (if
+// average_precision) or the recalls of Accumulate() at IOU threshold index
+// iou_threshold_index (all thresholds if negative), area range index
+// area_range_index and max detections index max_detections_index, over all
+// other dimensions, ignoring entries without ground truth
+struct SummaryStat {
+  bool average_precision = true;
+  int iou_threshold_index = -1;
+  int area_range_index = 0;
+  int max_detections_index = 0;
+};
+
+// Bootstrap the summary statistics stats of Accumulate() over the images of
+// evaluations, e.g. for confidence intervals of AP.  Each of num_samples
+// samples draws params.num_images images with replacement, and all instances
+// of an image drawn k times count k times.  Rather than accumulating every
+// sample from scratch, the detections of each (category, area range)
+// combination are sorted once and only reweighted per sample, and the
+// combinations are distributed over num_threads worker threads (num_threads
+// <= 0 uses all hardware threads).  Sample n draws its images with its own
+// random generator seeded from seed and n, so the results do not depend on
+// the number of threads.  samples_out is a flattened num_samples X
+// stats.size() matrix, where statistics without ground truth are -1
+void Bootstrap(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    const std::vector<SummaryStat>& stats,
+    int num_samples,
+    uint64_t seed,
+    int num_threads,
+    std::vector<double>* samples_out);
+
+// Operating points of the detections of one category, i.e., the precision,
+// recall and F1 score of the detections kept by every confidence threshold.
+// Point j keeps the detections with scores >= scores[j], in decreasing order
+// of scores.  best_score is the threshold of the highest F1 score (the
+// highest such threshold on ties), and -1 like the other best_* values if the
+// category has no ground truth or no detections
+struct OperatingCurve {
+  std::vector<double> scores;
+  std::vector<double> precisions;
+  std::vector<double> recalls;
+  std::vector<double> f1_scores;
+  int64_t num_ground_truth = 0;
+  double best_score = -1;
+  double best_precision = -1;
+  double best_recall = -1;
+  double best_f1 = -1;
+};
+
+// Compute the operating curve of every category for IOU threshold index
+// iou_threshold_index, area range index area_range_index and max detections
+// index max_detections_index, from the same sorted detection lists as
+// Accumulate(), e.g., to choose per category confidence thresholds for
+// deployment without evaluating every candidate threshold.  Categories are
+// distributed over num_threads worker threads (num_threads <= 0 uses all
+// hardware threads)
+std::vector<OperatingCurve> ComputeOperatingCurves(
+    const AccumulateParams& params,
+    const ImageEvaluations& evaluations,
+    int iou_threshold_index,
+    int area_range_index,
+    int max_detections_index,
+    int num_threads = 1);
+
+// Error types of a TIDE style analysis (Bolya et al., "TIDE: A General Toolbox
+// for Identifying Object Detection Errors").  Every false positive detection
+// has exactly one of the first five types, and missed errors are the ground
+// truth instances that no detection matched or was close to
+enum ErrorType {
+  kClassificationError = 0, // overlaps another category's instance >= fg
+  kLocalizationError, // overlaps its category's instance in [bg, fg)
+  kBothError, // overlaps another category's instance in [bg, fg)
+  kDuplicateError, // overlaps an instance already matched by a higher score
+  kBackgroundError, // overlaps no instance by more than bg
+  kMissedError, // unmatched ground truth instance
+  kNumErrorTypes
+};
+
+// Results of AnalyzeErrors(), where error_counts and fixed_average_precisions
+// are flattened num_categories X kNumErrorTypes matrices.  The average
+// precisions are the means over the recall thresholds like in summarize(),
+// and -1 for categories without ground truth
+struct ErrorBreakdown {
+  std::vector<int64_t> error_counts;
+  std::vector<double> average_precisions;
+  std::vector<double> fixed_average_precisions;
+};
+
+// Classify the errors of bounding box detections at IOU threshold index
+// iou_threshold_index, whose value is foreground_iou, and area range index
+// area_range_index, and measure how much fixing each type of error would
+// improve the AP of every category.  evaluations must be the results of
+// EvaluateImages() of image_category_detection_instances against images
+// ground_truth_images of ground_truth, whose matches are reused as is: only
+// the false positives are compared with the ground truth instances of all
+// categories of their image.  Errors are fixed as in TIDE, except that
+// classification errors are only removed from their detected category
+// rather than moved to the correct one: localization errors become true
+// positives if their instance is unmatched (each instance once, by the
+// highest score), missed instances are removed from the ground truth, and
+// all other errors are removed.  Images and then categories are distributed
+// over num_threads worker threads (num_threads <= 0 uses all hardware
+// threads), and the results do not depend on the number of threads.  Throws
+// std::invalid_argument unless 0 < background_iou < foreground_iou
+ErrorBreakdown AnalyzeErrors(
+    const PreparedGroundTruth& ground_truth,
+    const std::vector<int>& ground_truth_images,
+    const ImageCategoryInstances<InstanceAnnotation>&
+        image_category_detection_instances,
+    const ImageEvaluations& evaluations,
+    const AccumulateParams& params,
+    int iou_threshold_index,
+    double foreground_iou,
+    double background_iou = 0.1,
+    int area_range_index = 0,
+    int num_threads = 1);
+
+} // namespace COCOeval
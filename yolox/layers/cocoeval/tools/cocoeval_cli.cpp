@@ -0,0 +1,489 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+// Standalone COCO bounding box evaluation, which reads a COCO annotation file
+// and any number of result files and prints the 12 summary numbers of
+// pycocotools COCOeval.summarize() for each of them, without python.  The
+// ground truth is prepared once and shared by all result files
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cocoeval_core.h"
+#include "json_reader.h"
+
+namespace {
+
+using namespace COCOeval;
+
+// Instances read from a json file, laid out as the columns of InstanceColumns.
+// Ids of images and categories are translated to indices by Columns()
+struct Instances {
+  std::vector<int64_t> image_ids;
+  std::vector<int64_t> category_ids;
+  std::vector<int64_t> ids;
+  std::vector<double> scores;
+  std::vector<double> areas;
+  std::vector<double> bboxes;
+  std::vector<uint8_t> is_crowd;
+
+  std::vector<int64_t> image_indices;
+  std::vector<int64_t> category_indices;
+  std::unique_ptr<bool[]> crowd_flags;
+
+  // Map the image and category ids to indices into the sorted ids
+  // dataset_image_ids and dataset_category_ids and return the columns of the
+  // instances.  Instances of unknown categories are left out like the COCO
+  // PythonAPI does; instances of unknown images are an error if
+  // require_known_images, e.g. for results like COCO.loadRes()
+  InstanceColumns Columns(
+      const std::vector<int64_t>& dataset_image_ids,
+      const std::vector<int64_t>& dataset_category_ids,
+      bool require_known_images);
+};
+
+// Position of id in the sorted ids, or -1
+int64_t IndexOf(const std::vector<int64_t>& ids, int64_t id) {
+  const auto it = std::lower_bound(ids.begin(), ids.end(), id);
+  return (it != ids.end() && *it == id) ? it - ids.begin() : -1;
+}
+
+InstanceColumns Instances::Columns(
+    const std::vector<int64_t>& dataset_image_ids,
+    const std::vector<int64_t>& dataset_category_ids,
+    bool require_known_images) {
+  // Drop the instances that are not evaluated, keeping the others in order
+  size_t num_kept = 0;
+  for (size_t n = 0; n < ids.size(); ++n) {
+    const int64_t i = IndexOf(dataset_image_ids, image_ids[n]);
+    const int64_t c = IndexOf(dataset_category_ids, category_ids[n]);
+    if (i < 0 && require_known_images) {
+      throw std::runtime_error(
+          "result of image id " + std::to_string(image_ids[n]) +
+          " does not correspond to the annotations");
+    }
+    if (i < 0 || c < 0) {
+      continue;
+    }
+    image_indices.push_back(i);
+    category_indices.push_back(c);
+    ids[num_kept] = ids[n];
+    scores[num_kept] = scores[n];
+    areas[num_kept] = areas[n];
+    is_crowd[num_kept] = is_crowd[n];
+    std::copy(
+        bboxes.begin() + 4 * n,
+        bboxes.begin() + 4 * n + 4,
+        bboxes.begin() + 4 * num_kept);
+    ++num_kept;
+  }
+  crowd_flags.reset(new bool[num_kept]);
+  std::copy(is_crowd.begin(), is_crowd.begin() + num_kept, crowd_flags.get());
+
+  InstanceColumns columns;
+  columns.size = num_kept;
+  columns.image_indices = image_indices.data();
+  columns.category_indices = category_indices.data();
+  columns.ids = ids.data();
+  columns.scores = scores.data();
+  columns.areas = areas.data();
+  columns.is_crowd = crowd_flags.get();
+  // crowd instances are ignored like in COCOeval._prepare()
+  columns.ignores = crowd_flags.get();
+  columns.bboxes = bboxes.data();
+  return columns;
+}
+
+void ReadBox(JsonReader* reader, std::vector<double>* bboxes) {
+  reader->BeginArray();
+  int num_values = 0;
+  while (reader->NextElement()) {
+    if (num_values++ >= 4) {
+      throw std::runtime_error("bbox has more than 4 values");
+    }
+    bboxes->push_back(reader->ReadDouble());
+  }
+  if (num_values != 4) {
+    throw std::runtime_error("bbox has less than 4 values");
+  }
+}
+
+// Read the ids of the objects of an array, e.g. "images" or "categories"
+std::vector<int64_t> ReadIds(JsonReader* reader) {
+  std::vector<int64_t> ids;
+  std::string key;
+  reader->BeginArray();
+  while (reader->NextElement()) {
+    reader->BeginObject();
+    while (reader->NextKey(&key)) {
+      if (key == "id") {
+        ids.push_back(reader->ReadInt());
+      } else {
+        reader->SkipValue();
+      }
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+// Read one annotation or result object into instances, where the number of
+// instances read so far gives results the ids of COCO.loadRes()
+void ReadInstance(JsonReader* reader, bool is_result, Instances* instances) {
+  bool has_id = false, has_image = false, has_category = false;
+  bool has_bbox = false, has_area = false;
+  double area = 0.;
+  instances->scores.push_back(0.);
+  instances->is_crowd.push_back(0);
+  std::string key;
+  reader->BeginObject();
+  while (reader->NextKey(&key)) {
+    if (key == "id" && !is_result) {
+      instances->ids.push_back(reader->ReadInt());
+      has_id = true;
+    } else if (key == "image_id") {
+      instances->image_ids.push_back(reader->ReadInt());
+      has_image = true;
+    } else if (key == "category_id") {
+      instances->category_ids.push_back(reader->ReadInt());
+      has_category = true;
+    } else if (key == "bbox") {
+      ReadBox(reader, &instances->bboxes);
+      has_bbox = true;
+    } else if (key == "score" && is_result) {
+      instances->scores.back() = reader->ReadDouble();
+    } else if (key == "area" && !is_result) {
+      area = reader->ReadDouble();
+      has_area = true;
+    } else if (key == "iscrowd" && !is_result) {
+      instances->is_crowd.back() = reader->ReadBool();
+    } else {
+      reader->SkipValue();
+    }
+  }
+  if (!has_image || !has_category || !has_bbox || (!is_result && !has_id)) {
+    throw std::runtime_error(
+        std::string(is_result ? "result" : "annotation") + " " +
+        std::to_string(instances->areas.size()) +
+        " misses id, image_id, category_id or bbox");
+  }
+  if (is_result) {
+    instances->ids.push_back(instances->areas.size() + 1);
+    const double* bbox = &instances->bboxes[instances->bboxes.size() - 4];
+    area = bbox[2] * bbox[3];
+  } else if (!has_area) {
+    throw std::runtime_error(
+        "annotation " + std::to_string(instances->ids.back()) +
+        " misses area");
+  }
+  instances->areas.push_back(area);
+}
+
+// Read a COCO annotation file
+void ReadAnnotations(
+    const std::string& path,
+    std::vector<int64_t>* image_ids,
+    std::vector<int64_t>* category_ids,
+    Instances* instances) {
+  JsonReader reader = JsonReader::FromFile(path);
+  std::string key;
+  reader.BeginObject();
+  while (reader.NextKey(&key)) {
+    if (key == "images") {
+      *image_ids = ReadIds(&reader);
+    } else if (key == "categories") {
+      *category_ids = ReadIds(&reader);
+    } else if (key == "annotations") {
+      reader.BeginArray();
+      while (reader.NextElement()) {
+        ReadInstance(&reader, false, instances);
+      }
+    } else {
+      reader.SkipValue();
+    }
+  }
+  reader.End();
+}
+
+// Read a COCO result file, i.e. an array of detections
+void ReadResults(const std::string& path, Instances* instances) {
+  JsonReader reader = JsonReader::FromFile(path);
+  reader.BeginArray();
+  while (reader.NextElement()) {
+    ReadInstance(&reader, true, instances);
+  }
+  reader.End();
+}
+
+// Same as numpy.linspace(start, stop, num)
+std::vector<double> Linspace(double start, double stop, int num) {
+  std::vector<double> values(num);
+  const double step = (stop - start) / (num - 1);
+  for (auto k = 0; k < num; ++k) {
+    values[k] = k * step + start;
+  }
+  values.back() = stop;
+  return values;
+}
+
+// The default bounding box parameters of pycocotools COCOeval.Params
+struct Params {
+  std::vector<double> iou_thresholds = Linspace(0.5, 0.95, 10);
+  std::vector<double> recall_thresholds = Linspace(0., 1., 101);
+  std::vector<int> max_detections = {1, 10, 100};
+  std::vector<std::array<double, 2>> area_ranges = {
+      {{0., 1e5 * 1e5}},
+      {{0., 32. * 32.}},
+      {{32. * 32., 96. * 96.}},
+      {{96. * 96., 1e5 * 1e5}}};
+  std::vector<const char*> area_labels = {"all", "small", "medium", "large"};
+};
+
+// One number of COCOeval.summarize(), which is the mean of the precisions
+// (average_precision) or recalls at IOU threshold iou_threshold (all if
+// negative), area range area_index, and max_detections, over all other
+// dimensions, ignoring -1 entries
+double Summarize(
+    const Params& params,
+    const AccumulateParams& accumulate_params,
+    const std::vector<double>& precisions,
+    const std::vector<double>& recalls,
+    bool average_precision,
+    double iou_threshold,
+    int area_index,
+    int max_detections) {
+  const int num_iou_thresholds = params.iou_thresholds.size();
+  const int num_recall_thresholds = params.recall_thresholds.size();
+  const int num_categories = accumulate_params.num_categories;
+  const int num_area_ranges = params.area_ranges.size();
+  const int num_max_detections = params.max_detections.size();
+  const int m = std::find(
+                    params.max_detections.begin(),
+                    params.max_detections.end(),
+                    max_detections) -
+      params.max_detections.begin();
+
+  double sum = 0.;
+  int64_t count = 0;
+  for (auto t = 0; t < num_iou_thresholds; ++t) {
+    if (iou_threshold >= 0. && params.iou_thresholds[t] != iou_threshold) {
+      continue;
+    }
+    const int num_recalls = average_precision ? num_recall_thresholds : 1;
+    for (auto r = 0; r < num_recalls; ++r) {
+      for (auto k = 0; k < num_categories; ++k) {
+        const int64_t index = average_precision
+            ? (((static_cast<int64_t>(t) * num_recall_thresholds + r) *
+                    num_categories +
+                k) *
+                   num_area_ranges +
+               area_index) *
+                    num_max_detections +
+                m
+            : ((static_cast<int64_t>(t) * num_categories + k) *
+                   num_area_ranges +
+               area_index) *
+                    num_max_detections +
+                m;
+        const double value =
+            average_precision ? precisions[index] : recalls[index];
+        if (value > -1) {
+          sum += value;
+          ++count;
+        }
+      }
+    }
+  }
+  return count > 0 ? sum / count : -1.;
+}
+
+// Print the 12 numbers of COCOeval.summarize() like pycocotools, or on a single
+// line after the result path if brief
+void PrintSummary(
+    const std::string& path,
+    const Params& params,
+    const AccumulateParams& accumulate_params,
+    const std::vector<double>& precisions,
+    const std::vector<double>& recalls,
+    bool brief) {
+  struct Stat {
+    bool average_precision;
+    double iou_threshold;
+    int area_index;
+    int max_detections;
+  };
+  const int largest_max_detections = params.max_detections.back();
+  const Stat stats[12] = {
+      {true, -1., 0, largest_max_detections},
+      {true, .5, 0, largest_max_detections},
+      {true, .75, 0, largest_max_detections},
+      {true, -1., 1, largest_max_detections},
+      {true, -1., 2, largest_max_detections},
+      {true, -1., 3, largest_max_detections},
+      {false, -1., 0, params.max_detections[0]},
+      {false, -1., 0, params.max_detections[1]},
+      {false, -1., 0, largest_max_detections},
+      {false, -1., 1, largest_max_detections},
+      {false, -1., 2, largest_max_detections},
+      {false, -1., 3, largest_max_detections}};
+
+  if (brief) {
+    std::printf("%s", path.c_str());
+  }
+  for (const Stat& stat : stats) {
+    const double value = Summarize(
+        params,
+        accumulate_params,
+        precisions,
+        recalls,
+        stat.average_precision,
+        stat.iou_threshold,
+        stat.area_index,
+        stat.max_detections);
+    if (brief) {
+      std::printf(" %.6f", value);
+      continue;
+    }
+    char iou[32];
+    if (stat.iou_threshold < 0.) {
+      std::snprintf(
+          iou,
+          sizeof(iou),
+          "%0.2f:%0.2f",
+          params.iou_thresholds.front(),
+          params.iou_thresholds.back());
+    } else {
+      std::snprintf(iou, sizeof(iou), "%0.2f", stat.iou_threshold);
+    }
+    std::printf(
+        " %-18s %s @[ IoU=%-9s | area=%6s | maxDets=%3d ] = %0.3f\n",
+        stat.average_precision ? "Average Precision" : "Average Recall",
+        stat.average_precision ? "(AP)" : "(AR)",
+        iou,
+        params.area_labels[stat.area_index],
+        stat.max_detections,
+        value);
+  }
+  if (brief) {
+    std::printf("\n");
+  }
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void PrintUsage(const char* program) {
+  std::fprintf(
+      stderr,
+      "usage: %s [--num-threads N] [--brief] annotations.json "
+      "results.json...\n"
+      "  --num-threads N  worker threads, 0 (default) uses all hardware "
+      "threads\n"
+      "  --brief          print one line of the 12 numbers per result file\n",
+      program);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int num_threads = 0;
+  bool brief = false;
+  std::vector<std::string> paths;
+  for (auto a = 1; a < argc; ++a) {
+    if (std::strcmp(argv[a], "--num-threads") == 0 && a + 1 < argc) {
+      num_threads = std::atoi(argv[++a]);
+    } else if (std::strcmp(argv[a], "--brief") == 0) {
+      brief = true;
+    } else if (argv[a][0] == '-') {
+      PrintUsage(argv[0]);
+      return 2;
+    } else {
+      paths.push_back(argv[a]);
+    }
+  }
+  if (paths.size() < 2) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+
+  try {
+    const Params params;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int64_t> image_ids, category_ids;
+    Instances annotations;
+    ReadAnnotations(paths[0], &image_ids, &category_ids, &annotations);
+    const std::shared_ptr<PreparedGroundTruth> ground_truth =
+        PrepareGroundTruth(
+            params.area_ranges,
+            GroupInstances(
+                annotations.Columns(image_ids, category_ids, false),
+                image_ids.size(),
+                category_ids.size(),
+                true),
+            num_threads);
+    std::vector<int> images(image_ids.size());
+    std::iota(images.begin(), images.end(), 0);
+    if (!brief) {
+      std::printf(
+          "Loaded %zu images, %zu categories in %.2f seconds\n",
+          image_ids.size(),
+          category_ids.size(),
+          SecondsSince(start));
+    }
+
+    AccumulateParams accumulate_params;
+    accumulate_params.recall_thresholds = params.recall_thresholds;
+    accumulate_params.max_detections = params.max_detections;
+    accumulate_params.num_iou_thresholds = params.iou_thresholds.size();
+    accumulate_params.num_categories = category_ids.size();
+    accumulate_params.num_area_ranges = params.area_ranges.size();
+    accumulate_params.num_images = image_ids.size();
+
+    for (size_t p = 1; p < paths.size(); ++p) {
+      start = std::chrono::steady_clock::now();
+      Instances results;
+      ReadResults(paths[p], &results);
+      const ImageEvaluations evaluations = EvaluateImages(
+          *ground_truth,
+          images,
+          params.max_detections.back(),
+          params.iou_thresholds,
+          GroupInstances(
+              results.Columns(image_ids, category_ids, true),
+              image_ids.size(),
+              category_ids.size(),
+              true),
+          num_threads);
+      std::vector<double> precisions, recalls, scores;
+      Accumulate(
+          accumulate_params,
+          evaluations,
+          num_threads,
+          &precisions,
+          &recalls,
+          &scores);
+      if (!brief) {
+        std::printf(
+            "Evaluated %s in %.2f seconds\n",
+            paths[p].c_str(),
+            SecondsSince(start));
+      }
+      PrintSummary(
+          paths[p], params, accumulate_params, precisions, recalls, brief);
+    }
+  } catch (const std::exception& e) {
+    std::fprintf(stderr, "error: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
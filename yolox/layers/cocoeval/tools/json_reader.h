@@ -0,0 +1,284 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#pragma once
+
+#include "../../common/eval_utils.h"
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace COCOeval {
+
+// Minimal pull parser for the COCO annotation and result files.  Rather than
+// building a document tree, the caller walks the values it needs and skips
+// the rest (e.g., segmentation polygons) without allocating, which keeps
+// reading large annotation files fast:
+//   reader.BeginObject();
+//   std::string key;
+//   while (reader.NextKey(&key)) {
+//     if (key == "id") id = reader.ReadInt(); else reader.SkipValue();
+//   }
+// Errors throw std::runtime_error with the byte offset of the problem
+class JsonReader {
+ public:
+  explicit JsonReader(std::string text) : text_(std::move(text)) {}
+
+  // Read the whole file path
+  static JsonReader FromFile(const std::string& path) {
+    return JsonReader(EvalCommon::ReadFile(path));
+  }
+
+  // Type of the next value: one of '{', '[', '"', 'n' (null), 't'/'f'
+  // (boolean), or '0' (number)
+  char Peek() {
+    SkipWhitespace();
+    if (position_ >= text_.size()) {
+      Fail("unexpected end of input");
+    }
+    const char c = text_[position_];
+    return (c == '-' || (c >= '0' && c <= '9')) ? '0' : c;
+  }
+
+  void BeginObject() {
+    Expect('{');
+    first_ = true;
+  }
+
+  // Read the key of the next member of the current object into key, or
+  // return false at the end of the object
+  bool NextKey(std::string* key) {
+    if (!NextItem('}')) {
+      return false;
+    }
+    *key = ReadString();
+    Expect(':');
+    return true;
+  }
+
+  void BeginArray() {
+    Expect('[');
+    first_ = true;
+  }
+
+  // Return whether the current array has another element
+  bool NextElement() {
+    return NextItem(']');
+  }
+
+  std::string ReadString() {
+    Expect('"');
+    std::string value;
+    while (true) {
+      if (position_ >= text_.size()) {
+        Fail("unterminated string");
+      }
+      const char c = text_[position_++];
+      if (c == '"') {
+        return value;
+      }
+      if (c != '\\') {
+        value.push_back(c);
+        continue;
+      }
+      if (position_ >= text_.size()) {
+        Fail("unterminated string");
+      }
+      const char escaped = text_[position_++];
+      switch (escaped) {
+        case 'b':
+          value.push_back('\b');
+          break;
+        case 'f':
+          value.push_back('\f');
+          break;
+        case 'n':
+          value.push_back('\n');
+          break;
+        case 'r':
+          value.push_back('\r');
+          break;
+        case 't':
+          value.push_back('\t');
+          break;
+        case 'u':
+          AppendCodePoint(&value);
+          break;
+        default:
+          value.push_back(escaped);
+      }
+    }
+  }
+
+  double ReadDouble() {
+    if (Peek() != '0') {
+      Fail("expected a number");
+    }
+    const char* begin = text_.c_str() + position_;
+    char* end = nullptr;
+    const double value = std::strtod(begin, &end);
+    if (end == begin) {
+      Fail("invalid number");
+    }
+    position_ += end - begin;
+    return value;
+  }
+
+  int64_t ReadInt() {
+    const double value = ReadDouble();
+    if (value != static_cast<double>(static_cast<int64_t>(value))) {
+      Fail("expected an integer");
+    }
+    return static_cast<int64_t>(value);
+  }
+
+  // Read a boolean, also accepting numbers like the COCO iscrowd flags
+  bool ReadBool() {
+    switch (Peek()) {
+      case 't':
+        ExpectWord("true");
+        return true;
+      case 'f':
+        ExpectWord("false");
+        return false;
+      default:
+        return ReadDouble() != 0.;
+    }
+  }
+
+  void SkipValue() {
+    switch (Peek()) {
+      case '{': {
+        BeginObject();
+        std::string key;
+        while (NextKey(&key)) {
+          SkipValue();
+        }
+        break;
+      }
+      case '[':
+        BeginArray();
+        while (NextElement()) {
+          SkipValue();
+        }
+        break;
+      case '"':
+        SkipString();
+        break;
+      case 't':
+        ExpectWord("true");
+        break;
+      case 'f':
+        ExpectWord("false");
+        break;
+      case 'n':
+        ExpectWord("null");
+        break;
+      default:
+        ReadDouble();
+    }
+  }
+
+  // Check that nothing but whitespace follows the top level value
+  void End() {
+    SkipWhitespace();
+    if (position_ != text_.size()) {
+      Fail("unexpected trailing characters");
+    }
+  }
+
+ private:
+  [[noreturn]] void Fail(const std::string& message) const {
+    throw std::runtime_error(
+        "json: " + message + " at offset " + std::to_string(position_));
+  }
+
+  void SkipWhitespace() {
+    while (position_ < text_.size() &&
+           (text_[position_] == ' ' || text_[position_] == '\n' ||
+            text_[position_] == '\r' || text_[position_] == '\t')) {
+      ++position_;
+    }
+  }
+
+  void Expect(char c) {
+    SkipWhitespace();
+    if (position_ >= text_.size() || text_[position_] != c) {
+      Fail(std::string("expected '") + c + "'");
+    }
+    ++position_;
+  }
+
+  void ExpectWord(const char* word) {
+    SkipWhitespace();
+    for (const char* c = word; *c != '\0'; ++c, ++position_) {
+      if (position_ >= text_.size() || text_[position_] != *c) {
+        Fail(std::string("expected ") + word);
+      }
+    }
+  }
+
+  // Consume the separator before the next item of an object or array closed
+  // by close, or the closing character itself.  Nested containers are always
+  // fully consumed before their parent continues, so a single flag tracks
+  // whether the current container is at its first item
+  bool NextItem(char close) {
+    SkipWhitespace();
+    if (position_ >= text_.size()) {
+      Fail("unexpected end of input");
+    }
+    if (text_[position_] == close) {
+      ++position_;
+      first_ = false;
+      return false;
+    }
+    if (!first_) {
+      Expect(',');
+    }
+    first_ = false;
+    return true;
+  }
+
+  void SkipString() {
+    Expect('"');
+    while (position_ < text_.size() && text_[position_] != '"') {
+      position_ += text_[position_] == '\\' ? 2 : 1;
+    }
+    if (position_ >= text_.size()) {
+      Fail("unterminated string");
+    }
+    ++position_;
+  }
+
+  // Append the UTF-8 encoding of the \uXXXX escape at the read position
+  void AppendCodePoint(std::string* value) {
+    if (position_ + 4 > text_.size()) {
+      Fail("invalid unicode escape");
+    }
+    for (size_t k = position_; k < position_ + 4; ++k) {
+      if (!std::isxdigit(static_cast<unsigned char>(text_[k]))) {
+        Fail("invalid unicode escape");
+      }
+    }
+    const uint32_t code =
+        std::strtoul(text_.substr(position_, 4).c_str(), nullptr, 16);
+    position_ += 4;
+    if (code < 0x80) {
+      value->push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+      value->push_back(static_cast<char>(0xc0 | (code >> 6)));
+      value->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    } else {
+      value->push_back(static_cast<char>(0xe0 | (code >> 12)));
+      value->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+      value->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+    }
+  }
+
+  std::string text_;
+  size_t position_ = 0;
+  bool first_ = false;
+};
+
+} // namespace COCOeval
@@ -0,0 +1,27 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+// Numpy helpers shared by the python bindings of the cocoeval and voceval
+// extensions
+#pragma once
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <utility>
+#include <vector>
+
+namespace EvalCommon {
+
+// Move the contents of a vector into a numpy array of the given shape.  The
+// array takes ownership of the vector's buffer, so no element is copied or
+// converted to a python object
+template <typename T>
+pybind11::array_t<T> MoveToArray(
+    std::vector<T>&& values,
+    const std::vector<pybind11::ssize_t>& shape) {
+  auto* owner = new std::vector<T>(std::move(values));
+  pybind11::capsule free_when_done(owner, [](void* p) {
+    delete reinterpret_cast<std::vector<T>*>(p);
+  });
+  return pybind11::array_t<T>(shape, owner->data(), free_when_done);
+}
+
+} // namespace EvalCommon
@@ -0,0 +1,122 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+// Helpers shared by the cocoeval and voceval extensions, which only depend on
+// the standard library so that they can be used without python
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace EvalCommon {
+
+// Resolve the number of worker threads to use for num_work_items independent
+// work items.  A non-positive num_threads selects one thread per hardware
+// thread, and there is never more than one thread per work item
+inline int ResolveNumThreads(int num_threads, int64_t num_work_items) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  }
+  return (int)std::max<int64_t>(
+      1, std::min<int64_t>(num_threads, num_work_items));
+}
+
+// Call function(worker_index, item) for every item in [0, num_items), spread
+// over num_threads threads.  Items are handed out dynamically in small chunks,
+// so uneven per-item cost is balanced across threads.  worker_index is in
+// [0, num_threads) and can be used to index per-thread scratch storage.  With a
+// single thread, items are processed in order on the calling thread
+template <typename Function>
+void ParallelFor(int64_t num_items, int num_threads, const Function& function) {
+  if (num_threads <= 1 || num_items <= 1) {
+    for (int64_t item = 0; item < num_items; ++item) {
+      function(0, item);
+    }
+    return;
+  }
+
+  const int64_t chunk_size =
+      std::max<int64_t>(1, num_items / (static_cast<int64_t>(num_threads) * 8));
+  std::atomic<int64_t> next_item(0);
+  auto worker = [&](int worker_index) {
+    for (;;) {
+      const int64_t begin = next_item.fetch_add(chunk_size);
+      if (begin >= num_items) {
+        break;
+      }
+      const int64_t end = std::min(begin + chunk_size, num_items);
+      for (int64_t item = begin; item < end; ++item) {
+        function(worker_index, item);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back(worker, t);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Read the whole file at path, or throw std::runtime_error if it cannot be
+// opened
+inline std::string ReadFile(const std::string& path) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    throw std::runtime_error("cannot open " + path);
+  }
+  std::string text;
+  char buffer[1 << 16];
+  size_t size;
+  while ((size = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, size);
+  }
+  std::fclose(file);
+  return text;
+}
+
+// Append count values to the binary buffer
+template <typename T>
+void WriteValues(const T* values, size_t count, std::string* buffer) {
+  buffer->append(reinterpret_cast<const char*>(values), count * sizeof(T));
+}
+
+// Read count values at *position of the binary buffer and advance *position,
+// or return false if the buffer is too short
+template <typename T>
+bool ReadValues(
+    const std::string& buffer,
+    size_t count,
+    size_t* position,
+    T* values) {
+  if (count > (buffer.size() - *position) / sizeof(T)) {
+    return false;
+  }
+  std::memcpy(values, buffer.data() + *position, count * sizeof(T));
+  *position += count * sizeof(T);
+  return true;
+}
+
+template <typename T>
+bool ReadValues(
+    const std::string& buffer,
+    size_t count,
+    size_t* position,
+    std::vector<T>* values) {
+  if (count > (buffer.size() - *position) / sizeof(T)) {
+    return false;
+  }
+  values->resize(count);
+  return ReadValues(buffer, count, position, values->data());
+}
+
+} // namespace EvalCommon
@@ -14,14 +14,48 @@ from pycocotools.cocoeval import COCOeval
 from .jit_ops import FastCOCOEvalOp
 
 
+def iou_threshold_index(iouThrs, iouThr):
+    """
+    Index of the IoU threshold iouThr in params.iouThrs.  Raises ValueError if iouThr is not one
+    of them, rather than silently picking another threshold.
+    """
+    indices = np.flatnonzero(np.isclose(iouThrs, iouThr))
+    if len(indices) == 0:
+        raise ValueError(
+            "iouThr {} is not one of params.iouThrs {}".format(iouThr, list(iouThrs))
+        )
+    return int(indices[0])
+
+
 class COCOeval_opt(COCOeval):
     """
     This is a slightly modified version of the original COCO API, where the functions evaluateImg()
     and accumulate() are implemented in C++ to speedup evaluation
+
+    Besides the iouTypes of the COCO API, two iouTypes evaluate the four corner points predicted
+    by this fork's head, given by the "points" field [x1, y1, ..., x4, y4] of the ground truth and
+    result annotations. With "quad", the IoU of two instances is that of the convex quadrilaterals
+    of their corners. With "corners", instances are matched by the object keypoint similarity of
+    their corners like the "keypoints" OKS, with the per corner sigmas params.kpt_oks_sigmas.
+    Both are computed in C++ and use the same params and summary as "bbox".
+
+    Args:
+        num_threads (int): number of threads used by the C++ implementation.
+            Non-positive values use all available hardware threads. Default to 1, which
+            leaves the CPU to the dataloader workers and torch.
+        kwargs: passed to COCOeval.
     """
-    def __init__(self, *args, **kwargs):
-        super().__init__(*args, **kwargs)
+    corner_iou_types = ("quad", "corners")
+
+    def __init__(self, cocoGt=None, cocoDt=None, iouType="segm", num_threads=1, **kwargs):
+        is_corner_type = iouType in self.corner_iou_types
+        super().__init__(cocoGt, cocoDt, "bbox" if is_corner_type else iouType, **kwargs)
+        self.params.iouType = iouType
+        if iouType == "corners":
+            # the tightest sigma of the COCO person keypoints, for every corner
+            self.params.kpt_oks_sigmas = np.full(4, 0.025)
         self.module = FastCOCOEvalOp().load()
+        self.num_threads = num_threads
 
     def evaluate(self):
         """
@@ -55,65 +89,88 @@ class COCOeval_opt(COCOeval):
         # loop through images, area range, max detection number
         catIds = p.catIds if p.useCats else [-1]
 
+        # bounding box and corner IOUs are computed by the C++ implementation itself
+        native_iou = p.iouType == "bbox" or p.iouType in self.corner_iou_types
         if p.iouType == "segm" or p.iouType == "bbox":
             computeIoU = self.computeIoU
         elif p.iouType == "keypoints":
             computeIoU = self.computeOks
-        self.ious = {
-            (imgId, catId): computeIoU(imgId, catId)
-            for imgId in p.imgIds
-            for catId in catIds
-        }
+        if not native_iou:
+            self.ious = {
+                (imgId, catId): computeIoU(imgId, catId)
+                for imgId in p.imgIds
+                for catId in catIds
+            }
 
         maxDet = p.maxDets[-1]
 
         # <<<< Beginning of code differences with original COCO API
-        def convert_instances_to_cpp(instances, is_det=False):
-            # Convert annotations for a list of instances in an image to a format that's fast
-            # to access in C++
-            instances_cpp = []
-            for instance in instances:
-                instance_cpp = self.module.InstanceAnnotation(
-                    int(instance["id"]),
-                    instance["score"] if is_det else instance.get("score", 0.0),
-                    instance["area"],
-                    bool(instance.get("iscrowd", 0)),
-                    bool(instance.get("ignore", 0)),
-                )
-                instances_cpp.append(instance_cpp)
-            return instances_cpp
-
-        # Convert GT annotations, detections, and IOUs to a format that's fast to access in C++
-        ground_truth_instances = [
-            [convert_instances_to_cpp(self._gts[imgId, catId]) for catId in p.catIds]
-            for imgId in p.imgIds
-        ]
-        detected_instances = [
-            [
-                convert_instances_to_cpp(self._dts[imgId, catId], is_det=True)
-                for catId in p.catIds
-            ]
-            for imgId in p.imgIds
-        ]
-        ious = [[self.ious[imgId, catId] for catId in catIds] for imgId in p.imgIds]
-
-        if not p.useCats:
-            # For each image, flatten per-category lists into a single list
-            ground_truth_instances = [
-                [[o for c in i for o in c]] for i in ground_truth_instances
-            ]
-            detected_instances = [
-                [[o for c in i for o in c]] for i in detected_instances
-            ]
+        image_indices = {imgId: i for i, imgId in enumerate(p.imgIds)}
+        category_indices = {catId: c for c, catId in enumerate(p.catIds)}
+
+        def convert_instances_to_arrays(instances_per_image_category, is_det=False):
+            # Convert annotations of all images and categories to flat numpy arrays, which
+            # are grouped by image and category in C++ without a python object per instance
+            groups, instances = [], []
+            for (imgId, catId), group in instances_per_image_category.items():
+                if group and imgId in image_indices and catId in category_indices:
+                    groups.append((image_indices[imgId], category_indices[catId], len(group)))
+                    instances.extend(group)
+            counts = [n for _, _, n in groups]
+            num_instances = len(instances)
+
+            def column(values, dtype):
+                return np.fromiter(values, dtype=dtype, count=num_instances)
+
+            arrays = {
+                "image_index": np.repeat(
+                    np.array([i for i, _, _ in groups], dtype=np.int64), counts
+                ),
+                "category_index": np.repeat(
+                    np.array([c for _, c, _ in groups], dtype=np.int64), counts
+                ),
+                "id": column((o["id"] for o in instances), np.int64),
+                "score": column(
+                    (o["score"] if is_det else o.get("score", 0.0) for o in instances),
+                    np.float64,
+                ),
+                "area": column((o["area"] for o in instances), np.float64),
+                "is_crowd": column((bool(o.get("iscrowd", 0)) for o in instances), bool),
+                "ignore": column((bool(o.get("ignore", 0)) for o in instances), bool),
+            }
+            if p.iouType == "bbox":
+                arrays["bbox"] = np.array(
+                    [o["bbox"] for o in instances], dtype=np.float64
+                ).reshape(-1, 4)
+            elif p.iouType in self.corner_iou_types:
+                arrays["corners"] = np.array(
+                    [o["points"] for o in instances], dtype=np.float64
+                ).reshape(-1, 8)
+            return arrays
 
         # Call C++ implementation of self.evaluateImgs()
-        self._evalImgs_cpp = self.module.COCOevalEvaluateImages(
+        ious = None
+        if not native_iou:
+            ious = [[self.ious[imgId, catId] for catId in catIds] for imgId in p.imgIds]
+        gt_arrays = convert_instances_to_arrays(self._gts)
+        dt_arrays = convert_instances_to_arrays(self._dts, is_det=True)
+        # kept for analyze_errors()
+        self._instance_arrays = None
+        if p.iouType == "bbox" and p.useCats:
+            self._instance_arrays = (gt_arrays, dt_arrays)
+        self._evalImgs_cpp = self.module.COCOevalEvaluateImageArrays(
             p.areaRng,
             maxDet,
             p.iouThrs,
-            ious,
-            ground_truth_instances,
-            detected_instances,
+            len(p.imgIds),
+            len(p.catIds),
+            bool(p.useCats),
+            gt_arrays,
+            dt_arrays,
+            image_category_ious=ious,
+            num_threads=self.num_threads,
+            iou_type=p.iouType if p.iouType in self.corner_iou_types else "bbox",
+            corner_sigmas=list(p.kpt_oks_sigmas) if p.iouType == "corners" else [],
         )
         self._evalImgs = None
 
@@ -132,20 +189,298 @@ class COCOeval_opt(COCOeval):
         if not hasattr(self, "_evalImgs_cpp"):
             print("Please run evaluate() first")
 
-        self.eval = self.module.COCOevalAccumulate(self._paramsEval, self._evalImgs_cpp)
-
-        # recall is num_iou_thresholds X num_categories X num_area_ranges X num_max_detections
-        self.eval["recall"] = np.array(self.eval["recall"]).reshape(
-            self.eval["counts"][:1] + self.eval["counts"][2:]
+        self.eval = self.module.COCOevalAccumulate(
+            self._paramsEval, self._evalImgs_cpp, num_threads=self.num_threads
         )
 
-        # precision and scores are num_iou_thresholds X num_recall_thresholds X num_categories X
-        # num_area_ranges X num_max_detections
-        self.eval["precision"] = np.array(self.eval["precision"]).reshape(
-            self.eval["counts"]
-        )
-        self.eval["scores"] = np.array(self.eval["scores"]).reshape(self.eval["counts"])
+        # recall is a num_iou_thresholds X num_categories X num_area_ranges X
+        # num_max_detections array, precision and scores are num_iou_thresholds X
+        # num_recall_thresholds X num_categories X num_area_ranges X num_max_detections
+        # arrays, all returned by C++ without any copy
         toc = time.time()
         print(
             "COCOeval_opt.accumulate() finished in {:0.2f} seconds.".format(toc - tic)
         )
+
+    def summarize(self):
+        iouType = self.params.iouType
+        if iouType not in self.corner_iou_types:
+            return super().summarize()
+        # corner results are summarized like bounding box results
+        self.params.iouType = "bbox"
+        try:
+            super().summarize()
+        finally:
+            self.params.iouType = iouType
+
+    def bootstrap(self, num_samples=1000, confidence=0.95, seed=0):
+        """
+        Bootstrap confidence intervals of the summary metrics of summarize() over the images.
+        Every sample draws as many images as evaluated with replacement and recomputes the
+        precision recall curves in C++ from the results of evaluate(), so no image is matched
+        again.  Results do not depend on num_threads.
+
+        Args:
+            num_samples (int): number of image resamples.
+            confidence (float): coverage of the percentile intervals.
+            seed (int): seed of the image draws.
+
+        Returns:
+            dict: "samples" is the num_samples X num_stats array of the sampled metrics (nan if
+                undefined in a sample, and in every sample if params.iouThrs lacks the IoU
+                threshold of the metric, where summarize() reports -1), "lower" and "upper" the
+                interval bounds of every metric in the order of self.stats.
+        """
+        if not hasattr(self, "_evalImgs_cpp"):
+            print("Please run evaluate() first")
+        p = self._paramsEval
+
+        def stat(ap, iouThr=None, areaRng="all", maxDets=100):
+            iou_index = -1
+            if iouThr is not None:
+                try:
+                    iou_index = iou_threshold_index(p.iouThrs, iouThr)
+                except ValueError:
+                    # like summarize(), a threshold that was not evaluated selects nothing
+                    return None
+            return (ap, iou_index, p.areaRngLbl.index(areaRng), p.maxDets.index(maxDets))
+
+        if p.iouType == "keypoints":
+            stats = [
+                stat(ap, iouThr, areaRng, 20)
+                for ap in (True, False)
+                for iouThr, areaRng in (
+                    (None, "all"), (0.5, "all"), (0.75, "all"), (None, "medium"), (None, "large")
+                )
+            ]
+        else:
+            stats = [
+                stat(True, maxDets=p.maxDets[2]),
+                stat(True, iouThr=0.5, maxDets=p.maxDets[2]),
+                stat(True, iouThr=0.75, maxDets=p.maxDets[2]),
+                stat(True, areaRng="small", maxDets=p.maxDets[2]),
+                stat(True, areaRng="medium", maxDets=p.maxDets[2]),
+                stat(True, areaRng="large", maxDets=p.maxDets[2]),
+                stat(False, maxDets=p.maxDets[0]),
+                stat(False, maxDets=p.maxDets[1]),
+                stat(False, maxDets=p.maxDets[2]),
+                stat(False, areaRng="small", maxDets=p.maxDets[2]),
+                stat(False, areaRng="medium", maxDets=p.maxDets[2]),
+                stat(False, areaRng="large", maxDets=p.maxDets[2]),
+            ]
+
+        tic = time.time()
+        selected = [s for s, selection in enumerate(stats) if selection is not None]
+        samples = np.full((max(num_samples, 0), len(stats)), np.nan)
+        samples[:, selected] = self.module.COCOevalBootstrap(
+            p,
+            self._evalImgs_cpp,
+            [stats[s] for s in selected],
+            num_samples,
+            seed=seed,
+            num_threads=self.num_threads,
+        )
+        samples[samples < 0] = np.nan
+        alpha = (1 - confidence) / 2 * 100
+        toc = time.time()
+        print("COCOeval_opt.bootstrap() finished in {:0.2f} seconds.".format(toc - tic))
+        return {
+            "samples": samples,
+            "lower": np.nanpercentile(samples, alpha, axis=0),
+            "upper": np.nanpercentile(samples, 100 - alpha, axis=0),
+        }
+
+    def operating_points(self, iouThr=0.5, areaRng="all", maxDets=100):
+        """
+        Per category precision, recall and F1 score of the detections above every confidence
+        threshold, from the results of evaluate() in one pass, e.g. to pick the confidence
+        thresholds of a deployed model without evaluating each candidate.  iouThr must be one of
+        params.iouThrs.
+
+        Returns:
+            dict: the arrays "best_score", "best_precision", "best_recall", "best_f1" and
+                "num_ground_truth" with one entry per category of params.catIds (-1 without ground
+                truth or detections), and the lists of per category curve arrays "scores",
+                "precision", "recall" and "f1" with one point per distinct detection score, in
+                decreasing order of scores.
+        """
+        if not hasattr(self, "_evalImgs_cpp"):
+            print("Please run evaluate() first")
+        p = self._paramsEval
+        curves = self.module.COCOevalOperatingCurves(
+            p,
+            self._evalImgs_cpp,
+            iou_threshold_index=iou_threshold_index(p.iouThrs, iouThr),
+            area_range_index=p.areaRngLbl.index(areaRng),
+            max_detections_index=p.maxDets.index(maxDets),
+            num_threads=self.num_threads,
+        )
+        curves["catIds"] = list(p.catIds) if p.useCats else [-1]
+        return curves
+
+    def analyze_errors(self, iouThr=0.5, bgThr=0.1, areaRng="all"):
+        """
+        TIDE style breakdown of the errors of bounding box results into classification,
+        localization, both, duplicate, background and missed errors, computed in C++ from the
+        matches of evaluate().  Only the false positives are compared with the ground truth of
+        other categories, so this takes a fraction of the evaluation time.  iouThr must be one of
+        params.iouThrs, and bgThr must lie strictly between 0 and iouThr.
+
+        Returns:
+            dict: "error_types" names the error types, "counts" and "fixed_ap" are
+                num_categories X num_error_types arrays of the number of errors and the AP with
+                the errors of each type fixed, and "ap" the AP of each category at iouThr (-1
+                without ground truth).  "dAP" is the mean AP gain of fixing each type over the
+                categories with ground truth.
+        """
+        if getattr(self, "_instance_arrays", None) is None:
+            print("Please run evaluate() with iouType bbox and useCats first")
+            return None
+        p = self._paramsEval
+        gt_arrays, dt_arrays = self._instance_arrays
+        prepared_gt = self.module.COCOevalPrepareGroundTruth(
+            p.areaRng, len(p.imgIds), len(p.catIds), True, gt_arrays,
+            num_threads=self.num_threads,
+        )
+        errors = self.module.COCOevalAnalyzeErrors(
+            prepared_gt,
+            dt_arrays,
+            self._evalImgs_cpp,
+            p,
+            iou_threshold_index=iou_threshold_index(p.iouThrs, iouThr),
+            background_iou=bgThr,
+            area_range_index=p.areaRngLbl.index(areaRng),
+            num_threads=self.num_threads,
+        )
+        valid = errors["ap"] > -1
+        errors["dAP"] = (errors["fixed_ap"][valid] - errors["ap"][valid, None]).mean(axis=0)
+        errors["catIds"] = list(p.catIds)
+        return errors
+
+
+class COCOevalStream(COCOeval_opt):
+    """
+    Bounding box COCOeval_opt that is fed detections batch by batch with add_detections(), e.g.
+    while a model runs inference, instead of a COCO object of all detections.  The detections of
+    each batch are matched against the ground truth in C++ right away, so that only compact per
+    image results rather than all detections are kept, and evaluate() only gathers them.  The
+    params must not be changed after construction.
+
+    Args:
+        cocoGt (COCO): ground truth annotations.
+        num_threads (int): same as COCOeval_opt.
+        prepared_gt (PreparedGroundTruth): the prepared_gt of a previous COCOevalStream of the
+            same cocoGt, which is reused rather than prepared again. Default to None.
+    """
+    def __init__(self, cocoGt, num_threads=1, prepared_gt=None):
+        super().__init__(cocoGt, iouType="bbox", num_threads=num_threads)
+        p = self.params
+        p.imgIds = list(np.unique(p.imgIds))
+        p.catIds = list(np.unique(p.catIds))
+        p.maxDets = sorted(p.maxDets)
+        self._img_ids = np.asarray(p.imgIds, dtype=np.int64)
+        self._cat_ids = np.asarray(p.catIds, dtype=np.int64)
+
+        if prepared_gt is None:
+            prepared_gt = self.prepare_ground_truth(cocoGt)
+        elif (
+            prepared_gt.num_images != len(p.imgIds)
+            or prepared_gt.num_categories != len(p.catIds)
+            or prepared_gt.use_categories != bool(p.useCats)
+            or [list(r) for r in prepared_gt.area_ranges] != [list(r) for r in p.areaRng]
+        ):
+            raise ValueError("prepared_gt was prepared with different params")
+        self.prepared_gt = prepared_gt
+        self._evaluator = self.module.COCOevalIncrementalEvaluator(
+            prepared_gt, p.maxDets[-1], p.iouThrs, num_threads=num_threads
+        )
+
+    def prepare_ground_truth(self, cocoGt):
+        """
+        Group the ground truth instances and compute everything about them needed for evaluation
+        once, which can be reused by later COCOevalStream objects.
+        """
+        p = self.params
+        gts = cocoGt.loadAnns(cocoGt.getAnnIds(imgIds=p.imgIds, catIds=p.catIds))
+        # crowd instances are ignored like in COCOeval._prepare()
+        gts_arrays = {
+            "image_index": self._indices([gt["image_id"] for gt in gts], self._img_ids),
+            "category_index": self._indices([gt["category_id"] for gt in gts], self._cat_ids),
+            "id": np.array([gt["id"] for gt in gts], dtype=np.int64),
+            "area": np.array([gt["area"] for gt in gts], dtype=np.float64),
+            "is_crowd": np.array([bool(gt.get("iscrowd", 0)) for gt in gts], dtype=bool),
+            "ignore": np.array([bool(gt.get("iscrowd", 0)) for gt in gts], dtype=bool),
+            "bbox": np.array([gt["bbox"] for gt in gts], dtype=np.float64).reshape(-1, 4),
+        }
+        return self.module.COCOevalPrepareGroundTruth(
+            p.areaRng,
+            len(p.imgIds),
+            len(p.catIds),
+            bool(p.useCats),
+            gts_arrays,
+            num_threads=self.num_threads,
+        )
+
+    @staticmethod
+    def _indices(ids, all_ids):
+        ids = np.asarray(ids, dtype=np.int64).reshape(-1)
+        indices = np.searchsorted(all_ids, ids)
+        if np.any(indices >= len(all_ids)) or np.any(
+            all_ids[np.minimum(indices, len(all_ids) - 1)] != ids
+        ):
+            raise ValueError("Results do not correspond to current coco set")
+        return indices
+
+    def add_detections(self, image_ids, category_ids, bboxes, scores):
+        """
+        Evaluate a batch of detections, which must hold all detections of its images.
+
+        Args:
+            image_ids, category_ids, scores: length N sequences of the detections.
+            bboxes: N x 4 array of the detections in COCO [x, y, width, height] format.
+        """
+        bboxes = np.asarray(bboxes, dtype=np.float64).reshape(-1, 4)
+        first_id = self.num_detections + 1
+        # same ids and areas as COCO.loadRes()
+        self._evaluator.add_detections({
+            "image_index": self._indices(image_ids, self._img_ids),
+            "category_index": self._indices(category_ids, self._cat_ids),
+            "id": np.arange(first_id, first_id + len(bboxes), dtype=np.int64),
+            "score": np.asarray(scores, dtype=np.float64).reshape(-1),
+            "area": bboxes[:, 2] * bboxes[:, 3],
+            "bbox": bboxes,
+        })
+
+    @property
+    def num_detections(self):
+        return self._evaluator.num_detections
+
+    def serialize(self):
+        """
+        Return the per image results of all detections added so far as compact bytes, e.g. to
+        send the results of the image shard of one distributed rank to another rank.
+        """
+        return self._evaluator.serialize()
+
+    def merge(self, partial):
+        """
+        Add the results of serialize() of a COCOevalStream with the same ground truth and params.
+        Images whose results are already known, e.g. images of a padded distributed shard, keep
+        their results.
+        """
+        self._evaluator.merge(partial)
+
+    def evaluate(self):
+        """
+        Gather the per image evaluation results of all detections added so far into
+        self._evalImgs_cpp, like COCOeval_opt.evaluate().  Images without added detections are
+        evaluated as having none.
+        :return: None
+        """
+        tic = time.time()
+        print("Running per image evaluation...")
+        self._evalImgs_cpp = self._evaluator.evaluations()
+        self._evalImgs = None
+        self._paramsEval = copy.deepcopy(self.params)
+        toc = time.time()
+        print("COCOevalStream.evaluate() finished in {:0.2f} seconds.".format(toc - tic))
@@ -8,7 +8,7 @@ import sys
 import time
 from typing import List
 
-__all__ = ["JitOp", "FastCOCOEvalOp"]
+__all__ = ["JitOp", "FastCOCOEvalOp", "FastVOCEvalOp"]
 
 
 class JitOp:
@@ -136,3 +136,24 @@ class FastCOCOEvalOp(JitOp):
 
     def include_dirs(self):
         return [os.path.join("yolox", "layers", "cocoeval")]
+
+
+class FastVOCEvalOp(JitOp):
+
+    def __init__(self, name="fast_voceval"):
+        super().__init__(name=name)
+
+    def absolute_name(self):
+        return f'yolox.layers.{self.name}'
+
+    def sources(self):
+        sources = glob.glob(os.path.join("yolox", "layers", "voceval", "*.cpp"))
+        if not sources:  # source will be empty list if the so file is removed after install
+            # use abosolute path to compile
+            import yolox
+            code_path = os.path.join(yolox.__path__[0], "layers", "voceval", "*.cpp")
+            sources = glob.glob(code_path)
+        return sources
+
+    def include_dirs(self):
+        return [os.path.join("yolox", "layers", "voceval")]
@@ -0,0 +1,603 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#include "voceval.h"
+#include "../common/array_utils.h"
+#include "../common/eval_utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace pybind11::literals;
+
+namespace VOCeval {
+
+using EvalCommon::MoveToArray;
+using EvalCommon::ParallelFor;
+using EvalCommon::ReadFile;
+using EvalCommon::ReadValues;
+using EvalCommon::ResolveNumThreads;
+using EvalCommon::WriteValues;
+
+namespace {
+
+// Replace the predefined XML entities of text and strip surrounding
+// whitespace
+std::string DecodeText(const std::string& text) {
+  static const char* const kEntities[][2] = {
+      {"&lt;", "<"},
+      {"&gt;", ">"},
+      {"&amp;", "&"},
+      {"&apos;", "'"},
+      {"&quot;", "\""}};
+  std::string decoded;
+  for (size_t i = 0; i < text.size();) {
+    bool replaced = false;
+    if (text[i] == '&') {
+      for (const auto& entity : kEntities) {
+        const size_t length = std::strlen(entity[0]);
+        if (text.compare(i, length, entity[0]) == 0) {
+          decoded += entity[1];
+          i += length;
+          replaced = true;
+          break;
+        }
+      }
+    }
+    if (!replaced) {
+      decoded.push_back(text[i++]);
+    }
+  }
+  const size_t begin = decoded.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  const size_t end = decoded.find_last_not_of(" \t\r\n");
+  return decoded.substr(begin, end - begin + 1);
+}
+
+struct ParsedObject {
+  std::string name;
+  int difficult = 0;
+  double box[4] = {0., 0., 0., 0.};
+};
+
+// Parse the objects of a VOC annotation file.  Rather than building a
+// document tree, the tags are scanned while keeping the path of open
+// elements, and only the text of annotation/object/{name,difficult} and
+// annotation/object/bndbox/{xmin,ymin,xmax,ymax} is read, so that the
+// nested part boxes of some VOC objects are ignored.  Comments, processing
+// instructions and attributes are skipped
+std::vector<ParsedObject> ParseAnnotationFile(const std::string& path) {
+  static const char* const kBoxTags[4] = {"xmin", "ymin", "xmax", "ymax"};
+  const std::string text = ReadFile(path);
+  auto fail = [&](const std::string& message) {
+    throw std::runtime_error(path + ": " + message);
+  };
+
+  std::vector<ParsedObject> objects;
+  std::vector<std::string> open_elements;
+  size_t text_begin = 0;
+  size_t position = 0;
+  while ((position = text.find('<', position)) != std::string::npos) {
+    const size_t text_end = position;
+    if (text.compare(position, 4, "<!--") == 0) {
+      position = text.find("-->", position);
+      if (position == std::string::npos) {
+        fail("unterminated comment");
+      }
+      position += 3;
+      continue;
+    }
+    const size_t tag_end = text.find('>', position);
+    if (tag_end == std::string::npos) {
+      fail("unterminated tag");
+    }
+    const char kind = position + 1 < tag_end ? text[position + 1] : '>';
+    if (kind == '?' || kind == '!') {
+      position = tag_end + 1;
+      continue;
+    }
+
+    const bool closing = kind == '/';
+    const size_t name_begin = position + (closing ? 2 : 1);
+    const size_t name_end = text.find_first_of(" \t\r\n/>", name_begin);
+    const std::string name = text.substr(name_begin, name_end - name_begin);
+    if (!closing) {
+      // An empty <object/> has neither a name nor a box, so it is skipped
+      const bool empty_element = text[tag_end - 1] == '/';
+      if (open_elements.size() == 1 && name == "object" && !empty_element) {
+        objects.emplace_back();
+      }
+      if (!empty_element) {
+        open_elements.push_back(name);
+      }
+      text_begin = tag_end + 1;
+      position = tag_end + 1;
+      continue;
+    }
+
+    if (open_elements.empty() || open_elements.back() != name) {
+      fail("unexpected closing tag " + name);
+    }
+    const size_t depth = open_elements.size();
+    if (depth >= 3 && open_elements[1] == "object") {
+      const std::string value =
+          DecodeText(text.substr(text_begin, text_end - text_begin));
+      ParsedObject& object = objects.back();
+      if (depth == 3 && name == "name") {
+        object.name = value;
+      } else if (depth == 3 && name == "difficult") {
+        object.difficult = std::atoi(value.c_str());
+      } else if (depth == 4 && open_elements[2] == "bndbox") {
+        for (auto k = 0; k < 4; ++k) {
+          if (name == kBoxTags[k]) {
+            // Truncate like the int(float(...)) of the dataset loader
+            object.box[k] = static_cast<double>(
+                static_cast<int64_t>(std::strtod(value.c_str(), nullptr)));
+          }
+        }
+      }
+    }
+    open_elements.pop_back();
+    position = tag_end + 1;
+  }
+  if (!open_elements.empty()) {
+    fail("unterminated element " + open_elements.back());
+  }
+  return objects;
+}
+
+constexpr uint32_t kCacheMagic = 0x41565859; // "YXVA"
+constexpr uint32_t kCacheVersion = 1;
+
+void WriteStrings(const std::vector<std::string>& strings, std::string* buffer) {
+  for (const std::string& string : strings) {
+    const int64_t length = string.size();
+    WriteValues(&length, 1, buffer);
+    buffer->append(string);
+  }
+}
+
+bool ReadStrings(
+    const std::string& buffer,
+    size_t count,
+    size_t* position,
+    std::vector<std::string>* strings) {
+  strings->clear();
+  for (size_t i = 0; i < count; ++i) {
+    int64_t length;
+    if (!ReadValues(buffer, 1, position, &length) || length < 0 ||
+        static_cast<uint64_t>(length) > buffer.size() - *position) {
+      return false;
+    }
+    strings->push_back(buffer.substr(*position, length));
+    *position += length;
+  }
+  return true;
+}
+
+// The cache format is the magic number and version, the int64_t values
+// num_images, num_classes and num_objects, the length prefixed image and
+// class names, and the columns of the annotations
+void SaveCache(const VOCAnnotations& annotations, const std::string& path) {
+  const uint32_t magic[2] = {kCacheMagic, kCacheVersion};
+  const int64_t sizes[3] = {annotations.num_images(),
+                            static_cast<int64_t>(
+                                annotations.class_names.size()),
+                            annotations.num_objects()};
+  std::string buffer;
+  WriteValues(magic, 2, &buffer);
+  WriteValues(sizes, 3, &buffer);
+  WriteStrings(annotations.image_names, &buffer);
+  WriteStrings(annotations.class_names, &buffer);
+  WriteValues(
+      annotations.image_offsets.data(),
+      annotations.image_offsets.size(),
+      &buffer);
+  WriteValues(annotations.labels.data(), annotations.labels.size(), &buffer);
+  WriteValues(
+      annotations.difficult.data(), annotations.difficult.size(), &buffer);
+  WriteValues(annotations.boxes.data(), annotations.boxes.size(), &buffer);
+
+  // Write to a temporary file first, so that an interrupted write never
+  // leaves a truncated cache behind
+  const std::string temporary_path = path + ".tmp";
+  FILE* file = std::fopen(temporary_path.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("cannot write " + temporary_path);
+  }
+  const bool written =
+      std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  if (std::fclose(file) != 0 || !written ||
+      std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    throw std::runtime_error("cannot write " + path);
+  }
+}
+
+// Read the annotation cache at path into *annotations, or return false if it
+// does not exist or is not a valid cache file
+bool LoadCache(const std::string& path, VOCAnnotations* annotations) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::fclose(file);
+  const std::string buffer = ReadFile(path);
+
+  size_t position = 0;
+  uint32_t magic[2];
+  int64_t sizes[3];
+  if (!ReadValues(buffer, 2, &position, magic) || magic[0] != kCacheMagic ||
+      magic[1] != kCacheVersion || !ReadValues(buffer, 3, &position, sizes) ||
+      sizes[0] < 0 || sizes[1] < 0 || sizes[2] < 0) {
+    return false;
+  }
+  const int64_t num_images = sizes[0];
+  const int64_t num_objects = sizes[2];
+  if (!ReadStrings(buffer, num_images, &position, &annotations->image_names) ||
+      !ReadStrings(buffer, sizes[1], &position, &annotations->class_names) ||
+      !ReadValues(
+          buffer, num_images + 1, &position, &annotations->image_offsets) ||
+      !ReadValues(buffer, num_objects, &position, &annotations->labels) ||
+      !ReadValues(buffer, num_objects, &position, &annotations->difficult) ||
+      !ReadValues(buffer, 4 * num_objects, &position, &annotations->boxes)) {
+    return false;
+  }
+  return position == buffer.size() &&
+      annotations->image_offsets.front() == 0 &&
+      annotations->image_offsets.back() == num_objects;
+}
+
+// Average precision of a precision recall curve, see voc_ap() in
+// yolox/evaluators/voc_eval.py
+double AveragePrecision(
+    const std::vector<double>& recalls,
+    const std::vector<double>& precisions,
+    bool use_07_metric) {
+  const int64_t num_points = recalls.size();
+  if (use_07_metric) {
+    // 11 point metric, where the recall thresholds are computed like
+    // np.arange(0.0, 1.1, 0.1)
+    double average_precision = 0.;
+    for (auto t = 0; t < 11; ++t) {
+      const double threshold = t * 0.1;
+      double precision = 0.;
+      for (int64_t i = 0; i < num_points; ++i) {
+        if (recalls[i] >= threshold) {
+          precision = std::max(precision, precisions[i]);
+        }
+      }
+      average_precision += precision / 11.;
+    }
+    return average_precision;
+  }
+
+  // Area under the precision envelope, with sentinel values at both ends
+  std::vector<double> envelope_recalls(num_points + 2);
+  std::vector<double> envelope(num_points + 2);
+  envelope_recalls.front() = 0.;
+  envelope_recalls.back() = 1.;
+  envelope.front() = 0.;
+  envelope.back() = 0.;
+  std::copy(recalls.begin(), recalls.end(), envelope_recalls.begin() + 1);
+  std::copy(precisions.begin(), precisions.end(), envelope.begin() + 1);
+  for (int64_t i = num_points + 1; i > 0; --i) {
+    envelope[i - 1] = std::max(envelope[i - 1], envelope[i]);
+  }
+  double average_precision = 0.;
+  for (int64_t i = 0; i < num_points + 1; ++i) {
+    if (envelope_recalls[i + 1] != envelope_recalls[i]) {
+      average_precision +=
+          (envelope_recalls[i + 1] - envelope_recalls[i]) * envelope[i + 1];
+    }
+  }
+  return average_precision;
+}
+
+// Overlap of two boxes with the inclusive pixel convention of the VOC
+// devkit, where a box covers xmax - xmin + 1 pixels horizontally
+double BoxOverlap(const double* box, const double* other) {
+  const double width =
+      std::max(std::min(box[2], other[2]) - std::max(box[0], other[0]) + 1., 0.);
+  const double height =
+      std::max(std::min(box[3], other[3]) - std::max(box[1], other[1]) + 1., 0.);
+  const double intersection = width * height;
+  const double area = (box[2] - box[0] + 1.) * (box[3] - box[1] + 1.);
+  const double other_area =
+      (other[2] - other[0] + 1.) * (other[3] - other[1] + 1.);
+  return intersection / (area + other_area - intersection);
+}
+
+// Evaluate the detections of class k for all IOU thresholds
+void EvaluateClass(
+    const VOCAnnotations& annotations,
+    const DetectionColumns& detections,
+    const std::vector<double>& iou_thresholds,
+    bool use_07_metric,
+    int k,
+    VOCResults* results) {
+  const int num_classes = annotations.class_names.size();
+  const int64_t num_images = annotations.num_images();
+
+  // Group the ground truth objects of class k by image
+  std::vector<int64_t> image_offsets(num_images + 1, 0);
+  std::vector<int64_t> objects;
+  int64_t num_positives = 0;
+  for (int64_t i = 0; i < num_images; ++i) {
+    for (int64_t j = annotations.image_offsets[i];
+         j < annotations.image_offsets[i + 1];
+         ++j) {
+      if (annotations.labels[j] == k) {
+        objects.push_back(j);
+        num_positives += annotations.difficult[j] == 0;
+      }
+    }
+    image_offsets[i + 1] = objects.size();
+  }
+  results->num_positives[k] = num_positives;
+
+  std::vector<int64_t> sorted_detections;
+  for (int64_t d = 0; d < detections.size; ++d) {
+    if (detections.labels[d] == k) {
+      sorted_detections.push_back(d);
+    }
+  }
+  std::stable_sort(
+      sorted_detections.begin(),
+      sorted_detections.end(),
+      [&detections](int64_t j1, int64_t j2) {
+        return detections.scores[j1] > detections.scores[j2];
+      });
+  const int64_t num_detections = sorted_detections.size();
+  if (num_detections == 0) {
+    // voc_eval() reports no AP for classes without detections
+    return;
+  }
+
+  // The best overlapping ground truth of a detection does not depend on the
+  // IOU threshold, so it is found once for all thresholds
+  std::vector<double> max_overlaps(
+      num_detections, -std::numeric_limits<double>::infinity());
+  std::vector<int64_t> best_objects(num_detections, -1);
+  for (int64_t d = 0; d < num_detections; ++d) {
+    const int64_t detection = sorted_detections[d];
+    const int64_t image = detections.image_indices[detection];
+    for (int64_t j = image_offsets[image]; j < image_offsets[image + 1]; ++j) {
+      const double overlap = BoxOverlap(
+          &detections.bboxes[4 * detection],
+          &annotations.boxes[4 * objects[j]]);
+      if (overlap > max_overlaps[d]) {
+        max_overlaps[d] = overlap;
+        best_objects[d] = j;
+      }
+    }
+  }
+
+  std::vector<uint8_t> matched(objects.size());
+  for (size_t t = 0; t < iou_thresholds.size(); ++t) {
+    std::fill(matched.begin(), matched.end(), 0);
+    std::vector<double>& recalls = results->recalls[t * num_classes + k];
+    std::vector<double>& precisions = results->precisions[t * num_classes + k];
+    recalls.resize(num_detections);
+    precisions.resize(num_detections);
+    double true_positives = 0.;
+    double false_positives = 0.;
+    for (int64_t d = 0; d < num_detections; ++d) {
+      if (max_overlaps[d] > iou_thresholds[t]) {
+        const int64_t j = best_objects[d];
+        if (annotations.difficult[objects[j]] == 0) {
+          if (matched[j] == 0) {
+            true_positives += 1.;
+            matched[j] = 1;
+          } else {
+            false_positives += 1.;
+          }
+        }
+      } else {
+        false_positives += 1.;
+      }
+      recalls[d] = true_positives / static_cast<double>(num_positives);
+      // Avoid dividing by zero when the first detection matches a difficult
+      // ground truth
+      precisions[d] = true_positives /
+          std::max(true_positives + false_positives,
+                   std::numeric_limits<double>::epsilon());
+    }
+    results->average_precisions[t * num_classes + k] =
+        AveragePrecision(recalls, precisions, use_07_metric);
+  }
+}
+
+} // namespace
+
+VOCAnnotations LoadAnnotations(
+    const std::vector<std::string>& image_names,
+    const std::vector<std::string>& annotation_paths,
+    const std::vector<std::string>& class_names,
+    const std::string& cache_path,
+    int num_threads) {
+  if (image_names.size() != annotation_paths.size()) {
+    throw std::invalid_argument(
+        "got " + std::to_string(annotation_paths.size()) +
+        " annotation paths for " + std::to_string(image_names.size()) +
+        " images");
+  }
+
+  VOCAnnotations annotations;
+  if (!cache_path.empty() && LoadCache(cache_path, &annotations) &&
+      annotations.image_names == image_names &&
+      annotations.class_names == class_names) {
+    return annotations;
+  }
+
+  const int64_t num_images = image_names.size();
+  std::vector<std::vector<ParsedObject>> image_objects(num_images);
+  ParallelFor(
+      num_images,
+      ResolveNumThreads(num_threads, num_images),
+      [&](int /* worker_index */, int64_t i) {
+        image_objects[i] = ParseAnnotationFile(annotation_paths[i]);
+      });
+
+  std::unordered_map<std::string, int> class_indices;
+  for (size_t k = 0; k < class_names.size(); ++k) {
+    class_indices.emplace(class_names[k], k);
+  }
+  annotations = VOCAnnotations();
+  annotations.image_names = image_names;
+  annotations.class_names = class_names;
+  annotations.image_offsets.reserve(num_images + 1);
+  annotations.image_offsets.push_back(0);
+  for (const std::vector<ParsedObject>& objects : image_objects) {
+    for (const ParsedObject& object : objects) {
+      const auto class_index = class_indices.find(object.name);
+      if (class_index == class_indices.end()) {
+        continue;
+      }
+      annotations.labels.push_back(class_index->second);
+      annotations.difficult.push_back(object.difficult != 0);
+      annotations.boxes.insert(
+          annotations.boxes.end(), object.box, object.box + 4);
+    }
+    annotations.image_offsets.push_back(annotations.labels.size());
+  }
+
+  if (!cache_path.empty()) {
+    SaveCache(annotations, cache_path);
+  }
+  return annotations;
+}
+
+VOCResults Evaluate(
+    const VOCAnnotations& annotations,
+    const DetectionColumns& detections,
+    const std::vector<double>& iou_thresholds,
+    bool use_07_metric,
+    int num_threads) {
+  const int num_classes = annotations.class_names.size();
+  for (int64_t d = 0; d < detections.size; ++d) {
+    if (detections.image_indices[d] < 0 ||
+        detections.image_indices[d] >= annotations.num_images()) {
+      throw std::out_of_range(
+          "detection image index " +
+          std::to_string(detections.image_indices[d]) + " out of range");
+    }
+    if (detections.labels[d] < 0 || detections.labels[d] >= num_classes) {
+      throw std::out_of_range(
+          "detection label " + std::to_string(detections.labels[d]) +
+          " out of range");
+    }
+  }
+
+  const int64_t num_results = iou_thresholds.size() * num_classes;
+  VOCResults results;
+  results.average_precisions.resize(num_results, 0.);
+  results.num_positives.resize(num_classes, 0);
+  results.recalls.resize(num_results);
+  results.precisions.resize(num_results);
+  ParallelFor(
+      num_classes,
+      ResolveNumThreads(num_threads, num_classes),
+      [&](int /* worker_index */, int64_t k) {
+        EvaluateClass(
+            annotations,
+            detections,
+            iou_thresholds,
+            use_07_metric,
+            k,
+            &results);
+      });
+  return results;
+}
+
+namespace {
+
+// Cast the entry name of arrays to a numpy array of the expected type and
+// check that it holds num_values values
+template <typename Array>
+const typename Array::value_type* ReadDetectionArray(
+    const py::dict& arrays,
+    const char* name,
+    int64_t num_values,
+    Array* array) {
+  if (!arrays.contains(name)) {
+    throw std::invalid_argument(
+        std::string("missing detection array ") + name);
+  }
+  *array = arrays[name].template cast<Array>();
+  if (array->size() != num_values) {
+    throw std::invalid_argument(
+        std::string("detection array ") + name + " has " +
+        std::to_string(array->size()) + " values, expected " +
+        std::to_string(num_values));
+  }
+  return array->data();
+}
+
+} // namespace
+
+py::dict EvaluateArrays(
+    const VOCAnnotations& annotations,
+    const py::dict& detection_arrays,
+    const std::vector<double>& iou_thresholds,
+    bool use_07_metric,
+    int num_threads) {
+  using IndexArray =
+      py::array_t<int64_t, py::array::c_style | py::array::forcecast>;
+  using ValueArray =
+      py::array_t<double, py::array::c_style | py::array::forcecast>;
+
+  if (!detection_arrays.contains("image_index")) {
+    throw std::invalid_argument("missing detection array image_index");
+  }
+  IndexArray image_indices, labels;
+  ValueArray scores, bboxes;
+  DetectionColumns detections;
+  detections.size = py::len(detection_arrays["image_index"]);
+  detections.image_indices = ReadDetectionArray(
+      detection_arrays, "image_index", detections.size, &image_indices);
+  detections.labels = ReadDetectionArray(
+      detection_arrays, "label", detections.size, &labels);
+  detections.scores = ReadDetectionArray(
+      detection_arrays, "score", detections.size, &scores);
+  detections.bboxes = ReadDetectionArray(
+      detection_arrays, "bbox", 4 * detections.size, &bboxes);
+
+  VOCResults results;
+  {
+    py::gil_scoped_release release;
+    results = Evaluate(
+        annotations, detections, iou_thresholds, use_07_metric, num_threads);
+  }
+
+  const int num_iou_thresholds = iou_thresholds.size();
+  const int num_classes = annotations.class_names.size();
+  py::list recalls, precisions;
+  for (auto t = 0; t < num_iou_thresholds; ++t) {
+    py::list threshold_recalls, threshold_precisions;
+    for (auto k = 0; k < num_classes; ++k) {
+      std::vector<double>& recall = results.recalls[t * num_classes + k];
+      std::vector<double>& precision = results.precisions[t * num_classes + k];
+      const py::ssize_t size = recall.size();
+      threshold_recalls.append(MoveToArray(std::move(recall), {size}));
+      threshold_precisions.append(MoveToArray(std::move(precision), {size}));
+    }
+    recalls.append(threshold_recalls);
+    precisions.append(threshold_precisions);
+  }
+  return py::dict(
+      "ap"_a = MoveToArray(
+          std::move(results.average_precisions),
+          {num_iou_thresholds, num_classes}),
+      "num_positives"_a =
+          MoveToArray(std::move(results.num_positives), {num_classes}),
+      "recall"_a = recalls,
+      "precision"_a = precisions);
+}
+
+} // namespace VOCeval
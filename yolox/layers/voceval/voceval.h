@@ -0,0 +1,124 @@
+// Copyright (c) Megvii Inc. All rights reserved.
+#pragma once
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace py = pybind11;
+
+namespace VOCeval {
+
+// Ground truth objects of a VOC image set in columnar form.  The objects of
+// image i are [image_offsets[i], image_offsets[i + 1]), labels index
+// class_names, and boxes holds xmin, ymin, xmax, ymax of every object in the
+// pixel coordinates of the annotation files
+struct VOCAnnotations {
+  std::vector<std::string> image_names;
+  std::vector<std::string> class_names;
+  std::vector<int64_t> image_offsets;
+  std::vector<int32_t> labels;
+  std::vector<uint8_t> difficult;
+  std::vector<double> boxes;
+
+  int64_t num_images() const {
+    return image_names.size();
+  }
+
+  int64_t num_objects() const {
+    return labels.size();
+  }
+};
+
+// Parse the VOC XML annotation file of every image in parallel.  Objects
+// whose name is not in class_names are dropped, since no detection can match
+// them.  If cache_path is not empty, the annotations are read from that
+// binary cache file when it holds the same image and class names, and
+// written to it otherwise, so repeated evaluations skip the XML parsing
+VOCAnnotations LoadAnnotations(
+    const std::vector<std::string>& image_names,
+    const std::vector<std::string>& annotation_paths,
+    const std::vector<std::string>& class_names,
+    const std::string& cache_path,
+    int num_threads = 1);
+
+// Detections in columnar form.  Detection d belongs to image
+// image_indices[d] and class labels[d], and its box is
+// bboxes[4 * d, 4 * d + 4) in the coordinates of the annotations
+struct DetectionColumns {
+  int64_t size = 0;
+  const int64_t* image_indices = nullptr;
+  const int64_t* labels = nullptr;
+  const double* scores = nullptr;
+  const double* bboxes = nullptr;
+};
+
+// Results of Evaluate() for T IOU thresholds and K classes.
+// average_precisions is T x K, and recalls and precisions hold the T x K
+// curves over the detections of each class sorted by decreasing score
+struct VOCResults {
+  std::vector<double> average_precisions;
+  std::vector<int64_t> num_positives;
+  std::vector<std::vector<double>> recalls;
+  std::vector<std::vector<double>> precisions;
+};
+
+// Compute the per class VOC average precision of the detections for every
+// IOU threshold, like voc_eval() in yolox/evaluators/voc_eval.py.  The
+// classes are evaluated in parallel, and the overlaps of each detection are
+// computed once and reused for all thresholds.  use_07_metric selects the
+// 11 point interpolated AP of VOC2007 instead of the area under the
+// precision envelope used since VOC2010
+VOCResults Evaluate(
+    const VOCAnnotations& annotations,
+    const DetectionColumns& detections,
+    const std::vector<double>& iou_thresholds,
+    bool use_07_metric,
+    int num_threads = 1);
+
+// Python entry point of Evaluate() for detections given as a dict of equally
+// long 1-D numpy arrays "image_index", "label" and "score" plus an N x 4
+// array "bbox".  Returns a dict with the T x K array "ap", the K array
+// "num_positives", and nested T x K lists of arrays "recall" and
+// "precision".  The GIL is released once the arrays are read
+py::dict EvaluateArrays(
+    const VOCAnnotations& annotations,
+    const py::dict& detection_arrays,
+    const std::vector<double>& iou_thresholds,
+    bool use_07_metric,
+    int num_threads = 1);
+
+} // namespace VOCeval
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    m.def(
+        "VOCevalLoadAnnotations",
+        &VOCeval::LoadAnnotations,
+        "VOCeval::LoadAnnotations",
+        pybind11::arg("image_names"),
+        pybind11::arg("annotation_paths"),
+        pybind11::arg("class_names"),
+        pybind11::arg("cache_path") = "",
+        pybind11::arg("num_threads") = 1,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def(
+        "VOCevalEvaluate",
+        &VOCeval::EvaluateArrays,
+        "VOCeval::Evaluate with detections given as numpy arrays",
+        pybind11::arg("annotations"),
+        pybind11::arg("detection_arrays"),
+        pybind11::arg("iou_thresholds"),
+        pybind11::arg("use_07_metric") = false,
+        pybind11::arg("num_threads") = 1);
+    pybind11::class_<VOCeval::VOCAnnotations>(m, "VOCAnnotations")
+        .def_readonly("image_names", &VOCeval::VOCAnnotations::image_names)
+        .def_readonly("class_names", &VOCeval::VOCAnnotations::class_names)
+        .def_property_readonly(
+            "num_images", &VOCeval::VOCAnnotations::num_images)
+        .def_property_readonly(
+            "num_objects", &VOCeval::VOCAnnotations::num_objects);
+}